@@ -0,0 +1,135 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * cache所用的哈希表和原来的trie的对比。
+ * 用法：cache_bench <names>
+ * 生成names个形如www.12345678.abcexample.com的随机域名，分别插入trie和哈希表，
+ * 再按随机顺序逐个查找，输出堆内存的增量和平均查找时间。
+ * 堆内存用glibc的mallinfo2()统计，其他libc上只输出查找时间。
+ */
+
+#define _GNU_SOURCE
+
+#include "model/hash_table.h"
+#include "model/trie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define BENCH_NAME_SIZE 64
+
+static const char *const bench_tlds[] = { "com", "net", "org", "cn", "io" };
+
+static double __now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t __heap_size(void)
+{
+#ifdef __GLIBC__
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static void __report(const char *what, size_t names, size_t heap,
+		     double seconds, size_t hits)
+{
+	printf("%s: %.1f MB (%.0f B/name), lookup %.0f ns, hits %zu\n", what,
+	       heap / 1e6, (double)heap / names, seconds / names * 1e9, hits);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <names>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	size_t num = strtoul(argv[1], NULL, 10);
+	if (num == 0) {
+		fprintf(stderr, "Bad number of names.\n");
+		return EXIT_FAILURE;
+	}
+
+	char(*names)[BENCH_NAME_SIZE] = malloc(num * BENCH_NAME_SIZE);
+	size_t *order = (size_t *)malloc(num * sizeof(size_t));
+	srand(1);
+	for (size_t i = 0; i < num; i++)
+		snprintf(names[i], BENCH_NAME_SIZE, "%s%d.%c%c%cexample.%s",
+			 i % 3 ? "www." : "api.", rand() % 100000000,
+			 'a' + rand() % 26, 'a' + rand() % 26,
+			 'a' + rand() % 26,
+			 bench_tlds[i % (sizeof(bench_tlds) /
+					 sizeof(bench_tlds[0]))]);
+	for (size_t i = 0; i < num; i++)
+		order[i] = (size_t)rand() % num;
+
+	int value = 1;
+	size_t hits = 0;
+
+	size_t heap = __heap_size();
+	trie *tree = create_trie();
+	for (size_t i = 0; i < num; i++)
+		trie_insert(tree, names[i], strlen(names[i]), &value);
+	heap = __heap_size() - heap;
+
+	double start = __now();
+	for (size_t i = 0; i < num; i++) {
+		const char *name = names[order[i]];
+		hits += trie_find(tree, name, strlen(name)) != NULL;
+	}
+	__report("trie", num, heap, __now() - start, hits);
+	destroy_trie(tree);
+
+	hits = 0;
+	heap = __heap_size();
+	hash_table *table = create_hash_table(16);
+	for (size_t i = 0; i < num; i++)
+		hash_table_insert(table, names[i], strlen(names[i]), 1,
+				  &value);
+	heap = __heap_size() - heap;
+
+	start = __now();
+	for (size_t i = 0; i < num; i++) {
+		const char *name = names[order[i]];
+		hits += hash_table_find(table, name, strlen(name), 1) != NULL;
+	}
+	__report("hash", num, heap, __now() - start, hits);
+	destroy_hash_table(table, NULL);
+
+	free(order);
+	free(names);
+	return EXIT_SUCCESS;
+}
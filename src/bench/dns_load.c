@@ -0,0 +1,187 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * UDP的DNS压测客户端，用一个socket保持固定数量的查询在途，统计QPS和延迟。
+ * 用法：dns_load <server> <port> <queries> <names> [inflight]
+ * 依次查询n<i % names>.load.example的A记录，inflight默认为256。
+ * 2秒内没有收到任何回复时结束，没有收到回复的查询计为丢失。
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_ID_SPACE 65536
+#define LOAD_RECV_TIMEOUT_S 2
+
+static int load_sock;
+static unsigned long load_total;
+static unsigned long load_names;
+static unsigned long load_inflight = 256;
+static atomic_ulong load_received;
+static atomic_bool load_stopped; /* 超时没有收到回复，接收线程已经退出 */
+/* 按ID记录发送时间，在途的查询少于LOAD_ID_SPACE个时不会混淆 */
+static uint64_t load_sent_ns[LOAD_ID_SPACE];
+static uint64_t *load_latency_ns;
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t __make_query(uint8_t *buf, unsigned long i)
+{
+	uint16_t id = (uint16_t)i;
+	char name[64];
+
+	memset(buf, 0, 12);
+	buf[0] = (uint8_t)(id >> 8);
+	buf[1] = (uint8_t)id;
+	buf[2] = 0x01; /* RD */
+	buf[5] = 1;
+
+	snprintf(name, sizeof(name), "n%lu.load.example", i % load_names);
+	size_t size = 12;
+	const char *label = name;
+	while (*label != '\0') {
+		const char *dot = strchr(label, '.');
+		size_t len = dot ? (size_t)(dot - label) : strlen(label);
+		buf[size++] = (uint8_t)len;
+		memcpy(buf + size, label, len);
+		size += len;
+		label += dot ? len + 1 : len;
+	}
+	buf[size++] = 0;
+	const uint8_t question[] = { 0x00, 0x01, 0x00, 0x01 };
+	memcpy(buf + size, question, sizeof(question));
+	return size + sizeof(question);
+}
+
+static void *__receive(void *_)
+{
+	uint8_t buf[4096];
+
+	while (atomic_load(&load_received) < load_total) {
+		ssize_t size = recv(load_sock, buf, sizeof(buf), 0);
+		if (size < 2)
+			break;
+
+		uint16_t id = (uint16_t)(buf[0] << 8 | buf[1]);
+		unsigned long n = atomic_load(&load_received);
+		load_latency_ns[n] = __now_ns() - load_sent_ns[id];
+		atomic_store(&load_received, n + 1);
+	}
+	atomic_store(&load_stopped, true);
+	return NULL;
+}
+
+static int __compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 5) {
+		fprintf(stderr,
+			"Usage: %s <server> <port> <queries> <names> [inflight]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+	load_total = strtoul(argv[3], NULL, 10);
+	load_names = strtoul(argv[4], NULL, 10);
+	if (argc > 5)
+		load_inflight = strtoul(argv[5], NULL, 10);
+	if (load_total == 0 || load_names == 0 || load_inflight == 0 ||
+	    load_inflight >= LOAD_ID_SPACE) {
+		fprintf(stderr, "Bad arguments.\n");
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons((uint16_t)atoi(argv[2]));
+	if (inet_pton(AF_INET, argv[1], &server.sin_addr) != 1) {
+		fprintf(stderr, "Bad server address %s.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	load_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (load_sock < 0 ||
+	    connect(load_sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		perror("connect");
+		return EXIT_FAILURE;
+	}
+	struct timeval timeout = { LOAD_RECV_TIMEOUT_S, 0 };
+	setsockopt(load_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		   sizeof(timeout));
+	int buf_size = 8 << 20;
+	setsockopt(load_sock, SOL_SOCKET, SO_RCVBUF, &buf_size,
+		   sizeof(buf_size));
+
+	load_latency_ns = (uint64_t *)calloc(load_total, sizeof(uint64_t));
+	pthread_t receiver;
+	pthread_create(&receiver, NULL, __receive, NULL);
+
+	uint64_t start = __now_ns();
+	uint8_t buf[512];
+	unsigned long sent = 0;
+	for (; sent < load_total && !atomic_load(&load_stopped); sent++) {
+		/* 丢失的查询不会有回复，接收线程超时退出后不再发送 */
+		while (sent - atomic_load(&load_received) >= load_inflight &&
+		       !atomic_load(&load_stopped))
+			;
+		size_t size = __make_query(buf, sent);
+		load_sent_ns[(uint16_t)sent] = __now_ns();
+		send(load_sock, buf, size, 0);
+	}
+	pthread_join(receiver, NULL);
+
+	unsigned long received = atomic_load(&load_received);
+	double seconds = (double)(__now_ns() - start) / 1e9;
+	qsort(load_latency_ns, received, sizeof(uint64_t), __compare);
+	printf("sent %lu, received %lu, lost %lu, %.2fs, %.0f qps, p50 %.0fus, p99 %.0fus\n",
+	       sent, received, sent - received, seconds,
+	       received / seconds,
+	       received ? load_latency_ns[received / 2] / 1e3 : 0.0,
+	       received ? load_latency_ns[received * 99 / 100] / 1e3 : 0.0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * 快照加载的基准测试。
+ * 用法：snapshot_bench <config> <names>  生成names个A记录的回复写入cache并保存快照
+ *       snapshot_bench <config>          加载config中的快照，输出加载和查询全部entry的耗时
+ * config中应设置cache_snapshot，cache_max_bytes设为0以免生成时被淘汰。
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "core/cache.h"
+#include "core/config.h"
+#include "core/logger.h"
+#include "core/timer.h"
+#include "unidef.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define BENCH_NAME_FORMAT "host%lu.zone%lu.example"
+#define BENCH_ZONES 97
+
+/* 构造name的A记录回复，带两条TTL为3600的记录 */
+static size_t __make_reply(uint8_t *buf, const char *name, unsigned long id)
+{
+	memset(buf, 0, 12);
+	buf[0] = (uint8_t)(id >> 8);
+	buf[1] = (uint8_t)id;
+	buf[2] = 0x81;
+	buf[3] = 0x80;
+	buf[5] = 1;
+	buf[7] = 2;
+
+	size_t size = 12;
+	const char *label = name;
+	while (*label != '\0') {
+		const char *dot = strchr(label, '.');
+		size_t len = dot ? (size_t)(dot - label) : strlen(label);
+		buf[size++] = (uint8_t)len;
+		memcpy(buf + size, label, len);
+		size += len;
+		label += dot ? len + 1 : len;
+	}
+	buf[size++] = 0;
+	const uint8_t question[] = { 0x00, 0x01, 0x00, 0x01 };
+	memcpy(buf + size, question, sizeof(question));
+	size += sizeof(question);
+
+	for (uint8_t i = 0; i < 2; i++) {
+		const uint8_t record[] = { 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01,
+					   0x00, 0x00, 0x0e, 0x10, 0x00, 0x04,
+					   10,	 0,    (uint8_t)id, i };
+		memcpy(buf + size, record, sizeof(record));
+		size += sizeof(record);
+	}
+	return size;
+}
+
+static void __generate(const char *path, unsigned long names)
+{
+	for (unsigned long i = 0; i < names; i++) {
+		char name[64];
+		raw_data data;
+		snprintf(name, sizeof(name), BENCH_NAME_FORMAT, i,
+			 i % BENCH_ZONES);
+		data.size = __make_reply(data.data, name, i);
+		update_cache(&data);
+	}
+
+	uint64_t start = timer_now_ms();
+	if (!save_cache_snapshot(path)) {
+		fprintf(stderr, "Failed to save snapshot to %s.\n", path);
+		exit(EXIT_FAILURE);
+	}
+	printf("save: %llu ms\n",
+	       (unsigned long long)(timer_now_ms() - start));
+}
+
+/* 按生成时的名字逐个查询，直到第一个找不到的名字 */
+static void __lookup_all(void)
+{
+	uint64_t start = timer_now_ms();
+	unsigned long found = 0;
+
+	cache_read_begin();
+	for (;; found++) {
+		char name[64];
+		BOOL refresh = FALSE;
+		snprintf(name, sizeof(name), BENCH_NAME_FORMAT, found,
+			 found % BENCH_ZONES);
+		list *res = query_A_record(name, &refresh);
+		if (res == NULL || res->size != 2)
+			break;
+	}
+	cache_read_end();
+
+	printf("lookup: %lu names in %llu ms\n", found,
+	       (unsigned long long)(timer_now_ms() - start));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <config> [names]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	logger_init("/dev/null", LOGGER_ERROR, LOGGER_TARGET_CONSOLE);
+	read_config(argv[1]);
+	const char *path = get_config()->cache_snapshot;
+	if (path[0] == '\0') {
+		fprintf(stderr, "cache_snapshot is not set in %s.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	timer_init();
+
+	uint64_t start = timer_now_ms();
+	init_cache_pools();
+	uint64_t loaded = timer_now_ms();
+
+	if (argc > 2) {
+		__generate(path, strtoul(argv[2], NULL, 10));
+	} else {
+		cache_stats stats;
+		struct stat st;
+		get_cache_stats(&stats);
+		printf("load: %zu entries, %lld bytes in %llu ms\n",
+		       stats.entries,
+		       stat(path, &st) == 0 ? (long long)st.st_size : -1LL,
+		       (unsigned long long)(loaded - start));
+		__lookup_all();
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# 比较io_uring和recvmmsg接收请求时的QPS和CPU占用。
+# 用法：uring_bench.sh <dnsRelay> <dns_load> [queries] [inflight]
+# 在临时目录中为每种模式生成dns_relay.conf，查询的名字全部写在host文件中，
+# 因此不需要upstream。relay监听53端口，通常需要root。
+
+RELAY=$(realpath "$1")
+LOAD=$(realpath "$2")
+QUERIES=${3:-200000}
+INFLIGHT=${4:-256}
+NAMES=200
+
+if [ ! -x "$RELAY" ] || [ ! -x "$LOAD" ]; then
+	echo "usage: $0 <dnsRelay> <dns_load> [queries] [inflight]" >&2
+	exit 1
+fi
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+i=0
+while [ $i -lt $NAMES ]; do
+	echo "10.0.$((i / 256)).$((i % 256)) n$i.load.example"
+	i=$((i + 1))
+done > host
+
+run() {
+	printf "reuseport = %s\nio_uring = %s\n" "$1" "$2" > dns_relay.conf
+	"$RELAY" > relay.log 2>&1 &
+	pid=$!
+	sleep 1
+
+	"$LOAD" 127.0.0.1 53 2000 $NAMES > /dev/null
+	ticks=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+	result=$("$LOAD" 127.0.0.1 53 "$QUERIES" $NAMES "$INFLIGHT")
+	ticks=$(($(awk '{ print $14 + $15 }' /proc/$pid/stat) - ticks))
+
+	kill $pid
+	wait $pid 2> /dev/null
+	echo "reuseport=$1 io_uring=$2: $result, relay cpu ticks $ticks"
+}
+
+run no no
+run no yes
+run yes no
+run yes yes
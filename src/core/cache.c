@@ -22,172 +22,854 @@
  * SOFTWARE.
  */
 
+
 #define _POSIX_C_SOURCE 200809L
 #define _GNU_SOURCE
 
 #include "cache.h"
+#include "config.h"
 #include "dns.h"
+#include "ebr.h"
 #include "logger.h"
-#include "model/trie.h"
+#include "model/hash_table.h"
+#include "model/heap.h"
+#include "timer.h"
 #include "unidef.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_INITIAL_CAPACITY 4096
+#define CACHE_KEY_MAX_SIZE 256
+/* 每次malloc的额外开销（glibc的chunk header和对齐），用于估算实际内存占用 */
+#define CACHE_MALLOC_OVERHEAD 16
+/* NXDOMAIN对域名的所有类型都成立，用不会出现在查询中的类型0作为key */
+#define TYPE_ANY_NAME 0
+#define CACHE_LINE_SIZE 64
+/* 未命中且期间分片被修改时的重试次数 */
+#define CACHE_READ_RETRY 4
+
+typedef enum CACHE_ENTRY_KIND {
+	/* A、AAAA为list，CNAME为cname_answer_t，其他类型为rrset_answer_t */
+	ENTRY_RECORD = 0,
+	ENTRY_NEGATIVE = 1, /* negative_answer_t */
+	ENTRY_PACKET = 2, /* packet_answer_t，key为域名加上get_packet_flags() */
+} CACHE_ENTRY_KIND;
+
+typedef enum PREFETCH_STATE {
+	PREFETCH_NONE = 0,
+	PREFETCH_ISSUED = 1, /* 已请求刷新，等待upstream回复 */
+	PREFETCH_REFRESHED = 2, /* value由预取的回复在过期前替换，下次命中时计为有效 */
+} PREFETCH_STATE;
 
-static pthread_rwlock_t a_rec_pool_lock;
-static pthread_rwlock_t cname_rec_pool_lock;
-static pthread_rwlock_t aaaa_rec_pool_lock;
+/**
+ * 读者不加锁访问entry，因此除value和原子变量外插入后不再修改，
+ * 被替换的value和被删除的entry都交给EBR延迟释放。
+ */
+typedef struct cache_entry {
+	_Atomic(void *) value; /* 整体替换，不原地修改 */
+	uint16_t type; /* NXDOMAIN的negative entry为TYPE_ANY_NAME */
+	uint8_t kind; /* CACHE_ENTRY_KIND，kind变化时替换整个entry */
+	size_t bytes; /* 该entry占用的内存，包括key、entry本身和value */
+	atomic_bool referenced; /* CLOCK的访问位，由读者设置 */
+	atomic_uint hits; /* 当前value被查询的次数，达到prefetch_hits后不再增加 */
+	atomic_uchar prefetch; /* PREFETCH_STATE */
+	heap_node expire_node; /* priority为最早过期的记录的过期时间 */
+	size_t key_len;
+	char key[]; /* 用于过期时从哈希表中删除 */
+} cache_entry;
 
-static trie a_rec_pool;
-static trie cname_rec_pool;
-static trie aaaa_rec_pool;
+#define expire_node_entry(node)                                                \
+	((cache_entry *)((char *)(node)-offsetof(cache_entry, expire_node)))
+
+/**
+ * 按域名的哈希分片，每个分片有独立的锁、哈希表、过期堆和内存预算。
+ * 同一个域名的所有entry都在同一个分片中。
+ * lock只用于写者之间互斥，读者不加锁，用seq判断未命中时是否和写者并发。
+ */
+struct cache_shard {
+	_Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+	atomic_uint seq; /* 写者持有lock期间为奇数 */
+	hash_table *table;
+	heap *expire_heap;
+
+	/* 以下变量都受lock保护 */
+	size_t bytes; /* 所有entry的bytes之和 */
+	size_t evicted;
+	size_t reaped;
+	size_t clock_hand;
+};
+
+static cache_shard *shards;
+static size_t shard_bits;
+static size_t max_bytes; /* 每个分片的预算 */
+static size_t max_entries;
+static uint64_t stale_window; /* serve_stale时过期的entry还要保留的秒数 */
+
+/* 预取的预算按upstream回复客户端查询的速率计算，每秒重新开始 */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t prefetch_window;
+static size_t prefetch_window_replies; /* 窗口开始时的client_replies */
+static size_t prefetch_window_issued;
+static size_t prefetch_allowed;
+static atomic_size_t client_replies;
+static atomic_size_t prefetch_issued;
+static atomic_size_t prefetch_useful;
+
+static void __reap(void *_);
+static void __load_snapshot(const char *path);
+static void __save_snapshot(void *_);
+static BOOL __snapshot_owns(const void *ptr);
+static void __snapshot_release(void *_);
 
 void init_cache_pools(void)
 {
-	pthread_rwlock_init(&a_rec_pool_lock, NULL);
-	pthread_rwlock_init(&cname_rec_pool_lock, NULL);
-	pthread_rwlock_init(&aaaa_rec_pool_lock, NULL);
-	logger_write(LOGGER_DEBUG, "cache(): Cache initializetion finished.");
+	const relay_config *config = get_config();
+	size_t num_shards = 1;
+
+	shard_bits = 0;
+	while (num_shards < config->cache_shards && shard_bits < 16) {
+		num_shards <<= 1;
+		shard_bits++;
+	}
+
+	shards = (cache_shard *)aligned_alloc(
+		CACHE_LINE_SIZE, num_shards * sizeof(cache_shard));
+	if (shards == NULL) {
+		logger_write(LOGGER_ERROR,
+			     "init_cache_pools(): Failed to allocate %zu shards.",
+			     num_shards);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < num_shards; i++) {
+		cache_shard *shard = &shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		atomic_init(&shard->seq, 0);
+		shard->table = create_hash_table(DNS_SERVER_MAX(
+			CACHE_INITIAL_CAPACITY >> shard_bits, 16));
+		hash_table_set_retire(shard->table, ebr_retire);
+		shard->expire_heap = create_heap(DNS_SERVER_MAX(
+			CACHE_INITIAL_CAPACITY >> shard_bits, 16));
+		shard->bytes = 0;
+		shard->evicted = 0;
+		shard->reaped = 0;
+		shard->clock_hand = 0;
+	}
+
+	max_bytes = (config->cache_max_bytes + num_shards - 1) / num_shards;
+	max_entries = (config->cache_max_entries + num_shards - 1) / num_shards;
+	stale_window = config->serve_stale ? config->serve_stale_window : 0;
+
+	if (config->cache_snapshot[0] != '\0') {
+		__load_snapshot(config->cache_snapshot);
+		if (config->cache_snapshot_interval_ms)
+			timer_add(config->cache_snapshot_interval_ms,
+				  __save_snapshot, NULL);
+	}
+	if (config->cache_reap_interval_ms)
+		timer_add(config->cache_reap_interval_ms, __reap, NULL);
+	logger_write(LOGGER_DEBUG,
+		     "cache(): Cache initializetion finished with %zu shards.",
+		     num_shards);
 }
 
-static void update_A_record(const char *domain, list *records)
+/**
+ * 把域名转换为wire format作为key。
+ * 查询中的域名以'.'分隔，而回复中解析出的域名以长度字节分隔，这里统一按label重新编码。
+ * @return key的长度
+ */
+static size_t __cache_key(const char *domain, out char *key)
 {
-	size_t len = strlen(domain);
-	list *ori_list = trie_remove(&a_rec_pool, domain, len);
-	trie_insert(&a_rec_pool, domain, len, records);
+	size_t len = 0;
+	size_t label_begin = 0;
 
-	/* 删除之前的记录 */
-	if (ori_list != NULL) {
-		foreach_list(i, ori_list) free(i->value);
+	/* 留出长度字节和结尾的0 */
+	for (; *domain != '\0' && len < CACHE_KEY_MAX_SIZE - 2; domain++) {
+		if (*domain == '.' || iscntrl((unsigned char)*domain)) {
+			if (len > label_begin) {
+				key[label_begin] = (char)(len - label_begin - 1);
+				label_begin = len;
+			}
+			continue;
+		}
 
-		while (list_empty(ori_list))
-			list_pop_back(ori_list);
-		free(ori_list);
+		if (len == label_begin)
+			len++;
+		key[len++] = *domain;
 	}
+
+	if (len > label_begin)
+		key[label_begin] = (char)(len - label_begin - 1);
+	key[len++] = '\0';
+	return len;
 }
 
-static list *__query_A_record_no_lock(const char *domain)
+/**
+ * 只对key开头的wire format域名计算哈希，因此同一个域名的记录、negative entry
+ * 和整包缓存都在同一个分片中。
+ * 哈希表用FNV-1a的低位定位，这里乘以黄金比例后取高位，避免分片内哈希表的低位全部相同。
+ */
+static cache_shard *__shard_of(const char *key, size_t key_len)
 {
-	size_t len = strlen(domain);
-	list *res = (list *)trie_find(&a_rec_pool, domain, len);
-	return res;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < key_len && key[i] != '\0'; i++) {
+		hash ^= (uint8_t)tolower((unsigned char)key[i]);
+		hash *= 16777619u;
+	}
+
+	if (shard_bits == 0)
+		return &shards[0];
+	return &shards[(uint32_t)(hash * 2654435769u) >> (32 - shard_bits)];
 }
 
-list *query_A_record(const char *domain)
+void cache_read_begin(void)
 {
-	pthread_rwlock_rdlock(&a_rec_pool_lock);
-	size_t len = strlen(domain);
-	list *res = (list *)trie_find(&a_rec_pool, domain, len);
-	pthread_rwlock_unlock(&a_rec_pool_lock);
-	return res;
+	ebr_enter();
+}
+
+void cache_read_end(void)
+{
+	ebr_exit();
+}
+
+/**
+ * 读者查找entry，调用者须在cache_read_begin()之后。
+ * 写者移动entry时可能暂时找不到，未命中且分片被修改过时重试。
+ */
+static cache_entry *__lookup(const char *key, size_t len, uint16_t type)
+{
+	cache_shard *shard = __shard_of(key, len);
+
+	for (int i = 0; i < CACHE_READ_RETRY; i++) {
+		unsigned seq =
+			atomic_load_explicit(&shard->seq, memory_order_acquire);
+		cache_entry *entry = (cache_entry *)hash_table_find(
+			shard->table, key, len, type);
+		if (entry != NULL)
+			return entry;
+
+		atomic_thread_fence(memory_order_acquire);
+		if (!(seq & 1) &&
+		    atomic_load_explicit(&shard->seq, memory_order_relaxed) ==
+			    seq)
+			break;
+	}
+	return NULL;
+}
+
+static void __touch(cache_entry *entry)
+{
+	if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+		atomic_store_explicit(&entry->referenced, TRUE,
+				      memory_order_relaxed);
 }
 
-static void update_CNAME_record(const char *domain, cname_answer_t *records)
+static void *__entry_value(cache_entry *entry)
 {
-	size_t len = strlen(domain);
-	cname_answer_t *ori_rec = trie_remove(&cname_rec_pool, domain, len);
-	trie_insert(&cname_rec_pool, domain, len, records);
+	return atomic_load_explicit(&entry->value, memory_order_acquire);
+}
 
-	free(ori_rec);
+static BOOL __is_rrset(uint16_t type)
+{
+	return type != TYPE_A && type != TYPE_AAAA && type != TYPE_CNAME;
 }
 
-cname_answer_t *query_CNAME_record(const char *domain)
+static BOOL __is_list(uint8_t kind, uint16_t type)
 {
-	pthread_rwlock_rdlock(&cname_rec_pool_lock);
-	size_t len = strlen(domain);
-	cname_answer_t *res = (cname_answer_t *)trie_find(&cname_rec_pool, domain, len);
-	pthread_rwlock_unlock(&cname_rec_pool_lock);
+	return kind == ENTRY_RECORD && (type == TYPE_A || type == TYPE_AAAA);
+}
+
+/**
+ * @return 一次分配的value的大小，A、AAAA的list返回0
+ */
+static size_t __flat_value_size(uint8_t kind, uint16_t type,
+				const void *value)
+{
+	if (kind == ENTRY_NEGATIVE)
+		return sizeof(negative_answer_t) +
+		       ((const negative_answer_t *)value)->soa_size;
+	if (kind == ENTRY_PACKET)
+		return sizeof(packet_answer_t) +
+		       ((const packet_answer_t *)value)->num_ttl *
+			       sizeof(uint16_t) +
+		       ((const packet_answer_t *)value)->size;
+	if (__is_list(kind, type))
+		return 0;
+	if (type == TYPE_CNAME)
+		return sizeof(cname_answer_t);
+	return sizeof(rrset_answer_t) + ((const rrset_answer_t *)value)->size;
+}
+
+static size_t __value_bytes(uint8_t kind, uint16_t type, void *value)
+{
+	if (!__is_list(kind, type))
+		return __flat_value_size(kind, type, value) +
+		       CACHE_MALLOC_OVERHEAD;
+
+	list *records = (list *)value;
+	size_t rec_size = type == TYPE_A ? sizeof(a_answer_t) :
+					   sizeof(aaaa_answer_t);
+
+	/* list本身、哨兵节点，以及每条记录的节点和记录 */
+	return sizeof(list) + sizeof(struct __list_node) +
+	       2 * CACHE_MALLOC_OVERHEAD +
+	       list_size(records) *
+		       (sizeof(struct __list_node) + rec_size +
+			2 * CACHE_MALLOC_OVERHEAD);
+}
+
+/**
+ * 重新计算entry占用的内存，value被修改后调用
+ */
+static void __entry_account(cache_shard *shard, cache_entry *entry)
+{
+	/* entry本身带一份key，哈希表的节点里还有一份 */
+	shard->bytes -= entry->bytes;
+	entry->bytes = sizeof(cache_entry) + entry->key_len +
+		       hash_table_node_size(entry->key_len) +
+		       2 * CACHE_MALLOC_OVERHEAD +
+		       __value_bytes(entry->kind, entry->type, entry->value);
+	shard->bytes += entry->bytes;
+}
+
+/**
+ * @param ttl value中最早过期的记录的TTL
+ * @return value中最早过期的记录的过期时间
+ */
+static uint64_t __value_lifetime(uint8_t kind, uint16_t type, void *value,
+				 out uint32_t *ttl)
+{
+	if (kind == ENTRY_NEGATIVE) {
+		const negative_answer_t *rec = (negative_answer_t *)value;
+		*ttl = rec->ttl;
+		return (uint64_t)rec->last_update + rec->ttl;
+	}
+	if (kind == ENTRY_PACKET) {
+		const packet_answer_t *rec = (packet_answer_t *)value;
+		*ttl = rec->ttl;
+		return (uint64_t)rec->last_update + rec->ttl;
+	}
+	if (type == TYPE_CNAME) {
+		const cname_answer_t *rec = (cname_answer_t *)value;
+		*ttl = rec->ttl;
+		return (uint64_t)rec->last_update + rec->ttl;
+	}
+	if (__is_rrset(type)) {
+		const rrset_answer_t *rec = (rrset_answer_t *)value;
+		*ttl = rec->ttl;
+		return (uint64_t)rec->last_update + rec->ttl;
+	}
+
+	uint64_t res = 0;
+	*ttl = 0;
+	list *records = (list *)value;
+	foreach_list(i, records)
+	{
+		uint64_t expire;
+		uint32_t rec_ttl;
+		if (type == TYPE_A) {
+			a_answer_t *rec = (a_answer_t *)i->value;
+			rec_ttl = rec->ttl;
+			expire = (uint64_t)rec->last_update + rec->ttl;
+		} else {
+			aaaa_answer_t *rec = (aaaa_answer_t *)i->value;
+			rec_ttl = rec->ttl;
+			expire = (uint64_t)rec->last_update + rec->ttl;
+		}
+		if (res == 0 || expire < res) {
+			res = expire;
+			*ttl = rec_ttl;
+		}
+	}
 	return res;
 }
 
-static void update_AAAA_record(const char *domain, list *records)
+/**
+ * @return value中最早过期的记录的过期时间
+ */
+static uint64_t __value_expire(uint8_t kind, uint16_t type, void *value)
 {
-	size_t len = strlen(domain);
-	list *ori_list = trie_remove(&aaaa_rec_pool, domain, len);
-	trie_insert(&aaaa_rec_pool, domain, len, records);
+	uint32_t ttl = 0;
+	return __value_lifetime(kind, type, value, &ttl);
+}
 
-	/* 删除之前的记录 */
-	if (ori_list != NULL) {
-		foreach_list(i, ori_list) free(i->value);
+static void __free_list(void *value)
+{
+	list *records = (list *)value;
+	list_clear(records);
+	free(records->end);
+	free(records);
+}
 
-		while (list_empty(ori_list))
-			list_pop_back(ori_list);
-		free(ori_list);
+/**
+ * 读者可能还在使用value，交给EBR延迟释放。从快照加载的value在映射中，只释放引用
+ */
+static void __retire_value(uint8_t kind, uint16_t type, void *value)
+{
+	if (value == NULL)
+		return;
+
+	/* 快照中的list的记录都在映射中，list本身在arena中 */
+	const void *data =
+		__is_list(kind, type) ? list_first((list *)value) : value;
+	if (__snapshot_owns(data))
+		ebr_retire(value, __snapshot_release);
+	else if (__is_list(kind, type))
+		ebr_retire(value, __free_list);
+	else
+		ebr_retire(value, free);
+}
+
+/**
+ * 从哈希表和过期堆中删除entry，并延迟释放
+ */
+static void __remove_entry(cache_shard *shard, cache_entry *entry)
+{
+	hash_table_remove(shard->table, entry->key, entry->key_len,
+			  entry->type);
+	heap_remove(shard->expire_heap, &entry->expire_node);
+	shard->bytes -= entry->bytes;
+	__retire_value(entry->kind, entry->type, entry->value);
+	ebr_retire(entry, free);
+}
+
+static cache_entry *__find_entry(cache_shard *shard, const char *domain,
+				 uint16_t type)
+{
+	char key[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(domain, key);
+	return (cache_entry *)hash_table_find(shard->table, key, len, type);
+}
+
+/**
+ * 插入或替换key的记录，之前的记录会被释放。
+ * 正常记录会替换掉同一个key的negative entry，反之亦然。
+ */
+static cache_entry *__set_entry_key(cache_shard *shard, const char *key,
+				    size_t len, uint16_t type, uint8_t kind,
+				    void *value)
+{
+	cache_entry *entry =
+		(cache_entry *)hash_table_find(shard->table, key, len, type);
+
+	if (entry != NULL && entry->kind != kind) {
+		__remove_entry(shard, entry);
+		entry = NULL;
+	}
+
+	if (entry == NULL) {
+		entry = (cache_entry *)malloc(sizeof(cache_entry) + len);
+		entry->type = type;
+		entry->bytes = 0;
+		atomic_init(&entry->value, value);
+		entry->kind = kind;
+		atomic_init(&entry->referenced, FALSE);
+		atomic_init(&entry->hits, 0);
+		atomic_init(&entry->prefetch, PREFETCH_NONE);
+		entry->expire_node.index = HEAP_INVALID_INDEX;
+		entry->key_len = len;
+		memcpy(entry->key, key, len);
+		hash_table_insert(shard->table, key, len, type, entry);
+	}
+
+	void *old = atomic_exchange_explicit(&entry->value, value,
+					     memory_order_acq_rel);
+	if (old != value) {
+		/* 预取的回复在旧记录过期之前到达，才算避免了一次过期 */
+		BOOL refreshed =
+			atomic_load_explicit(&entry->prefetch,
+					     memory_order_relaxed) ==
+				PREFETCH_ISSUED &&
+			__value_expire(kind, type, old) > (uint64_t)time(NULL);
+		atomic_store_explicit(&entry->prefetch,
+				      refreshed ? PREFETCH_REFRESHED :
+						  PREFETCH_NONE,
+				      memory_order_relaxed);
+		atomic_store_explicit(&entry->hits, 0, memory_order_relaxed);
+		__retire_value(kind, type, old);
 	}
+	__entry_account(shard, entry);
+
+	entry->expire_node.priority =
+		__value_expire(entry->kind, entry->type, entry->value) +
+		stale_window;
+	if (entry->expire_node.index == HEAP_INVALID_INDEX)
+		heap_push(shard->expire_heap, &entry->expire_node);
+	else
+		heap_update(shard->expire_heap, &entry->expire_node);
+	return entry;
 }
 
-static list *__query_AAAA_record_no_lock(const char *domain)
+static cache_entry *__set_entry(cache_shard *shard, const char *domain,
+				uint16_t type, uint8_t kind, void *value)
 {
-	size_t len = strlen(domain);
-	list *res = (list *)trie_find(&aaaa_rec_pool, domain, len);
-	return res;
+	char key[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(domain, key);
+	return __set_entry_key(shard, key, len, type, kind, value);
+}
+
+static void __lock_shard(cache_shard *shard)
+{
+	pthread_mutex_lock(&shard->lock);
+	atomic_fetch_add_explicit(&shard->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void __write_unlock(cache_shard *shard)
+{
+	atomic_fetch_add_explicit(&shard->seq, 1, memory_order_release);
+	pthread_mutex_unlock(&shard->lock);
 }
 
-list *query_AAAA_record(const char *domain)
+/**
+ * 对domain所在的分片加写锁
+ */
+static cache_shard *__write_lock(const char *domain)
 {
-	pthread_rwlock_rdlock(&aaaa_rec_pool_lock);
-	size_t len = strlen(domain);
-	list *res = (list *)trie_find(&aaaa_rec_pool, domain, len);
-	pthread_rwlock_unlock(&aaaa_rec_pool_lock);
+	char key[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(domain, key);
+	cache_shard *shard = __shard_of(key, len);
+
+	__lock_shard(shard);
+	return shard;
+}
+
+/**
+ * 整包缓存的key：wire format的域名后面加上get_packet_flags()
+ * @return key的长度，不缓存的查询返回0
+ */
+static size_t __packet_key(const void *data, size_t data_size, out char *key,
+			   out uint16_t *qtype)
+{
+	query_meta query = parse_query(data, data_size);
+	if (query.query_end == NULL ||
+	    GET_TYPE_PTR_TYPE(query.class_ptr) != CLASS_IN)
+		return 0;
+
+	size_t len = decompress_name(data, data_size, query.query_begin,
+				     (uint8_t *)key, CACHE_KEY_MAX_SIZE - 1);
+	if (len == 0)
+		return 0;
+
+	key[len++] = (char)get_packet_flags(data, data_size);
+	*qtype = GET_TYPE_PTR_TYPE(query.type_ptr);
+	return len;
+}
+
+/**
+ * priority包含了stale_window，过期但还能stale使用的entry在淘汰时优先删除
+ */
+static BOOL __entry_expired(const cache_entry *entry, time_t now)
+{
+	return entry->expire_node.priority <= (uint64_t)now + stale_window;
+}
+
+/**
+ * @return entry是否已超出stale窗口，不能再使用
+ */
+static BOOL __entry_dead(const cache_entry *entry, time_t now)
+{
+	return entry->expire_node.priority <= (uint64_t)now;
+}
+
+BOOL cache_stale_usable(time_t last_update, uint32_t ttl)
+{
+	return (uint64_t)time(NULL) <
+	       (uint64_t)last_update + ttl + stale_window;
+}
+
+static BOOL __over_budget(cache_shard *shard)
+{
+	size_t total = shard->bytes + hash_table_memory(shard->table);
+
+	return (max_bytes && total > max_bytes) ||
+	       (max_entries && hash_table_size(shard->table) > max_entries);
+}
+
+/**
+ * CLOCK：时钟指针扫过哈希表的槽位，过期的entry和访问位为0的entry被淘汰，
+ * 访问位为1的entry清零后获得第二次机会。
+ */
+static void __evict_no_lock(cache_shard *shard)
+{
+	size_t max_steps = 2 * hash_table_capacity(shard->table);
+	time_t now = time(NULL);
+
+	for (size_t steps = 0; steps < max_steps && __over_budget(shard);
+	     steps++) {
+		const char *key = NULL;
+		size_t key_len = 0;
+		uint16_t type = 0;
+		cache_entry *entry = (cache_entry *)hash_table_slot(
+			shard->table, shard->clock_hand, &key, &key_len, &type);
+
+		if (entry == NULL ||
+		    (!__entry_expired(entry, now) &&
+		     atomic_exchange_explicit(&entry->referenced, FALSE,
+					      memory_order_relaxed))) {
+			shard->clock_hand =
+				(shard->clock_hand + 1) &
+				(hash_table_capacity(shard->table) - 1);
+			continue;
+		}
+
+		/* 删除后后面的entry会前移到当前位置，因此指针不前进 */
+		__remove_entry(shard, entry);
+		shard->evicted++;
+	}
+}
+
+/**
+ * @return 是否还在本秒的预取预算之内，在预算内时计入本次预取
+ */
+static BOOL __prefetch_budget(void)
+{
+	time_t now = time(NULL);
+	BOOL res = FALSE;
+
+	pthread_mutex_lock(&prefetch_lock);
+	if (now != prefetch_window) {
+		size_t replies = atomic_load_explicit(&client_replies,
+						      memory_order_relaxed);
+		size_t elapsed = prefetch_window != 0 && now > prefetch_window ?
+					 (size_t)(now - prefetch_window) :
+					 1;
+		prefetch_allowed = (replies - prefetch_window_replies) /
+				   elapsed * get_config()->prefetch_budget /
+				   100;
+		/* upstream空闲时也允许少量预取 */
+		if (prefetch_allowed == 0)
+			prefetch_allowed = 1;
+		prefetch_window = now;
+		prefetch_window_replies = replies;
+		prefetch_window_issued = 0;
+	}
+	if (prefetch_window_issued < prefetch_allowed) {
+		prefetch_window_issued++;
+		res = TRUE;
+	}
+	pthread_mutex_unlock(&prefetch_lock);
 	return res;
 }
 
+/**
+ * 常用的A、AAAA、CNAME记录剩余的TTL不超过prefetch_percent时，每个value只预取一次
+ * @return 调用者是否应该在后台刷新
+ */
+static BOOL __want_prefetch(cache_entry *entry, void *value)
+{
+	const relay_config *config = get_config();
+
+	if (!config->prefetch || (entry->type != TYPE_A &&
+				  entry->type != TYPE_AAAA &&
+				  entry->type != TYPE_CNAME))
+		return FALSE;
+	if (atomic_load_explicit(&entry->hits, memory_order_relaxed) <
+		    config->prefetch_hits ||
+	    atomic_load_explicit(&entry->prefetch, memory_order_relaxed) !=
+		    PREFETCH_NONE)
+		return FALSE;
+
+	uint32_t ttl = 0;
+	uint64_t expire = __value_lifetime(entry->kind, entry->type, value,
+					   &ttl);
+	uint64_t now = (uint64_t)time(NULL);
+	if (expire <= now ||
+	    (expire - now) * 100 > (uint64_t)ttl * config->prefetch_percent)
+		return FALSE;
+
+	unsigned char state = PREFETCH_NONE;
+	if (!atomic_compare_exchange_strong_explicit(
+		    &entry->prefetch, &state, PREFETCH_ISSUED,
+		    memory_order_relaxed, memory_order_relaxed))
+		return FALSE;
+	if (!__prefetch_budget()) {
+		atomic_store_explicit(&entry->prefetch, PREFETCH_NONE,
+				      memory_order_relaxed);
+		return FALSE;
+	}
+
+	atomic_fetch_add_explicit(&prefetch_issued, 1, memory_order_relaxed);
+	return TRUE;
+}
+
+/**
+ * 读者命中entry，记录访问位和命中次数
+ * @return 调用者是否应该在后台刷新
+ */
+static BOOL __hit(cache_entry *entry, void *value)
+{
+	__touch(entry);
+
+	if (atomic_load_explicit(&entry->hits, memory_order_relaxed) <
+	    get_config()->prefetch_hits)
+		atomic_fetch_add_explicit(&entry->hits, 1,
+					  memory_order_relaxed);
+
+	unsigned char state = PREFETCH_REFRESHED;
+	if (atomic_load_explicit(&entry->prefetch, memory_order_relaxed) ==
+		    PREFETCH_REFRESHED &&
+	    atomic_compare_exchange_strong_explicit(
+		    &entry->prefetch, &state, PREFETCH_NONE,
+		    memory_order_relaxed, memory_order_relaxed))
+		atomic_fetch_add_explicit(&prefetch_useful, 1,
+					  memory_order_relaxed);
+
+	return __want_prefetch(entry, value);
+}
+
+static void *__query_record(const char *domain, uint16_t type,
+			    out BOOL *refresh)
+{
+	char key[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(domain, key);
+	cache_entry *entry = __lookup(key, len, type);
+	if (entry == NULL || entry->kind != ENTRY_RECORD)
+		return NULL;
+
+	void *value = __entry_value(entry);
+	if (__hit(entry, value) && refresh != NULL)
+		*refresh = TRUE;
+	return value;
+}
+
+list *query_A_record(const char *domain, out BOOL *refresh)
+{
+	return (list *)__query_record(domain, TYPE_A, refresh);
+}
+
+cname_answer_t *query_CNAME_record(const char *domain, out BOOL *refresh)
+{
+	return (cname_answer_t *)__query_record(domain, TYPE_CNAME, refresh);
+}
+
+list *query_AAAA_record(const char *domain, out BOOL *refresh)
+{
+	return (list *)__query_record(domain, TYPE_AAAA, refresh);
+}
+
+rrset_answer_t *query_rrset_record(const char *domain, uint16_t type)
+{
+	rrset_answer_t *rec =
+		(rrset_answer_t *)__query_record(domain, type, NULL);
+	return rec == NULL || answer_timeout(rec) ? NULL : rec;
+}
+
+negative_answer_t *query_negative_record(const char *domain, uint16_t qtype)
+{
+	char key[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(domain, key);
+	cache_entry *entry = __lookup(key, len, TYPE_ANY_NAME);
+	if (entry == NULL)
+		entry = __lookup(key, len, qtype);
+	if (entry == NULL || entry->kind != ENTRY_NEGATIVE)
+		return NULL;
+
+	negative_answer_t *rec = (negative_answer_t *)__entry_value(entry);
+	if (answer_timeout(rec))
+		return NULL;
+
+	__touch(entry);
+	return rec;
+}
+
+/**
+ * 域名有了正常记录，说明之前缓存的NXDOMAIN已经失效
+ */
+static void __drop_nxdomain(cache_shard *shard, const char *domain)
+{
+	cache_entry *entry = __find_entry(shard, domain, TYPE_ANY_NAME);
+	if (entry != NULL)
+		__remove_entry(shard, entry);
+}
 
 static void try_update_cname_cache(answer_t *answers, size_t num_answer)
 {
 #ifdef __DEBUG__
 	assert(answers != NULL);
 #endif
-	if (num_answer == 0)
-		return;
-
-	pthread_rwlock_wrlock(&cname_rec_pool_lock);
-
 	for (size_t i = 0; i < num_answer; i++) {
 		if (answers[i].type == TYPE_CNAME) {
 			cname_answer_t *rec =
 				(cname_answer_t *)answers[i].answer;
 			rec->last_update = time(NULL);
-			update_CNAME_record(rec->domain, rec);
+
+			cache_shard *shard = __write_lock(rec->domain);
+			__drop_nxdomain(shard, rec->domain);
+			__set_entry(shard, rec->domain, TYPE_CNAME,
+				    ENTRY_RECORD, rec);
+			__evict_no_lock(shard);
+			__write_unlock(shard);
 		}
 	}
-
-	pthread_rwlock_unlock(&cname_rec_pool_lock);
 }
 
-static void try_update_a_cache(answer_t *answers, size_t num_answer)
+static BOOL __same_domain(const char *a, const char *b)
 {
-#ifdef __DEBUG__
-	assert(answers != NULL);
-#endif
-	if (num_answer == 0)
-		return;
+	char key_a[CACHE_KEY_MAX_SIZE];
+	char key_b[CACHE_KEY_MAX_SIZE];
+	size_t len = __cache_key(a, key_a);
 
-	pthread_rwlock_wrlock(&a_rec_pool_lock);
+	return len == __cache_key(b, key_b) &&
+	       strncasecmp(key_a, key_b, len) == 0;
+}
 
+/**
+ * 同一个域名的多条记录放在同一个list中。先在锁外为回复中的每个域名建好新的list，
+ * 再在分片的写锁下整体替换，读者不会看到只更新了一部分的list。
+ */
+static void __update_record_lists(answer_t *answers, size_t num_answer,
+				  uint16_t type)
+{
 	for (size_t i = 0; i < num_answer; i++) {
-		if (answers[i].type == TYPE_A) {
-			a_answer_t *rec = (a_answer_t *)answers[i].answer;
-			list *lst = __query_A_record_no_lock(rec->domain);
-			list_clear(lst);
-		}
+		if (answers[i].type != type)
+			continue;
+
+		/* a_answer_t和aaaa_answer_t的domain都在开头 */
+		const char *domain = (const char *)answers[i].answer;
+		BOOL done = FALSE;
+		for (size_t j = 0; j < i && !done; j++)
+			done = answers[j].type == type &&
+			       __same_domain((const char *)answers[j].answer,
+					     domain);
+		if (done)
+			continue;
+
+		list *lst = create_list();
+		for (size_t j = i; j < num_answer; j++)
+			if (answers[j].type == type &&
+			    __same_domain((const char *)answers[j].answer,
+					  domain))
+				list_push_back(lst, answers[j].answer);
+
+		cache_shard *shard = __write_lock(domain);
+		__drop_nxdomain(shard, domain);
+		__set_entry(shard, domain, type, ENTRY_RECORD, lst);
+		__evict_no_lock(shard);
+		__write_unlock(shard);
 	}
+}
 
+static void try_update_a_cache(answer_t *answers, size_t num_answer)
+{
+#ifdef __DEBUG__
+	assert(answers != NULL);
+#endif
 	for (size_t i = 0; i < num_answer; i++) {
 		if (answers[i].type == TYPE_A) {
 			a_answer_t *rec = (a_answer_t *)answers[i].answer;
 			rec->last_update = time(NULL);
-			list *lst = __query_A_record_no_lock(rec->domain);
-
-			if (lst == NULL) {
-				lst = create_list();
-				update_A_record(rec->domain, lst);
-			} else {
-				list_clear(lst);
-			}
-
-			list_push_back(lst, rec);
 
 			logger_write(
 				LOGGER_INFO,
@@ -198,8 +880,7 @@ static void try_update_a_cache(answer_t *answers, size_t num_answer)
 				((uint8_t *)(&rec->ip_addr))[3]);
 		}
 	}
-
-	pthread_rwlock_unlock(&a_rec_pool_lock);
+	__update_record_lists(answers, num_answer, TYPE_A);
 }
 
 static void try_update_aaaa_cache(answer_t *answers, size_t num_answer)
@@ -207,33 +888,10 @@ static void try_update_aaaa_cache(answer_t *answers, size_t num_answer)
 #ifdef __DEBUG__
 	assert(answers != NULL);
 #endif
-	if (num_answer == 0)
-		return;
-
-	pthread_rwlock_wrlock(&aaaa_rec_pool_lock);
-
-	for (size_t i = 0; i < num_answer; i++) {
-		if (answers[i].type == TYPE_AAAA) {
-			aaaa_answer_t *rec = (aaaa_answer_t *)answers[i].answer;
-			list *lst = __query_AAAA_record_no_lock(rec->domain);
-			list_clear(lst);
-		}
-	}
-
 	for (size_t i = 0; i < num_answer; i++) {
 		if (answers[i].type == TYPE_AAAA) {
 			aaaa_answer_t *rec = (aaaa_answer_t *)answers[i].answer;
 			rec->last_update = time(NULL);
-			list *lst = __query_AAAA_record_no_lock(rec->domain);
-
-			if (lst == NULL) {
-				lst = create_list();
-				update_AAAA_record(rec->domain, lst);
-			} else {
-				list_clear(lst);
-			}
-
-			list_push_back(lst, rec);
 
 			logger_write(
 				LOGGER_INFO,
@@ -249,8 +907,132 @@ static void try_update_aaaa_cache(answer_t *answers, size_t num_answer)
 				ntohs(((uint16_t *)(&rec->ip_addr))[7]));
 		}
 	}
+	__update_record_lists(answers, num_answer, TYPE_AAAA);
+}
+
+size_t query_packet_record(const void *query, size_t q_size, out void *dest,
+			   size_t dest_size, out BOOL *refresh)
+{
+	char key[CACHE_KEY_MAX_SIZE];
+	uint16_t qtype = 0;
+	size_t len = __packet_key(query, q_size, key, &qtype);
+	if (len == 0)
+		return 0;
+
+	size_t res = 0;
+	BOOL stale = FALSE;
+	*refresh = FALSE;
+	ebr_enter();
+	cache_entry *entry = __lookup(key, len, qtype);
+	if (entry != NULL && entry->kind == ENTRY_PACKET) {
+		packet_answer_t *rec = (packet_answer_t *)__entry_value(entry);
+		if (!answer_timeout(rec) || answer_stale_usable(rec)) {
+			stale = answer_timeout(rec);
+			*refresh = __hit(entry, rec) || stale;
+			res = generate_packet_response(query, q_size, rec, dest,
+						       dest_size);
+		}
+	}
+	ebr_exit();
+
+	if (res && stale)
+		set_response_ttl(dest, res, get_config()->serve_stale_ttl);
+	return res;
+}
+
+/**
+ * 缓存upstream的完整回复，negative回复的TTL同样不超过negative_ttl_max
+ */
+static void try_update_packet_cache(raw_data *remote_data)
+{
+	char key[CACHE_KEY_MAX_SIZE];
+	uint16_t qtype = 0;
+	size_t len = __packet_key(remote_data->data, remote_data->size, key,
+				  &qtype);
+	if (len == 0)
+		return;
+
+	packet_answer_t *ans =
+		get_packet_answer(remote_data->data, remote_data->size);
+	if (ans == NULL)
+		return;
+
+	uint16_t rcode =
+		get_header_info(remote_data->data, HEADER_FLAGS) & RCODE_MASK;
+	if (rcode == RCODE_NAME_ERROR ||
+	    get_header_info(remote_data->data, HEADER_ANSWER) == 0) {
+		ans->ttl = DNS_SERVER_MIN(ans->ttl,
+					  get_config()->negative_ttl_max);
+		if (ans->ttl == 0) {
+			free(ans);
+			return;
+		}
+	}
+
+	cache_shard *shard = __shard_of(key, len);
+	__lock_shard(shard);
+	__set_entry_key(shard, key, len, qtype, ENTRY_PACKET, ans);
+	__evict_no_lock(shard);
+	__write_unlock(shard);
+}
+
+/**
+ * 缓存NXDOMAIN和NODATA回复（RFC 2308），TTL不超过negative_ttl_max
+ * @return remote_data是否为negative回复
+ */
+static BOOL try_update_negative_cache(raw_data *remote_data)
+{
+	size_t ttl_max = get_config()->negative_ttl_max;
+	if (ttl_max == 0)
+		return FALSE;
+
+	negative_answer_t *ans =
+		get_negative_answer(remote_data->data, remote_data->size);
+	if (ans == NULL)
+		return FALSE;
+
+	ans->ttl = DNS_SERVER_MIN(ans->ttl, ttl_max);
+	uint16_t type = ans->rcode == RCODE_NAME_ERROR ? TYPE_ANY_NAME :
+							 ans->qtype;
+
+	logger_write(LOGGER_INFO,
+		     "try_update_negative_cache(): %s %s, qtype: %u, ttl: %u",
+		     ans->rcode == RCODE_NAME_ERROR ? "NXDOMAIN" : "NODATA",
+		     ans->domain, ans->qtype, ans->ttl);
 
-	pthread_rwlock_unlock(&aaaa_rec_pool_lock);
+	cache_shard *shard = __write_lock(ans->domain);
+	__set_entry(shard, ans->domain, type, ENTRY_NEGATIVE, ans);
+	__evict_no_lock(shard);
+	__write_unlock(shard);
+	return TRUE;
+}
+
+/**
+ * 缓存查询类型为MX、TXT等的回复
+ * @return remote_data中是否有可缓存的记录集合
+ */
+static BOOL try_update_rrset_cache(raw_data *remote_data)
+{
+	rrset_answer_t *ans =
+		get_rrset_answer(remote_data->data, remote_data->size);
+	if (ans == NULL)
+		return FALSE;
+
+	logger_write(LOGGER_INFO,
+		     "try_update_rrset_cache(): Update cache:\n  Domain: %s\n  Type: %u\n  Records: %u",
+		     ans->domain, ans->type, ans->num);
+
+	cache_shard *shard = __write_lock(ans->domain);
+	__drop_nxdomain(shard, ans->domain);
+	__set_entry(shard, ans->domain, ans->type, ENTRY_RECORD, ans);
+	__evict_no_lock(shard);
+	__write_unlock(shard);
+	return TRUE;
+}
+
+void cache_count_client_reply(void)
+{
+	atomic_fetch_add_explicit(&client_replies, 1, memory_order_relaxed);
 }
 
 void update_cache(raw_data *remote_data)
@@ -260,10 +1042,19 @@ void update_cache(raw_data *remote_data)
 #endif
 	answer_t *answers = NULL;
 
+	try_update_packet_cache(remote_data);
+	if (try_update_negative_cache(remote_data) ||
+	    try_update_rrset_cache(remote_data))
+		return;
+
 	size_t num_ans =
 		get_answers(remote_data->data, remote_data->size, &answers);
 	if (answers == NULL)
 		return;
+	if (num_ans == 0) {
+		free(answers);
+		return;
+	}
 
 	logger_write(LOGGER_INFO, "update_cache(): Trying to update a cache.");
 	try_update_a_cache(answers, num_ans);
@@ -273,7 +1064,726 @@ void update_cache(raw_data *remote_data)
 
 	logger_write(LOGGER_INFO, "update_cache(): Trying to update aaaa cache.");
 	try_update_aaaa_cache(answers, num_ans);
+
 	logger_write(LOGGER_INFO, "update_cache(): Update Cache Finished.");
 
 	free(answers);
 }
+
+/**
+ * 定期删除已过期的entry。每批最多删除cache_reap_batch个，批之间释放写锁，
+ * 避免读者长时间等待。
+ */
+static void __reap(void *_)
+{
+	const relay_config *config = get_config();
+	size_t batch = DNS_SERVER_MAX(config->cache_reap_batch, 1);
+
+	for (size_t i = 0; i < ((size_t)1 << shard_bits); i++) {
+		cache_shard *shard = &shards[i];
+		BOOL more = TRUE;
+
+		while (more) {
+			time_t now = time(NULL);
+			size_t num = 0;
+
+			__lock_shard(shard);
+			while (num < batch) {
+				heap_node *top = heap_top(shard->expire_heap);
+				if (top == NULL ||
+				    top->priority > (uint64_t)now)
+					break;
+
+				__remove_entry(shard, expire_node_entry(top));
+				num++;
+			}
+			shard->reaped += num;
+			more = num == batch;
+			__write_unlock(shard);
+		}
+	}
+	ebr_collect();
+
+	timer_add(config->cache_reap_interval_ms, __reap, NULL);
+}
+
+/**
+ * 快照文件：snapshot_header之后是num_entries个entry，每个entry为snapshot_entry、
+ * key、value，各部分都填充到8字节对齐，mmap后可以原地读取。
+ * value为内存中的结构体原样保存（domain数组结尾之后清零），A、AAAA依次保存list中的
+ * 每条记录。加载时cache直接使用映射中的value，不再复制，A、AAAA只为list和节点
+ * 从arena分配内存；映射和arena在所有这样的value都被EBR释放后才释放。
+ * 因此快照只能被结构体布局相同的程序读取，layout不同时拒绝加载。
+ */
+#define SNAPSHOT_MAGIC "DRCS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 8
+/* 每个加载线程至少分到的字节数，快照较小时不值得开线程 */
+#define SNAPSHOT_MIN_RANGE (4 * 1024 * 1024)
+/* 加载时连续这么多个entry在同一个分片中时才重新加锁 */
+#define SNAPSHOT_LOCK_BATCH 256
+#define SNAPSHOT_ARENA_BLOCK (1024 * 1024)
+
+typedef struct snapshot_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t layout;
+	uint32_t reserved;
+	int64_t saved_at;
+	uint64_t num_entries;
+	uint64_t body_size;
+	uint64_t checksum; /* body的校验和 */
+} snapshot_header;
+
+typedef struct snapshot_entry {
+	uint32_t value_size; /* 编码后的大小，包括填充 */
+	uint16_t type;
+	uint16_t key_len;
+	uint8_t kind;
+	uint8_t reserved[7];
+} snapshot_entry;
+
+typedef struct snapshot_buf {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} snapshot_buf;
+
+/* 加载时为A、AAAA的list分配内存，只能整体释放 */
+typedef struct snapshot_arena {
+	struct snapshot_arena *next;
+	size_t used;
+	_Alignas(SNAPSHOT_ALIGN) uint8_t data[];
+} snapshot_arena;
+
+/* 一个加载线程负责的entry范围 */
+typedef struct snapshot_range {
+	const uint8_t *begin;
+	const uint8_t *end;
+	time_t now;
+	pthread_t thread;
+	BOOL threaded; /* 是否在单独的线程中加载 */
+	snapshot_arena *arena; /* 当前的块在链表头 */
+	size_t loaded;
+	size_t expired;
+	BOOL corrupted;
+} snapshot_range;
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_flag snapshot_running = ATOMIC_FLAG_INIT;
+
+/* 启动时加载的快照，释放后map为NULL */
+static _Atomic(const uint8_t *) snapshot_map;
+static size_t snapshot_map_size;
+static snapshot_arena *snapshot_arenas;
+/* 使用映射的value数，加载期间另加1 */
+static atomic_size_t snapshot_refs;
+
+#define SNAPSHOT_PAD(size)                                                     \
+	(((size) + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1))
+#define SNAPSHOT_CHECKSUM_INIT 14695981039346656037ull
+
+/* 各value结构体的大小和字节序，任何一个变化都会使旧快照失效 */
+static uint32_t __snapshot_layout(void)
+{
+	const uint32_t sizes[] = {
+		sizeof(a_answer_t),	    sizeof(aaaa_answer_t),
+		sizeof(cname_answer_t),	    sizeof(negative_answer_t),
+		sizeof(rrset_answer_t),	    sizeof(packet_answer_t),
+		sizeof(snapshot_entry),	    sizeof(time_t),
+		DOMAIN_NAME_MAX_LENGTH,	    0x01020304,
+	};
+	uint32_t hash = 2166136261u;
+	const uint8_t *bytes = (const uint8_t *)sizes;
+
+	for (size_t i = 0; i < sizeof(sizes); i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* 按8字节计算的FNV-1a，size须为SNAPSHOT_ALIGN的倍数 */
+static uint64_t __snapshot_checksum(uint64_t hash, const uint8_t *data,
+				    size_t size)
+{
+	for (size_t i = 0; i < size; i += SNAPSHOT_ALIGN) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static size_t __record_size(uint16_t type)
+{
+	return type == TYPE_A ? sizeof(a_answer_t) : sizeof(aaaa_answer_t);
+}
+
+/* 一条记录的定长部分，list为一条记录的大小 */
+static size_t __head_size(uint8_t kind, uint16_t type)
+{
+	if (kind == ENTRY_NEGATIVE)
+		return sizeof(negative_answer_t);
+	if (kind == ENTRY_PACKET)
+		return sizeof(packet_answer_t);
+	if (__is_list(kind, type))
+		return __record_size(type);
+	return type == TYPE_CNAME ? sizeof(cname_answer_t) :
+				    sizeof(rrset_answer_t);
+}
+
+/**
+ * @return buf中新增的size字节，填充部分已清零。buf->data可能被重新分配
+ */
+static uint8_t *__snapshot_reserve(snapshot_buf *buf, size_t size)
+{
+	size_t padded = SNAPSHOT_PAD(size);
+
+	if (buf->size + padded > buf->capacity) {
+		size_t capacity = DNS_SERVER_MAX(buf->capacity * 2, 4096);
+		while (capacity < buf->size + padded)
+			capacity *= 2;
+		uint8_t *data = (uint8_t *)realloc(buf->data, capacity);
+		if (data == NULL) {
+			logger_write(
+				LOGGER_ERROR,
+				"save_cache_snapshot(): Failed to allocate %zu bytes.",
+				capacity);
+			exit(1);
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+
+	uint8_t *res = buf->data + buf->size;
+	memset(res + size, 0, padded - size);
+	buf->size += padded;
+	return res;
+}
+
+static void __snapshot_write_record(snapshot_buf *buf, uint8_t kind,
+				    uint16_t type, const void *rec)
+{
+	size_t size = __is_list(kind, type) ?
+			      __record_size(type) :
+			      __flat_value_size(kind, type, rec);
+	uint8_t *dest = __snapshot_reserve(buf, size);
+
+	memcpy(dest, rec, size);
+	/* 除整包外，value都以domain数组开头，结尾之后是无用的内容 */
+	if (kind != ENTRY_PACKET) {
+		size_t len = strnlen((const char *)dest,
+				     DOMAIN_NAME_MAX_LENGTH - 1);
+		memset(dest + len, 0, DOMAIN_NAME_MAX_LENGTH - len);
+	}
+}
+
+static void __snapshot_write_entry(snapshot_buf *buf, const cache_entry *entry)
+{
+	size_t head_pos = buf->size;
+	__snapshot_reserve(buf, sizeof(snapshot_entry));
+	memcpy(__snapshot_reserve(buf, entry->key_len), entry->key,
+	       entry->key_len);
+
+	size_t value_pos = buf->size;
+	void *value = entry->value;
+	if (__is_list(entry->kind, entry->type)) {
+		foreach_list(i, (list *)value)
+		{
+			__snapshot_write_record(buf, entry->kind, entry->type,
+						i->value);
+		}
+	} else {
+		__snapshot_write_record(buf, entry->kind, entry->type, value);
+	}
+
+	snapshot_entry head;
+	memset(&head, 0, sizeof(head));
+	head.value_size = (uint32_t)(buf->size - value_pos);
+	head.type = entry->type;
+	head.key_len = (uint16_t)entry->key_len;
+	head.kind = entry->kind;
+	memcpy(buf->data + head_pos, &head, sizeof(head));
+}
+
+/**
+ * 每个分片在持有写锁期间序列化到内存中，释放锁后再写入文件。
+ * 先写入临时文件，完成后rename，读到的快照总是完整的。
+ */
+BOOL save_cache_snapshot(const char *path)
+{
+	char tmp_path[CONFIG_PATH_MAX_SIZE + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	pthread_mutex_lock(&snapshot_lock);
+	uint64_t start = timer_now_ms();
+	FILE *file = fopen(tmp_path, "wb");
+	if (file == NULL) {
+		logger_write(LOGGER_WARNING,
+			     "save_cache_snapshot(): Failed to open %s.",
+			     tmp_path);
+		pthread_mutex_unlock(&snapshot_lock);
+		return FALSE;
+	}
+
+	snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(header);
+	header.layout = __snapshot_layout();
+	header.saved_at = time(NULL);
+	header.checksum = SNAPSHOT_CHECKSUM_INIT;
+
+	BOOL ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	snapshot_buf buf = { NULL, 0, 0 };
+
+	for (size_t i = 0; ok && i < ((size_t)1 << shard_bits); i++) {
+		cache_shard *shard = &shards[i];
+		time_t now = time(NULL);
+
+		buf.size = 0;
+		pthread_mutex_lock(&shard->lock);
+		for (size_t pos = 0; pos < hash_table_capacity(shard->table);
+		     pos++) {
+			const char *key = NULL;
+			size_t key_len = 0;
+			uint16_t type = 0;
+			cache_entry *entry = (cache_entry *)hash_table_slot(
+				shard->table, pos, &key, &key_len, &type);
+			if (entry == NULL || __entry_dead(entry, now))
+				continue;
+
+			__snapshot_write_entry(&buf, entry);
+			header.num_entries++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+
+		header.checksum = __snapshot_checksum(header.checksum,
+						      buf.data, buf.size);
+		header.body_size += buf.size;
+		ok = buf.size == 0 || fwrite(buf.data, buf.size, 1, file) == 1;
+	}
+	free(buf.data);
+
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+	     fwrite(&header, sizeof(header), 1, file) == 1 &&
+	     fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+	ok = ok && rename(tmp_path, path) == 0;
+	if (!ok) {
+		logger_write(LOGGER_WARNING,
+			     "save_cache_snapshot(): Failed to write %s.", path);
+		remove(tmp_path);
+	} else {
+		logger_write(
+			LOGGER_INFO,
+			"save_cache_snapshot(): Saved %llu entries (%llu bytes) to %s in %llu ms.",
+			(unsigned long long)header.num_entries,
+			(unsigned long long)header.body_size, path,
+			(unsigned long long)(timer_now_ms() - start));
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	return ok;
+}
+
+/* 回复时会按value中记录的偏移改写TTL，偏移必须在范围内 */
+static BOOL __snapshot_check_value(uint8_t kind, const void *value)
+{
+	if (kind == ENTRY_NEGATIVE) {
+		const negative_answer_t *rec = (const negative_answer_t *)value;
+		return rec->soa_ttl_offset + sizeof(uint32_t) <= rec->soa_size;
+	}
+	if (kind == ENTRY_PACKET) {
+		const packet_answer_t *rec = (const packet_answer_t *)value;
+		for (size_t i = 0; i < rec->num_ttl; i++)
+			if (packet_ttl_offsets(rec)[i] + sizeof(uint32_t) >
+			    rec->size)
+				return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * 检查映射中的一条记录，记录之后原地使用
+ * @return 下一条记录的位置，数据不完整或无效时返回NULL
+ */
+static const uint8_t *__snapshot_read_record(const uint8_t *data,
+					     const uint8_t *end, uint8_t kind,
+					     uint16_t type)
+{
+	size_t avail = (size_t)(end - data);
+
+	if (avail < __head_size(kind, type) ||
+	    (kind != ENTRY_PACKET &&
+	     memchr(data, '\0', DOMAIN_NAME_MAX_LENGTH) == NULL))
+		return NULL;
+
+	size_t size = __is_list(kind, type) ?
+			      __record_size(type) :
+			      __flat_value_size(kind, type, data);
+	if (avail < SNAPSHOT_PAD(size) || !__snapshot_check_value(kind, data))
+		return NULL;
+	return data + SNAPSHOT_PAD(size);
+}
+
+static void *__arena_alloc(snapshot_range *range, size_t size)
+{
+	snapshot_arena *arena = range->arena;
+
+	size = SNAPSHOT_PAD(size);
+	if (arena == NULL ||
+	    arena->used + size > SNAPSHOT_ARENA_BLOCK - sizeof(snapshot_arena)) {
+		size_t capacity = DNS_SERVER_MAX(
+			size, SNAPSHOT_ARENA_BLOCK - sizeof(snapshot_arena));
+		arena = (snapshot_arena *)malloc(sizeof(snapshot_arena) +
+						 capacity);
+		if (arena == NULL) {
+			logger_write(LOGGER_ERROR,
+				     "cache(): Failed to allocate %zu bytes.",
+				     capacity);
+			exit(1);
+		}
+		arena->next = range->arena;
+		arena->used = 0;
+		range->arena = arena;
+	}
+
+	void *res = arena->data + arena->used;
+	arena->used += size;
+	return res;
+}
+
+/**
+ * @return 指向[data, end)的value，A、AAAA为在arena中建立的list，数据无效时返回NULL
+ */
+static void *__snapshot_read_value(snapshot_range *range, const uint8_t *data,
+				   const uint8_t *end, uint8_t kind,
+				   uint16_t type)
+{
+	if (kind > ENTRY_PACKET)
+		return NULL;
+	if (!__is_list(kind, type))
+		return __snapshot_read_record(data, end, kind, type) == end ?
+			       (void *)data :
+			       NULL;
+
+	/* 记录都是定长的，list和所有节点（包括末尾的哨兵）一次分配 */
+	size_t num = (size_t)(end - data) / SNAPSHOT_PAD(__record_size(type));
+	if (num == 0)
+		return NULL;
+	list *records = (list *)__arena_alloc(
+		range, sizeof(list) + (num + 1) * sizeof(struct __list_node));
+	struct __list_node *nodes = (struct __list_node *)(records + 1);
+
+	for (size_t i = 0; i <= num; i++) {
+		nodes[i].pre = i > 0 ? &nodes[i - 1] : NULL;
+		nodes[i].next = i < num ? &nodes[i + 1] : NULL;
+		nodes[i].value = i < num ? (void *)data : NULL;
+		nodes[i].belong_to = records;
+		if (i < num)
+			data = __snapshot_read_record(data, end, kind, type);
+		if (data == NULL)
+			return NULL;
+	}
+	if (data != end)
+		return NULL;
+	records->begin = &nodes[0];
+	records->end = &nodes[num];
+	records->size = num;
+	return records;
+}
+
+/**
+ * @return 下一个entry的位置，越界时返回NULL
+ */
+static const uint8_t *__snapshot_next(const uint8_t *data, const uint8_t *end)
+{
+	const snapshot_entry *head = (const snapshot_entry *)data;
+	if ((size_t)(end - data) < sizeof(snapshot_entry) ||
+	    head->key_len == 0 || head->key_len > CACHE_KEY_MAX_SIZE ||
+	    head->value_size % SNAPSHOT_ALIGN)
+		return NULL;
+
+	size_t size = sizeof(snapshot_entry) + SNAPSHOT_PAD(head->key_len) +
+		      head->value_size;
+	return (size_t)(end - data) < size ? NULL : data + size;
+}
+
+static BOOL __snapshot_owns(const void *ptr)
+{
+	const uint8_t *map = atomic_load(&snapshot_map);
+	return map != NULL && (const uint8_t *)ptr >= map &&
+	       (const uint8_t *)ptr < map + snapshot_map_size;
+}
+
+/**
+ * 释放一个value对映射的引用，最后一个引用释放时解除映射并释放arena
+ */
+static void __snapshot_release(void *_)
+{
+	if (atomic_fetch_sub(&snapshot_refs, 1) != 1)
+		return;
+
+	const uint8_t *map = atomic_exchange(&snapshot_map, NULL);
+	munmap((void *)map, snapshot_map_size);
+	while (snapshot_arenas != NULL) {
+		snapshot_arena *next = snapshot_arenas->next;
+		free(snapshot_arenas);
+		snapshot_arenas = next;
+	}
+	logger_write(LOGGER_DEBUG,
+		     "cache(): All entries from the snapshot are gone.");
+}
+
+static void __load_unlock(cache_shard *shard)
+{
+	__evict_no_lock(shard);
+	__write_unlock(shard);
+}
+
+static void *__load_range(void *arg)
+{
+	snapshot_range *range = (snapshot_range *)arg;
+	const uint8_t *data = range->begin;
+	cache_shard *locked = NULL;
+	size_t batch = 0;
+
+	while (data < range->end) {
+		const snapshot_entry *head = (const snapshot_entry *)data;
+		const uint8_t *next = __snapshot_next(data, range->end);
+		const char *key = (const char *)data + sizeof(snapshot_entry);
+		void *value =
+			next == NULL ?
+				NULL :
+				__snapshot_read_value(
+					range, next - head->value_size, next,
+					head->kind, head->type);
+		if (value == NULL) {
+			range->corrupted = TRUE;
+			break;
+		}
+		data = next;
+
+		/* 过期的A、AAAA的list留在arena中，和快照一起释放 */
+		if (__value_expire(head->kind, head->type, value) +
+			    stale_window <=
+		    (uint64_t)range->now) {
+			range->expired++;
+			continue;
+		}
+
+		/* 快照按分片顺序保存，相邻的entry基本都在同一个分片中 */
+		cache_shard *shard = __shard_of(key, head->key_len);
+		if (shard != locked || batch == SNAPSHOT_LOCK_BATCH) {
+			if (locked != NULL)
+				__load_unlock(locked);
+			__lock_shard(shard);
+			locked = shard;
+			batch = 0;
+		}
+		atomic_fetch_add_explicit(&snapshot_refs, 1,
+					  memory_order_relaxed);
+		__set_entry_key(shard, key, head->key_len, head->type,
+				head->kind, value);
+		batch++;
+		range->loaded++;
+	}
+	if (locked != NULL)
+		__load_unlock(locked);
+	return NULL;
+}
+
+/**
+ * 按字节数把body大致均分给num_ranges个线程，边界对齐到entry
+ * @return 实际的范围数
+ */
+static size_t __split_ranges(const uint8_t *body, size_t body_size,
+			     snapshot_range *ranges, size_t num_ranges)
+{
+	const uint8_t *data = body;
+	const uint8_t *end = body + body_size;
+	size_t num = 0;
+
+	while (num < num_ranges && data < end) {
+		const uint8_t *limit = body + body_size * (num + 1) / num_ranges;
+
+		ranges[num].begin = data;
+		/* 最后一段不用逐个entry走到结尾 */
+		if (num + 1 == num_ranges)
+			data = end;
+		while (data != NULL && data < limit)
+			data = __snapshot_next(data, end);
+		/* 损坏的entry留给最后一个范围报告 */
+		if (data == NULL)
+			data = end;
+		ranges[num++].end = data;
+	}
+	return num;
+}
+
+/**
+ * 启动时加载快照，TTL按保存时的last_update计算，已经过期的entry不加载。
+ * 快照不存在或无效时从空cache开始。快照按分片顺序保存，因此分成几段并行加载时
+ * 各线程基本不会竞争同一个分片的锁。
+ */
+static void __load_snapshot(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		logger_write(LOGGER_DEBUG, "cache(): No snapshot at %s.", path);
+		return;
+	}
+
+	uint64_t start = timer_now_ms();
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(snapshot_header)) {
+		logger_write(LOGGER_WARNING,
+			     "cache(): Snapshot %s is truncated. Ignored.", path);
+		close(fd);
+		return;
+	}
+
+	size_t file_size = (size_t)st.st_size;
+	const uint8_t *data = (const uint8_t *)mmap(NULL, file_size, PROT_READ,
+						    MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		logger_write(LOGGER_WARNING,
+			     "cache(): Failed to map snapshot %s. Ignored.",
+			     path);
+		return;
+	}
+	madvise((void *)data, file_size, MADV_WILLNEED);
+
+	const snapshot_header *header = (const snapshot_header *)data;
+	const uint8_t *body = data + sizeof(snapshot_header);
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->header_size != sizeof(snapshot_header) ||
+	    header->layout != __snapshot_layout() ||
+	    header->body_size != file_size - sizeof(snapshot_header) ||
+	    header->body_size % SNAPSHOT_ALIGN != 0 ||
+	    header->checksum != __snapshot_checksum(SNAPSHOT_CHECKSUM_INIT,
+						    body, header->body_size)) {
+		logger_write(LOGGER_WARNING,
+			     "cache(): Snapshot %s is invalid. Ignored.", path);
+		munmap((void *)data, file_size);
+		return;
+	}
+
+	/* 一次扩容到位，避免加载过程中反复rehash。分片之间不完全均匀，多留1/8 */
+	size_t num_shards = (size_t)1 << shard_bits;
+	size_t per_shard = (size_t)(header->num_entries >> shard_bits);
+	per_shard += per_shard / 8;
+	if (max_entries)
+		per_shard = DNS_SERVER_MIN(per_shard, max_entries);
+	for (size_t i = 0; i < num_shards; i++) {
+		__lock_shard(&shards[i]);
+		hash_table_reserve(shards[i].table, per_shard);
+		__write_unlock(&shards[i]);
+	}
+
+	size_t num_threads = DNS_SERVER_MIN(config_threads(), num_shards);
+	num_threads = DNS_SERVER_MIN(
+		num_threads, header->body_size / SNAPSHOT_MIN_RANGE + 1);
+	snapshot_range *ranges =
+		(snapshot_range *)calloc(num_threads, sizeof(snapshot_range));
+	size_t num_ranges =
+		__split_ranges(body, header->body_size, ranges, num_threads);
+
+	/* value被替换或淘汰时随时可能释放引用，加载完之前不能解除映射 */
+	snapshot_map_size = file_size;
+	atomic_store(&snapshot_refs, 1);
+	atomic_store(&snapshot_map, data);
+
+	/* 第一段由当前线程加载，线程创建失败的段也是 */
+	time_t now = time(NULL);
+	for (size_t i = 0; i < num_ranges; i++) {
+		ranges[i].now = now;
+		ranges[i].threaded = i > 0 && pthread_create(&ranges[i].thread,
+							     NULL, __load_range,
+							     &ranges[i]) == 0;
+	}
+	for (size_t i = 0; i < num_ranges; i++)
+		if (!ranges[i].threaded)
+			__load_range(&ranges[i]);
+
+	size_t loaded = 0;
+	size_t expired = 0;
+	BOOL corrupted = FALSE;
+	for (size_t i = 0; i < num_ranges; i++) {
+		if (ranges[i].threaded)
+			pthread_join(ranges[i].thread, NULL);
+		loaded += ranges[i].loaded;
+		expired += ranges[i].expired;
+		corrupted = corrupted || ranges[i].corrupted;
+
+		while (ranges[i].arena != NULL) {
+			snapshot_arena *arena = ranges[i].arena;
+			ranges[i].arena = arena->next;
+			arena->next = snapshot_arenas;
+			snapshot_arenas = arena;
+		}
+	}
+	free(ranges);
+	__snapshot_release(NULL);
+
+	if (corrupted)
+		logger_write(LOGGER_WARNING,
+			     "cache(): Snapshot %s is partially corrupted.",
+			     path);
+	logger_write(
+		LOGGER_INFO,
+		"cache(): Loaded %zu entries from snapshot %s in %llu ms with %zu threads, %zu expired.",
+		loaded, path, (unsigned long long)(timer_now_ms() - start),
+		num_ranges, expired);
+}
+
+static void *__snapshot_thread(void *_)
+{
+	save_cache_snapshot(get_config()->cache_snapshot);
+	atomic_flag_clear(&snapshot_running);
+	return NULL;
+}
+
+/**
+ * 定期保存快照。保存可能需要较长时间，在单独的线程中进行，避免阻塞timer线程
+ */
+static void __save_snapshot(void *_)
+{
+	const relay_config *config = get_config();
+
+	if (!atomic_flag_test_and_set(&snapshot_running)) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, __snapshot_thread, NULL) == 0)
+			pthread_detach(thread);
+		else
+			atomic_flag_clear(&snapshot_running);
+	}
+
+	timer_add(config->cache_snapshot_interval_ms, __save_snapshot, NULL);
+}
+
+void get_cache_stats(cache_stats *stats)
+{
+	memset(stats, 0, sizeof(cache_stats));
+	for (size_t i = 0; i < ((size_t)1 << shard_bits); i++) {
+		cache_shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->entries += hash_table_size(shard->table);
+		stats->bytes += shard->bytes + hash_table_memory(shard->table);
+		stats->evicted += shard->evicted;
+		stats->reaped += shard->reaped;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	stats->prefetched =
+		atomic_load_explicit(&prefetch_issued, memory_order_relaxed);
+	stats->prefetch_useful =
+		atomic_load_explicit(&prefetch_useful, memory_order_relaxed);
+}
@@ -37,14 +37,86 @@ typedef struct pure_response {
     raw_data data;
 } pure_response;
 
+typedef struct cache_stats {
+    size_t entries;
+    size_t bytes; /* 估算的内存占用，包括哈希表本身 */
+    size_t evicted; /* 因超出内存预算被淘汰的entry数 */
+    size_t reaped; /* 过期后被后台删除的entry数 */
+    size_t prefetched; /* 快过期时提前发出的刷新数 */
+    size_t prefetch_useful; /* 在过期前刷新成功并且之后又被命中的预取数 */
+} cache_stats;
+
 extern void init_cache_pools(void);
 
-extern list *query_A_record(const char *domain);
+typedef struct cache_shard cache_shard;
+
+/**
+ * 读者不加锁，查询得到的指针在cache_read_begin()和cache_read_end()之间一直有效，
+ * 更新和淘汰释放的旧记录要等所有读者结束后才真正释放（见ebr.h）。期间不应阻塞。
+ */
+extern void cache_read_begin(void);
+extern void cache_read_end(void);
+
+/**
+ * 以下查询函数须在cache_read_begin()之后调用。
+ * 被查询过prefetch_hits次的记录剩余TTL不超过prefetch_percent时设置refresh，
+ * 调用者应在后台刷新，否则不修改refresh。
+ */
+extern list *query_A_record(const char *domain, out BOOL *refresh);
+
+extern cname_answer_t *query_CNAME_record(const char *domain,
+					  out BOOL *refresh);
+
+extern list *query_AAAA_record(const char *domain, out BOOL *refresh);
+
+/**
+ * 查找A、AAAA、CNAME以外类型的记录集合，已过期的不返回
+ */
+extern rrset_answer_t *query_rrset_record(const char *domain, uint16_t type);
+
+/**
+ * 查找domain的NXDOMAIN，或者qtype的NODATA记录，已过期的不返回
+ */
+extern negative_answer_t *query_negative_record(const char *domain,
+						uint16_t qtype);
 
-extern cname_answer_t *query_CNAME_record(const char *domain);
+/**
+ * 开启serve_stale时，过期不超过serve_stale_window秒的记录仍可以使用（RFC 8767）
+ */
+extern BOOL cache_stale_usable(time_t last_update, uint32_t ttl);
+#define answer_stale_usable(ans) \
+	cache_stale_usable((ans)->last_update, (ans)->ttl)
 
-extern list *query_AAAA_record(const char *domain);
+/**
+ * 在整包缓存中查找与query的域名、类型、CD/DO位相同的回复，复制到dest并修改ID和TTL。
+ * 过期但还能使用的回复所有TTL改为serve_stale_ttl。
+ * 回复已过期或需要预取时设置refresh，调用者应在后台刷新。
+ * 不需要调用cache_read_begin()。
+ * @return 回复的大小，未命中时返回0
+ */
+extern size_t query_packet_record(const void *query, size_t q_size,
+				  out void *dest, size_t dest_size,
+				  out BOOL *refresh);
 
+/**
+ * 过期的entry由后台每cache_reap_interval_ms分批删除。
+ * 用回复中的记录更新cache，MX、TXT等类型只缓存owner为查询域名的记录，超出cache_max_bytes/cache_max_entries时按CLOCK淘汰。
+ */
 extern void update_cache(raw_data *remote_data);
 
+/**
+ * upstream回复了一个有客户端在等待的查询。预取的预算按它的速率计算，
+ * 预取和其他后台刷新的回复不计入，否则预取会抬高自己的预算。
+ */
+extern void cache_count_client_reply(void);
+
+extern void get_cache_stats(cache_stats *stats);
+
+/**
+ * 把未过期的entry保存为快照，init_cache_pools()启动时从配置的cache_snapshot加载。
+ * 退出时和每cache_snapshot_interval_ms保存一次。
+ * @return 是否保存成功
+ */
+extern BOOL save_cache_snapshot(const char *path);
+
 #endif /* CORE_CACHE_H_ */
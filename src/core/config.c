@@ -0,0 +1,263 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "logger.h"
+#include "unidef.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+typedef enum CONFIG_TYPE {
+	CONFIG_SIZE = 0,
+	CONFIG_BOOL = 1,
+	CONFIG_PATH = 2, /* char[CONFIG_PATH_MAX_SIZE] */
+} CONFIG_TYPE;
+
+typedef struct config_item {
+	const char *name;
+	CONFIG_TYPE type;
+	size_t offset;
+} config_item;
+
+static relay_config config = {
+	.threads = 0,
+	.reuseport = FALSE,
+	.io_uring = FALSE,
+	.request_queue_size = 4096,
+	.request_pool_size = 4096,
+	.worker_spin = 2000,
+	.batch_size = 32,
+	.batch_flush_us = 200,
+	.cache_max_bytes = 64 * 1024 * 1024,
+	.cache_max_entries = 0,
+	.cache_reap_interval_ms = 1000,
+	.cache_reap_batch = 256,
+	.cache_shards = 16,
+	.negative_ttl_max = 900,
+	.cache_snapshot = "",
+	.cache_snapshot_interval_ms = 300000,
+	.serve_stale = FALSE,
+	.serve_stale_window = 86400,
+	.serve_stale_ttl = 30,
+	.prefetch = TRUE,
+	.prefetch_hits = 3,
+	.prefetch_percent = 10,
+	.prefetch_budget = 10,
+	.hedge = FALSE,
+	.hedge_race = FALSE,
+	.hedge_percent = 5,
+	.upstream_retries = 2,
+	.upstream_tcp = FALSE,
+};
+
+static const config_item config_items[] = {
+	{ "threads", CONFIG_SIZE, offsetof(relay_config, threads) },
+	{ "reuseport", CONFIG_BOOL, offsetof(relay_config, reuseport) },
+	{ "io_uring", CONFIG_BOOL, offsetof(relay_config, io_uring) },
+	{ "request_queue_size", CONFIG_SIZE,
+	  offsetof(relay_config, request_queue_size) },
+	{ "request_pool_size", CONFIG_SIZE,
+	  offsetof(relay_config, request_pool_size) },
+	{ "worker_spin", CONFIG_SIZE, offsetof(relay_config, worker_spin) },
+	{ "batch_size", CONFIG_SIZE, offsetof(relay_config, batch_size) },
+	{ "batch_flush_us", CONFIG_SIZE,
+	  offsetof(relay_config, batch_flush_us) },
+	{ "cache_max_bytes", CONFIG_SIZE,
+	  offsetof(relay_config, cache_max_bytes) },
+	{ "cache_max_entries", CONFIG_SIZE,
+	  offsetof(relay_config, cache_max_entries) },
+	{ "cache_reap_interval_ms", CONFIG_SIZE,
+	  offsetof(relay_config, cache_reap_interval_ms) },
+	{ "cache_reap_batch", CONFIG_SIZE,
+	  offsetof(relay_config, cache_reap_batch) },
+	{ "cache_shards", CONFIG_SIZE, offsetof(relay_config, cache_shards) },
+	{ "negative_ttl_max", CONFIG_SIZE,
+	  offsetof(relay_config, negative_ttl_max) },
+	{ "cache_snapshot", CONFIG_PATH,
+	  offsetof(relay_config, cache_snapshot) },
+	{ "cache_snapshot_interval_ms", CONFIG_SIZE,
+	  offsetof(relay_config, cache_snapshot_interval_ms) },
+	{ "serve_stale", CONFIG_BOOL, offsetof(relay_config, serve_stale) },
+	{ "serve_stale_window", CONFIG_SIZE,
+	  offsetof(relay_config, serve_stale_window) },
+	{ "serve_stale_ttl", CONFIG_SIZE,
+	  offsetof(relay_config, serve_stale_ttl) },
+	{ "prefetch", CONFIG_BOOL, offsetof(relay_config, prefetch) },
+	{ "prefetch_hits", CONFIG_SIZE, offsetof(relay_config, prefetch_hits) },
+	{ "prefetch_percent", CONFIG_SIZE,
+	  offsetof(relay_config, prefetch_percent) },
+	{ "prefetch_budget", CONFIG_SIZE,
+	  offsetof(relay_config, prefetch_budget) },
+	{ "hedge", CONFIG_BOOL, offsetof(relay_config, hedge) },
+	{ "hedge_race", CONFIG_BOOL, offsetof(relay_config, hedge_race) },
+	{ "hedge_percent", CONFIG_SIZE, offsetof(relay_config, hedge_percent) },
+	{ "upstream_retries", CONFIG_SIZE,
+	  offsetof(relay_config, upstream_retries) },
+	{ "upstream_tcp", CONFIG_BOOL, offsetof(relay_config, upstream_tcp) },
+};
+
+#define NUM_CONFIG_ITEMS (sizeof(config_items) / sizeof(config_items[0]))
+
+static char *__trim(char *str)
+{
+	while (isspace((unsigned char)str[0]))
+		str++;
+
+	size_t len = strlen(str);
+	while (len && isspace((unsigned char)str[len - 1]))
+		str[--len] = '\0';
+	return str;
+}
+
+static BOOL __set_item(const config_item *item, const char *value)
+{
+	char *end = NULL;
+
+	switch (item->type) {
+	case CONFIG_SIZE: {
+		unsigned long long val = strtoull(value, &end, 10);
+		if (end == value)
+			return FALSE;
+
+		/* 允许K、M、G后缀 */
+		switch (toupper((unsigned char)*end)) {
+		case 'G':
+			val *= 1024;
+			/* fall through */
+		case 'M':
+			val *= 1024;
+			/* fall through */
+		case 'K':
+			val *= 1024;
+			end++;
+			break;
+		default:
+			break;
+		}
+		if (*end != '\0')
+			return FALSE;
+		*(size_t *)((char *)&config + item->offset) = (size_t)val;
+		return TRUE;
+	}
+	case CONFIG_BOOL: {
+		BOOL *val = (BOOL *)((char *)&config + item->offset);
+		if (!strcasecmp(value, "1") || !strcasecmp(value, "yes") ||
+		    !strcasecmp(value, "true") || !strcasecmp(value, "on"))
+			*val = TRUE;
+		else if (!strcasecmp(value, "0") || !strcasecmp(value, "no") ||
+			 !strcasecmp(value, "false") || !strcasecmp(value, "off"))
+			*val = FALSE;
+		else
+			return FALSE;
+		return TRUE;
+	}
+	case CONFIG_PATH: {
+		if (strlen(value) >= CONFIG_PATH_MAX_SIZE)
+			return FALSE;
+		strcpy((char *)&config + item->offset, value);
+		return TRUE;
+	}
+	default:
+		return FALSE;
+	}
+}
+
+static void __parse_line(char *line, int line_no)
+{
+	char *comment = strchr(line, '#');
+	if (comment != NULL)
+		comment[0] = '\0';
+
+	char *key = __trim(line);
+	if (key[0] == '\0')
+		return;
+
+	char *value = strchr(key, '=');
+	if (value == NULL) {
+		logger_write(LOGGER_WARNING,
+			     "read_config(): Line %d: Missing '='. Ignored.",
+			     line_no);
+		return;
+	}
+	value[0] = '\0';
+	key = __trim(key);
+	value = __trim(value + 1);
+
+	for (size_t i = 0; i < NUM_CONFIG_ITEMS; i++) {
+		if (strcmp(config_items[i].name, key) != 0)
+			continue;
+
+		if (!__set_item(&config_items[i], value))
+			logger_write(
+				LOGGER_WARNING,
+				"read_config(): Line %d: Invalid value \"%s\" for %s. Ignored.",
+				line_no, value, key);
+		return;
+	}
+
+	logger_write(LOGGER_WARNING,
+		     "read_config(): Line %d: Unknown key \"%s\". Ignored.",
+		     line_no, key);
+}
+
+void read_config(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		logger_write(LOGGER_DEBUG,
+			     "read_config(): %s not found. Using default config.",
+			     path);
+		return;
+	}
+
+	char line[1024];
+	int line_no = 0;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+		__parse_line(line, ++line_no);
+
+	fclose(file);
+	logger_write(LOGGER_DEBUG, "read_config(): Read config %s finished.",
+		     path);
+}
+
+const relay_config *get_config(void)
+{
+	return &config;
+}
+
+size_t config_threads(void)
+{
+	if (config.threads)
+		return config.threads;
+
+	long num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return num_cpu > 0 ? (size_t)num_cpu : 1;
+}
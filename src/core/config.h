@@ -0,0 +1,80 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_CONFIG_H_
+#define CORE_CONFIG_H_
+
+#include "unidef.h"
+
+#include <stddef.h>
+
+#define CONFIG_DEFAULT_PATH "./dns_relay.conf"
+#define CONFIG_PATH_MAX_SIZE 256
+
+typedef struct relay_config {
+	size_t threads; /* 工作线程数，0表示在线CPU数 */
+	BOOL reuseport; /* 每个线程使用自己的SO_REUSEPORT socket独立完成处理 */
+	BOOL io_uring; /* 使用io_uring接收请求，不可用时退回recvmmsg */
+	size_t request_queue_size;
+	size_t request_pool_size; /* 空闲request_data最多保留的数量，0表示不使用池 */
+	size_t worker_spin; /* 空闲工作线程park前最多自旋的次数，0表示不自旋 */
+	size_t batch_size; /* recvmmsg/sendmmsg一次最多处理的报文数 */
+	size_t batch_flush_us; /* 待发送的回复最多在批次中停留的时间 */
+	size_t cache_max_bytes; /* cache的内存预算，0表示不限制 */
+	size_t cache_max_entries; /* cache的entry数上限，0表示不限制 */
+	size_t cache_reap_interval_ms; /* 后台删除过期entry的间隔，0表示不删除 */
+	size_t cache_reap_batch; /* 每次持有写锁时最多删除的entry数 */
+	size_t cache_shards; /* cache的分片数，向上取整为2的幂 */
+	size_t negative_ttl_max; /* NXDOMAIN/NODATA缓存的最长秒数，0表示不缓存 */
+	char cache_snapshot[CONFIG_PATH_MAX_SIZE]; /* cache快照文件，空表示不保存 */
+	size_t cache_snapshot_interval_ms; /* 定期保存快照的间隔，0表示只在退出时保存 */
+	BOOL serve_stale; /* 过期的记录在窗口内继续使用，并在后台刷新（RFC 8767） */
+	size_t serve_stale_window; /* 过期后还能使用的秒数 */
+	size_t serve_stale_ttl; /* 过期记录回复给客户端的TTL */
+	BOOL prefetch; /* 常用的记录快过期时提前向upstream刷新 */
+	size_t prefetch_hits; /* 本次TTL内至少被查询多少次才预取 */
+	size_t prefetch_percent; /* 剩余TTL不超过原TTL的百分之多少时预取 */
+	size_t prefetch_budget; /* 预取不超过upstream回复速率的百分之多少 */
+	BOOL hedge; /* 回复慢时同时向第二个upstream查询，先到的回复有效 */
+	BOOL hedge_race; /* 不等待，转发时立即同时发给两个upstream */
+	size_t hedge_percent; /* 额外的查询不超过转发数的百分之多少 */
+	size_t upstream_retries; /* upstream超时后最多重传给其他upstream的次数 */
+	BOOL upstream_tcp; /* 所有查询都通过TCP连接池发给upstream */
+} relay_config;
+
+/**
+ * 读取配置文件，格式为每行一个"key = value"，'#'之后为注释。
+ * 文件不存在时使用默认配置。必须在其他模块初始化之前调用。
+ */
+extern void read_config(const char *path);
+
+extern const relay_config *get_config(void);
+
+/**
+ * @return 工作线程数。threads为0时返回在线CPU数
+ */
+extern size_t config_threads(void);
+
+#endif /* CORE_CONFIG_H_ */
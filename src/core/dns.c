@@ -54,6 +54,12 @@ void set_header_info(void *header, HEADER_ITEM qtype, uint16_t value)
 	__header[(int)qtype] = htons(value);
 }
 
+uint16_t response_flags(const void *query, uint16_t rcode)
+{
+	uint16_t flags = get_header_info(query, HEADER_FLAGS);
+	return FLAGS_QR | FLAGS_RA | (flags & (FLAGS_RD | FLAGS_CD)) | rcode;
+}
+
 static struct __query_meta __parse_query_info(const void *query, size_t qsize)
 {
 	struct __query_meta result;
@@ -430,6 +436,660 @@ size_t get_answers(const void *data, size_t data_size, answer_t **answer_list)
 	return num_answer;
 }
 
+size_t skip_name(const void *data, size_t data_size, const void *name)
+{
+	const uint8_t *data_end = (const uint8_t *)data + data_size;
+	const uint8_t *iter = (const uint8_t *)name;
+
+	while (iter < data_end) {
+		if ((*iter & 0xc0) == 0xc0)
+			return iter + 2 <= data_end ?
+				       (size_t)(iter + 2 - (const uint8_t *)name) :
+				       0;
+		if (*iter == 0)
+			return (size_t)(iter + 1 - (const uint8_t *)name);
+		iter += *iter + 1;
+	}
+	return 0;
+}
+
+size_t decompress_name(const void *data, size_t data_size, const void *name,
+		       uint8_t *dest, size_t dest_size)
+{
+	const uint8_t *data_begin = (const uint8_t *)data;
+	const uint8_t *iter = (const uint8_t *)name;
+	size_t len = 0;
+	/* 每次跳转都必须向前，防止指针构成环 */
+	const uint8_t *limit = iter;
+
+	while (iter >= data_begin && iter < data_begin + data_size) {
+		if ((*iter & 0xc0) == 0xc0) {
+			if (iter + 1 >= data_begin + data_size)
+				return 0;
+			size_t bias = ((iter[0] & 0x3f) << 8) | iter[1];
+			if (data_begin + bias >= limit)
+				return 0;
+			limit = data_begin + bias;
+			iter = limit;
+			continue;
+		}
+
+		size_t label_len = *iter + 1;
+		if (*iter == 0) {
+			if (len + 1 > dest_size)
+				return 0;
+			dest[len++] = 0;
+			return len;
+		}
+		if ((*iter & 0xc0) != 0 ||
+		    iter + label_len > data_begin + data_size ||
+		    len + label_len + 1 > DNS_SERVER_MIN(dest_size,
+							 DNS_NAME_MAX_SIZE))
+			return 0;
+
+		memcpy(dest + len, iter, label_len);
+		len += label_len;
+		iter += label_len;
+	}
+	return 0;
+}
+
+/**
+ * 把SOA记录解压后写入ans->soa
+ * @return 写入的字节数，失败时返回0
+ */
+static size_t __copy_soa(const uint8_t *data, size_t data_size,
+			 const uint8_t *rr, negative_answer_t *ans,
+			 size_t soa_capacity, uint32_t *minimum)
+{
+	const uint8_t *data_end = data + data_size;
+	uint8_t *dest = ans->soa;
+	size_t len = decompress_name(data, data_size, rr, dest, soa_capacity);
+	size_t name_len = skip_name(data, data_size, rr);
+
+	if (len == 0 || name_len == 0 || len + 10 > soa_capacity)
+		return 0;
+
+	const uint8_t *fixed = rr + name_len;
+	if (fixed + 10 > data_end)
+		return 0;
+	uint16_t rdlen = ntohs(*(uint16_t *)(fixed + 8));
+	const uint8_t *rdata = fixed + 10;
+	if (rdata + rdlen > data_end)
+		return 0;
+
+	/* type, class, ttl，rdlength稍后填写 */
+	memcpy(dest + len, fixed, 8);
+	ans->soa_ttl_offset = (uint16_t)(len + 4);
+	size_t rdlen_offset = len + 8;
+	len += 10;
+
+	/* MNAME和RNAME */
+	const uint8_t *iter = rdata;
+	for (int i = 0; i < 2; i++) {
+		size_t n = decompress_name(data, data_size, iter, dest + len,
+					   soa_capacity - len);
+		size_t skip = skip_name(data, data_size, iter);
+		if (n == 0 || skip == 0)
+			return 0;
+		len += n;
+		iter += skip;
+	}
+
+	/* SERIAL, REFRESH, RETRY, EXPIRE, MINIMUM */
+	if (iter + 20 > rdata + rdlen || len + 20 > soa_capacity)
+		return 0;
+	memcpy(dest + len, iter, 20);
+	*minimum = ntohl(*(uint32_t *)(iter + 16));
+	len += 20;
+
+	*(uint16_t *)(dest + rdlen_offset) = htons((uint16_t)(len - rdlen_offset - 2));
+	return len;
+}
+
+negative_answer_t *get_negative_answer(const void *data, size_t data_size)
+{
+	if (data_size < sizeof(dns_header))
+		return NULL;
+
+	uint16_t rcode = get_header_info(data, HEADER_FLAGS) & RCODE_MASK;
+	if ((rcode != RCODE_NO_ERROR && rcode != RCODE_NAME_ERROR) ||
+	    get_header_info(data, HEADER_QUESTION) != 1 ||
+	    get_header_info(data, HEADER_ANSWER) != 0)
+		return NULL;
+
+	query_meta query = parse_query(data, data_size);
+	if (query.query_end == NULL)
+		return NULL;
+
+	const uint8_t *data_end = (const uint8_t *)data + data_size;
+	const uint8_t *rr = (const uint8_t *)query.query_end;
+	uint16_t num_authority = get_header_info(data, HEADER_AUTHORITY);
+
+	for (uint16_t i = 0; i < num_authority && rr < data_end; i++) {
+		size_t name_len = skip_name(data, data_size, rr);
+		if (name_len == 0 || rr + name_len + 10 > data_end)
+			return NULL;
+
+		const uint8_t *fixed = rr + name_len;
+		if (GET_TYPE_PTR_TYPE(fixed) != TYPE_SOA) {
+			rr = fixed + 10 + ntohs(*(uint16_t *)(fixed + 8));
+			continue;
+		}
+
+		/* owner、MNAME、RNAME各最多255字节，加上定长部分 */
+		size_t soa_capacity = 3 * DNS_NAME_MAX_SIZE + 30;
+		negative_answer_t *ans = (negative_answer_t *)malloc(
+			sizeof(negative_answer_t) + soa_capacity);
+		uint32_t minimum = 0;
+		size_t soa_size = __copy_soa(data, data_size, rr, ans,
+					     soa_capacity, &minimum);
+
+		if (soa_size == 0 ||
+		    !get_query_url(data, data_size, ans->domain,
+				   DOMAIN_NAME_MAX_LENGTH)) {
+			free(ans);
+			return NULL;
+		}
+
+		ans->soa_size = (uint16_t)soa_size;
+		ans->ttl = DNS_SERVER_MIN(GET_TTL_PTR_TTL(fixed + 4), minimum);
+		ans->qtype = GET_TYPE_PTR_TYPE(query.type_ptr);
+		ans->rcode = rcode;
+		ans->last_update = time(NULL);
+		return (negative_answer_t *)realloc(
+			ans, sizeof(negative_answer_t) + soa_size);
+	}
+	return NULL;
+}
+
+size_t generate_negative_response(const void *query, size_t q_size,
+				  const negative_answer_t *answer, void *dest,
+				  size_t dest_size)
+{
+	uint8_t *q_end = get_query_info(query, QUERY_END, q_size);
+	if (q_end == NULL)
+		return 0;
+
+	/* 只保留header和question，丢掉请求中的additional（如EDNS OPT） */
+	size_t len = q_end - (uint8_t *)query;
+	if (len + answer->soa_size > dest_size)
+		return 0;
+
+	memcpy(dest, query, len);
+	set_header_info(dest, HEADER_FLAGS,
+			response_flags(query, answer->rcode));
+	set_header_info(dest, HEADER_ANSWER, 0);
+	set_header_info(dest, HEADER_AUTHORITY, 1);
+	set_header_info(dest, HEADER_ADDITIONAL, 0);
+
+	uint8_t *soa = (uint8_t *)dest + len;
+	memcpy(soa, answer->soa, answer->soa_size);
+	*(uint32_t *)(soa + answer->soa_ttl_offset) =
+		htonl((uint32_t)answer_ttl(answer));
+	return len + answer->soa_size;
+}
+
+/**
+ * @param rr 一条记录的起始位置
+ * @param fixed 记录中type字段的位置
+ * @return 下一条记录的起始位置，记录不完整时返回NULL
+ */
+static const uint8_t *__next_record(const void *data, size_t data_size,
+				    const uint8_t *rr, out const uint8_t **fixed)
+{
+	const uint8_t *data_end = (const uint8_t *)data + data_size;
+	size_t name_len = skip_name(data, data_size, rr);
+
+	if (name_len == 0 || rr + name_len + 10 > data_end)
+		return NULL;
+
+	*fixed = rr + name_len;
+	const uint8_t *next = *fixed + 10 + ntohs(*(uint16_t *)(*fixed + 8));
+	return next <= data_end ? next : NULL;
+}
+
+static size_t __num_records(const void *data)
+{
+	return (size_t)get_header_info(data, HEADER_ANSWER) +
+	       get_header_info(data, HEADER_AUTHORITY) +
+	       get_header_info(data, HEADER_ADDITIONAL);
+}
+
+uint8_t get_packet_flags(const void *data, size_t data_size)
+{
+	query_meta query = parse_query(data, data_size);
+	if (query.query_end == NULL)
+		return 0;
+
+	uint8_t flags = 0;
+	if (get_header_info(data, HEADER_FLAGS) & FLAGS_CD)
+		flags |= PACKET_FLAG_CD;
+
+	size_t num = __num_records(data);
+	const uint8_t *rr = (const uint8_t *)query.query_end;
+	for (size_t i = 0; i < num && rr != NULL; i++) {
+		const uint8_t *fixed = NULL;
+		const uint8_t *next = __next_record(data, data_size, rr, &fixed);
+		if (next == NULL)
+			break;
+
+		/* OPT的TTL字段依次为extended RCODE、version和flags */
+		if (GET_TYPE_PTR_TYPE(fixed) == TYPE_OPT) {
+			flags |= PACKET_FLAG_EDNS;
+			if (fixed[6] & 0x80)
+				flags |= PACKET_FLAG_DO;
+		}
+		rr = next;
+	}
+	return flags;
+}
+
+uint16_t get_udp_payload_size(const void *data, size_t data_size)
+{
+	const uint8_t *rr = get_query_info(data, QUERY_END, data_size);
+	if (rr == NULL)
+		return DNS_UDP_DEFAULT_SIZE;
+
+	size_t num = __num_records(data);
+	for (size_t i = 0; i < num; i++) {
+		const uint8_t *fixed = NULL;
+		const uint8_t *next = __next_record(data, data_size, rr, &fixed);
+		if (next == NULL)
+			break;
+
+		/* OPT的CLASS字段为请求方的UDP payload大小 */
+		if (GET_TYPE_PTR_TYPE(fixed) == TYPE_OPT)
+			return DNS_SERVER_MAX(ntohs(*(uint16_t *)(fixed + 2)),
+					      DNS_UDP_DEFAULT_SIZE);
+		rr = next;
+	}
+	return DNS_UDP_DEFAULT_SIZE;
+}
+
+size_t truncate_response(void *data, size_t data_size)
+{
+	uint8_t *end = get_query_info(data, QUERY_END, data_size);
+	if (end == NULL)
+		return 0;
+
+	set_header_info(data, HEADER_FLAGS,
+			get_header_info(data, HEADER_FLAGS) | FLAGS_TC);
+	set_header_info(data, HEADER_ANSWER, 0);
+	set_header_info(data, HEADER_AUTHORITY, 0);
+	set_header_info(data, HEADER_ADDITIONAL, 0);
+	return end - (uint8_t *)data;
+}
+
+packet_answer_t *get_packet_answer(const void *data, size_t data_size)
+{
+	uint16_t header_flags = get_header_info(data, HEADER_FLAGS);
+	uint16_t rcode = header_flags & RCODE_MASK;
+	query_meta query = parse_query(data, data_size);
+
+	if (query.query_end == NULL || (header_flags & FLAGS_TC) ||
+	    (rcode != RCODE_NO_ERROR && rcode != RCODE_NAME_ERROR) ||
+	    get_header_info(data, HEADER_QUESTION) != 1 ||
+	    data_size > RAW_DATA_MAX_SIZE)
+		return NULL;
+
+	size_t num = __num_records(data);
+	uint16_t offsets[RAW_DATA_MAX_SIZE / 11];
+	uint16_t num_ttl = 0;
+	uint32_t ttl = 0;
+	uint32_t soa_minimum = UINT32_MAX;
+	BOOL negative = rcode == RCODE_NAME_ERROR ||
+			get_header_info(data, HEADER_ANSWER) == 0;
+	const uint8_t *rr = (const uint8_t *)query.query_end;
+
+	for (size_t i = 0; i < num; i++) {
+		const uint8_t *fixed = NULL;
+		const uint8_t *next = __next_record(data, data_size, rr, &fixed);
+		if (next == NULL)
+			return NULL;
+
+		uint16_t type = GET_TYPE_PTR_TYPE(fixed);
+		rr = next;
+		if (type == TYPE_OPT)
+			continue;
+
+		uint32_t rr_ttl = GET_TTL_PTR_TTL(fixed + 4);
+		if (num_ttl == 0 || rr_ttl < ttl)
+			ttl = rr_ttl;
+		offsets[num_ttl++] = (uint16_t)(fixed + 4 - (const uint8_t *)data);
+
+		/* SOA的MINIMUM是rdata的最后4个字节 */
+		if (negative && type == TYPE_SOA)
+			soa_minimum = DNS_SERVER_MIN(soa_minimum,
+						     GET_TTL_PTR_TTL(next - 4));
+	}
+
+	if (num_ttl == 0)
+		return NULL;
+
+	packet_answer_t *ans = (packet_answer_t *)malloc(
+		sizeof(packet_answer_t) + num_ttl * sizeof(uint16_t) +
+		data_size);
+	ans->last_update = time(NULL);
+	ans->ttl = DNS_SERVER_MIN(ttl, soa_minimum);
+	ans->size = (uint16_t)data_size;
+	ans->num_ttl = num_ttl;
+	memcpy(packet_ttl_offsets(ans), offsets, num_ttl * sizeof(uint16_t));
+	memcpy(packet_data(ans), data, data_size);
+	return ans;
+}
+
+size_t generate_packet_response(const void *query, size_t q_size,
+				const packet_answer_t *answer, void *dest,
+				size_t dest_size)
+{
+	const uint8_t *q_end = get_query_info(query, QUERY_END, q_size);
+	const uint8_t *data = packet_data(answer);
+	if (q_end == NULL)
+		return 0;
+
+	size_t q_len = q_end - (const uint8_t *)query;
+	if (answer->size > dest_size || q_len > answer->size ||
+	    get_query_info(data, QUERY_END, answer->size) !=
+		    data + q_len)
+		return 0;
+
+	memcpy(dest, data, answer->size);
+	/* 保留查询中域名的大小写（0x20编码） */
+	memcpy((uint8_t *)dest + sizeof(dns_header),
+	       (const uint8_t *)query + sizeof(dns_header),
+	       q_len - sizeof(dns_header));
+	set_header_info(dest, HEADER_ID, get_header_info(query, HEADER_ID));
+	/* CD是key的一部分，RD则可能与缓存的回复不同 */
+	uint16_t flags = get_header_info(dest, HEADER_FLAGS) & ~FLAGS_RD;
+	set_header_info(dest, HEADER_FLAGS,
+			flags | (get_header_info(query, HEADER_FLAGS) & FLAGS_RD));
+
+	uint32_t elapsed = (uint32_t)(time(NULL) - answer->last_update);
+	const uint16_t *offsets = packet_ttl_offsets(answer);
+	for (uint16_t i = 0; i < answer->num_ttl; i++) {
+		uint32_t ttl = GET_TTL_PTR_TTL(data + offsets[i]);
+		ttl = ttl > elapsed ? ttl - elapsed : 0;
+		*(uint32_t *)((uint8_t *)dest + offsets[i]) = htonl(ttl);
+	}
+	return answer->size;
+}
+
+void set_response_ttl(void *data, size_t data_size, uint32_t ttl)
+{
+	const uint8_t *rr = get_query_info(data, QUERY_END, data_size);
+	if (rr == NULL)
+		return;
+
+	size_t num = __num_records(data);
+	for (size_t i = 0; i < num; i++) {
+		const uint8_t *fixed = NULL;
+		const uint8_t *next = __next_record(data, data_size, rr, &fixed);
+		if (next == NULL)
+			return;
+
+		if (GET_TYPE_PTR_TYPE(fixed) != TYPE_OPT)
+			*(uint32_t *)(fixed + 4) = htonl(ttl);
+		rr = next;
+	}
+}
+
+/**
+ * @return type的rdata中可压缩域名的偏移，没有时返回RRSET_NO_NAME
+ */
+static uint16_t __rdata_name_offset(uint16_t type)
+{
+	switch (type) {
+	case TYPE_NS:
+	case TYPE_PTR:
+		return 0;
+	case TYPE_MX:
+		return 2; /* PREFERENCE */
+	case TYPE_SRV:
+		return 6; /* PRIORITY, WEIGHT, PORT */
+	default:
+		/* TXT没有域名，SVCB/HTTPS的TargetName不允许压缩 */
+		return RRSET_NO_NAME;
+	}
+}
+
+BOOL rrset_cacheable(uint16_t type)
+{
+	switch (type) {
+	case TYPE_NS:
+	case TYPE_PTR:
+	case TYPE_MX:
+	case TYPE_TXT:
+	case TYPE_SRV:
+	case TYPE_SVCB:
+	case TYPE_HTTPS:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static BOOL __name_equal(const uint8_t *a, size_t a_len, const uint8_t *b,
+			 size_t b_len)
+{
+	if (a_len != b_len)
+		return FALSE;
+	for (size_t i = 0; i < a_len; i++)
+		if (tolower(a[i]) != tolower(b[i]))
+			return FALSE;
+	return TRUE;
+}
+
+/**
+ * 把一条记录的rdata解压后追加到ans->rdata
+ * @return 追加的字节数，失败时返回0
+ */
+static size_t __append_rdata(const uint8_t *data, size_t data_size,
+			     const uint8_t *rdata, uint16_t rdlen,
+			     rrset_answer_t *ans, size_t capacity)
+{
+	uint16_t name_offset = __rdata_name_offset(ans->type);
+	uint8_t *dest = ans->rdata + ans->size;
+	size_t len = 4;
+
+	if (name_offset == RRSET_NO_NAME || name_offset >= rdlen) {
+		if (ans->size + len + rdlen > capacity)
+			return 0;
+		memcpy(dest + len, rdata, rdlen);
+		len += rdlen;
+		name_offset = RRSET_NO_NAME;
+	} else {
+		if (ans->size + len + name_offset > capacity)
+			return 0;
+		memcpy(dest + len, rdata, name_offset);
+		len += name_offset;
+
+		size_t n = decompress_name(data, data_size, rdata + name_offset,
+					   dest + len, capacity - ans->size - len);
+		size_t skip = skip_name(data, data_size, rdata + name_offset);
+		if (n == 0 || skip == 0 || name_offset + skip != rdlen)
+			return 0;
+		len += n;
+	}
+
+	*(uint16_t *)dest = (uint16_t)(len - 4);
+	*(uint16_t *)(dest + 2) = name_offset;
+	return len;
+}
+
+rrset_answer_t *get_rrset_answer(const void *data, size_t data_size)
+{
+	uint16_t header_flags = get_header_info(data, HEADER_FLAGS);
+	query_meta query = parse_query(data, data_size);
+	/* 截断的回复只有一部分记录 */
+	if (query.query_end == NULL || (header_flags & FLAGS_TC) ||
+	    (header_flags & RCODE_MASK) != RCODE_NO_ERROR ||
+	    get_header_info(data, HEADER_QUESTION) != 1)
+		return NULL;
+
+	uint16_t qtype = GET_TYPE_PTR_TYPE(query.type_ptr);
+	if (!rrset_cacheable(qtype))
+		return NULL;
+
+	uint8_t qname[DNS_NAME_MAX_SIZE];
+	size_t qname_len = decompress_name(data, data_size, query.query_begin,
+					   qname, sizeof(qname));
+	if (qname_len == 0)
+		return NULL;
+
+	const uint8_t *data_end = (const uint8_t *)data + data_size;
+	const uint8_t *rr = (const uint8_t *)query.query_end;
+	uint16_t num_answer = get_header_info(data, HEADER_ANSWER);
+	rrset_answer_t *ans = (rrset_answer_t *)malloc(sizeof(rrset_answer_t) +
+						       RAW_DATA_MAX_SIZE);
+	ans->type = qtype;
+	ans->num = 0;
+	ans->size = 0;
+	ans->ttl = 0;
+
+	for (uint16_t i = 0; i < num_answer; i++) {
+		uint8_t owner[DNS_NAME_MAX_SIZE];
+		size_t name_len = skip_name(data, data_size, rr);
+		if (name_len == 0 || rr + name_len + 10 > data_end)
+			goto rrset_answer_invalid;
+
+		const uint8_t *fixed = rr + name_len;
+		uint16_t rdlen = ntohs(*(uint16_t *)(fixed + 8));
+		const uint8_t *rdata = fixed + 10;
+		if (rdata + rdlen > data_end)
+			goto rrset_answer_invalid;
+		rr = rdata + rdlen;
+
+		/* CNAME链中间的记录由CNAME cache处理 */
+		size_t owner_len = decompress_name(data, data_size, fixed - name_len,
+						   owner, sizeof(owner));
+		if (owner_len == 0)
+			goto rrset_answer_invalid;
+		if (GET_TYPE_PTR_TYPE(fixed) != qtype ||
+		    ntohs(*(uint16_t *)(fixed + 2)) != CLASS_IN ||
+		    !__name_equal(owner, owner_len, qname, qname_len))
+			continue;
+
+		size_t len = __append_rdata(data, data_size, rdata, rdlen, ans,
+					    RAW_DATA_MAX_SIZE);
+		if (len == 0)
+			goto rrset_answer_invalid;
+
+		uint32_t ttl = GET_TTL_PTR_TTL(fixed + 4);
+		if (ans->num == 0 || ttl < ans->ttl)
+			ans->ttl = ttl;
+		ans->size += len;
+		ans->num++;
+	}
+
+	if (ans->num == 0 ||
+	    !get_query_url(data, data_size, ans->domain,
+			   DOMAIN_NAME_MAX_LENGTH))
+		goto rrset_answer_invalid;
+
+	ans->last_update = time(NULL);
+	return (rrset_answer_t *)realloc(ans,
+					 sizeof(rrset_answer_t) + ans->size);
+
+	/* 只缓存完整的RRset，不保留已经解析的部分记录 */
+rrset_answer_invalid:
+	free(ans);
+	return NULL;
+}
+
+/**
+ * 把域名写入dest，与qname相同的后缀替换为指向question中对应位置的指针
+ * @param qname 回复中question的域名，未压缩
+ * @return 写入的字节数
+ */
+static size_t __encode_name(const uint8_t *name, const uint8_t *qname,
+			    uint16_t qname_offset, uint8_t *dest)
+{
+	size_t qname_len = strlen((const char *)qname) + 1;
+	size_t len = 0;
+
+	while (*name != 0) {
+		/* name剩余部分是否等于qname的某个label边界开始的后缀 */
+		size_t rest = strlen((const char *)name) + 1;
+		for (size_t q = 0; q + rest <= qname_len; q += qname[q] + 1) {
+			if (q + rest == qname_len &&
+			    __name_equal(name, rest, qname + q, rest)) {
+				uint16_t ptr = 0xc000 | (uint16_t)(qname_offset + q);
+				*(uint16_t *)(dest + len) = htons(ptr);
+				return len + 2;
+			}
+			if (qname[q] == 0)
+				break;
+		}
+
+		memcpy(dest + len, name, *name + 1);
+		len += *name + 1;
+		name += *name + 1;
+	}
+	dest[len++] = 0;
+	return len;
+}
+
+size_t generate_rrset_response(const void *query, size_t q_size,
+			       const rrset_answer_t *answer, void *dest,
+			       size_t dest_size)
+{
+	query_meta meta = parse_query(query, q_size);
+	if (meta.query_end == NULL)
+		return 0;
+
+	uint8_t qname[DNS_NAME_MAX_SIZE];
+	if (decompress_name(query, q_size, meta.query_begin, qname,
+			    sizeof(qname)) == 0)
+		return 0;
+
+	size_t len = (const uint8_t *)meta.query_end - (const uint8_t *)query;
+	uint16_t qname_offset =
+		(const uint8_t *)meta.query_begin - (const uint8_t *)query;
+	/* 压缩后不会比解压缩时更长，每条记录另有owner指针和定长部分 */
+	if (len + answer->size + answer->num * 12 > dest_size)
+		return 0;
+
+	memcpy(dest, query, len);
+	set_header_info(dest, HEADER_FLAGS,
+			response_flags(query, RCODE_NO_ERROR));
+	set_header_info(dest, HEADER_ANSWER, answer->num);
+	set_header_info(dest, HEADER_AUTHORITY, 0);
+	set_header_info(dest, HEADER_ADDITIONAL, 0);
+
+	uint8_t *iter = (uint8_t *)dest + len;
+	const uint8_t *rec = answer->rdata;
+	uint32_t ttl = htonl((uint32_t)answer_ttl(answer));
+
+	for (uint16_t i = 0; i < answer->num; i++) {
+		uint16_t rdlen = *(const uint16_t *)rec;
+		uint16_t name_offset = *(const uint16_t *)(rec + 2);
+		const uint8_t *rdata = rec + 4;
+		rec += 4 + rdlen;
+
+		*(uint16_t *)iter = htons(0xc000 | qname_offset);
+		*(uint16_t *)(iter + 2) = htons(answer->type);
+		*(uint16_t *)(iter + 4) = htons(CLASS_IN);
+		memcpy(iter + 6, &ttl, sizeof(ttl));
+		uint8_t *rdlen_ptr = iter + 10;
+		iter += 12;
+
+		if (name_offset == RRSET_NO_NAME) {
+			memcpy(iter, rdata, rdlen);
+			*(uint16_t *)rdlen_ptr = htons(rdlen);
+			iter += rdlen;
+			continue;
+		}
+
+		memcpy(iter, rdata, name_offset);
+		size_t n = __encode_name(rdata + name_offset, qname,
+					 qname_offset, iter + name_offset);
+		*(uint16_t *)rdlen_ptr = htons((uint16_t)(name_offset + n));
+		iter += name_offset + n;
+	}
+	return iter - (uint8_t *)dest;
+}
+
 size_t generate_no_name_response(const void *query, size_t q_size,
 				 void *response, size_t response_size)
 {
@@ -441,10 +1101,53 @@ size_t generate_no_name_response(const void *query, size_t q_size,
 	}
 
 	memcpy(response, query, q_size);
-	set_header_info(response, HEADER_FLAGS, FLAGS_RESPONSE_NO_SUCH_NAME);
+	set_header_info(response, HEADER_FLAGS,
+			response_flags(query, RCODE_NAME_ERROR));
 	return q_size;
 }
 
+size_t generate_query(const void *query, size_t q_size, const char *domain,
+		      out void *dest, size_t dest_size)
+{
+	const uint8_t *qtype = get_query_info(query, QUERY_TYPE, q_size);
+	if (qtype == NULL || dest_size < sizeof(dns_header) + 4)
+		return 0;
+
+	/* domain以'.'或长度字节分隔，按label重新编码，留出结尾的0和type、class */
+	uint8_t *name = (uint8_t *)dest + sizeof(dns_header);
+	size_t max_len = DNS_SERVER_MIN(dest_size - sizeof(dns_header) - 4,
+					DOMAIN_NAME_MAX_LENGTH);
+	size_t len = 0;
+	size_t label_begin = 0;
+	for (; *domain != '\0'; domain++) {
+		if (*domain == '.' || iscntrl((unsigned char)*domain)) {
+			if (len > label_begin) {
+				name[label_begin] =
+					(uint8_t)(len - label_begin - 1);
+				label_begin = len;
+			}
+			continue;
+		}
+
+		if (len == label_begin)
+			len++;
+		if (len + 1 >= max_len)
+			return 0;
+		name[len++] = (uint8_t)*domain;
+	}
+	if (len > label_begin)
+		name[label_begin] = (uint8_t)(len - label_begin - 1);
+	name[len++] = 0;
+
+	memcpy(dest, query, sizeof(dns_header));
+	set_header_info(dest, HEADER_QUESTION, 1);
+	set_header_info(dest, HEADER_ANSWER, 0);
+	set_header_info(dest, HEADER_AUTHORITY, 0);
+	set_header_info(dest, HEADER_ADDITIONAL, 0);
+	memcpy(name + len, qtype, 4);
+	return sizeof(dns_header) + len + 4;
+}
+
 static BOOL __is_equal_character(char a, char b)
 {
 	if (a == b)
@@ -505,7 +1208,8 @@ size_t generate_whole_a_response(const void *query, size_t q_size,
 	memcpy(dest, query, q_size);
 	response_begin += q_size;
 
-	set_header_info(dest, HEADER_FLAGS, FLAGS_RESPONSE_NO_ERROR);
+	set_header_info(dest, HEADER_FLAGS,
+			response_flags(query, RCODE_NO_ERROR));
 	set_header_info(dest, HEADER_ANSWER, 1);
 
 	res += generate_single_a_response(bias, answer, response_begin);
@@ -545,7 +1249,7 @@ size_t generate_single_cname_response(const void *data, uint16_t bias,
 	assert(answer != NULL);
 	assert(dest != NULL);
 #endif
-	bias |= 0xc0;
+	bias |= 0xc000;
 	uint16_t *a_ptr = (uint16_t *)dest;
 	a_ptr[0] = htons(bias);
 	bias &= 0x3fff;
@@ -50,10 +50,30 @@
 #define TYPE_MX 15
 #define TYPE_TXT 16
 #define TYPE_AAAA 28
+#define TYPE_SRV 33
+#define TYPE_OPT 41
+#define TYPE_SVCB 64
 #define TYPE_HTTPS 65
 
 #define CLASS_IN 1
 
+#define RCODE_NO_ERROR 0
+#define RCODE_NAME_ERROR 3
+#define RCODE_MASK 0x000f
+#define FLAGS_QR 0x8000
+#define FLAGS_TC 0x0200
+#define FLAGS_RD 0x0100
+#define FLAGS_RA 0x0080
+#define FLAGS_CD 0x0010
+
+/* get_packet_flags()的返回值 */
+#define PACKET_FLAG_CD 0x01
+#define PACKET_FLAG_EDNS 0x02
+#define PACKET_FLAG_DO 0x04
+
+/* wire format域名的最大长度 */
+#define DNS_NAME_MAX_SIZE 255
+
 enum HEADER_FLAGS {
 	FLAGS_QUERY_STANDARD_QUERY = 0x0100,
 	FLAGS_RESPONSE_NO_ERROR = 0x8180,
@@ -88,6 +108,11 @@ extern uint16_t get_header_info(const void *header, HEADER_ITEM qtype);
  */
 extern void set_header_info(void *header, HEADER_ITEM qtype, uint16_t value);
 
+/**
+ * 回复query时header的flags：QR、RA置位，RD和CD从query中复制
+ */
+extern uint16_t response_flags(const void *query, uint16_t rcode);
+
 /**
  * Parse query.
  * @return query_meta::response_begin is NULL if data is illegal query.
@@ -126,6 +151,103 @@ extern size_t parse_responses(const void *data, size_t data_size,
 extern size_t get_answers(const void *data, size_t data_size,
 			  out answer_t **answer_list);
 
+/**
+ * @param name 报文中域名的起始位置
+ * @return name在报文中占用的字节数。域名不合法时返回0
+ */
+extern size_t skip_name(const void *data, size_t data_size, const void *name);
+
+/**
+ * 将报文中可能被压缩的域名解压为wire format。
+ * @return 写入dest的字节数，包括结尾的0。域名不合法或dest空间不足时返回0
+ */
+extern size_t decompress_name(const void *data, size_t data_size,
+			      const void *name, out uint8_t *dest,
+			      size_t dest_size);
+
+/**
+ * 若data是answer为空、authority中带有SOA的NXDOMAIN或NODATA回复，则从中提取negative answer。
+ * @return 调用者负责free，不是negative回复时返回NULL
+ */
+extern negative_answer_t *get_negative_answer(const void *data,
+					      size_t data_size);
+
+/**
+ * @return 报文的CD位、是否带有EDNS OPT以及OPT的DO位，
+ *         回复会原样带回这些位，因此查询和回复得到的值相同
+ */
+extern uint8_t get_packet_flags(const void *data, size_t data_size);
+
+/* 不带EDNS时UDP报文的最大长度 */
+#define DNS_UDP_DEFAULT_SIZE 512
+
+/**
+ * @return 请求方能接收的UDP报文大小，即OPT的CLASS字段，不带EDNS或小于512时为512
+ */
+extern uint16_t get_udp_payload_size(const void *data, size_t data_size);
+
+/**
+ * 只保留回复的header和question，并设置TC位，让客户端改用TCP
+ * @return 截断后的大小，报文不合法时返回0
+ */
+extern size_t truncate_response(void *data, size_t data_size);
+
+/**
+ * 记录回复中除OPT以外所有记录的TTL位置，用于整包缓存。
+ * NXDOMAIN和NODATA回复的TTL不超过SOA MINIMUM。
+ * @return 调用者负责free，回复被截断、RCODE不是NOERROR/NXDOMAIN或没有TTL时返回NULL
+ */
+extern packet_answer_t *get_packet_answer(const void *data, size_t data_size);
+
+/**
+ * 复制缓存的回复，换上query的ID和question，TTL减去经过的时间。
+ * @return 回复的大小，question与缓存不一致或空间不足时返回0
+ */
+extern size_t generate_packet_response(const void *query, size_t q_size,
+				       const packet_answer_t *answer,
+				       out void *dest, size_t dest_size);
+
+/**
+ * 把回复中除OPT以外所有记录的TTL改为ttl
+ */
+extern void set_response_ttl(void *data, size_t data_size, uint32_t ttl);
+
+/**
+ * @return type的记录能否以rrset_answer_t缓存
+ */
+extern BOOL rrset_cacheable(uint16_t type);
+
+/**
+ * 提取answer中owner为查询域名、类型为查询类型的全部记录，rdata中的域名会被解压缩。
+ * @return 调用者负责free，查询类型不可缓存、回复被截断或不是NOERROR、
+ *         报文不完整、放不下或没有这样的记录时返回NULL
+ */
+extern rrset_answer_t *get_rrset_answer(const void *data, size_t data_size);
+
+/**
+ * 根据query和缓存的记录集合构造回复，rdata中的域名尽量压缩为指向question的指针。
+ * @return 回复的大小，空间不足时返回0
+ */
+extern size_t generate_rrset_response(const void *query, size_t q_size,
+				      const rrset_answer_t *answer,
+				      out void *dest, size_t dest_size);
+
+/**
+ * 根据query和缓存的negative answer构造回复，authority中带有SOA。
+ * @return 回复的大小，空间不足时返回0
+ */
+extern size_t generate_negative_response(const void *query, size_t q_size,
+					 const negative_answer_t *answer,
+					 out void *dest, size_t dest_size);
+
+/**
+ * 生成与query的ID、flags、type、class相同，但查询domain的请求，不带EDNS
+ * @return 请求的大小，domain不合法或空间不足时返回0
+ */
+extern size_t generate_query(const void *query, size_t q_size,
+			     const char *domain, out void *dest,
+			     size_t dest_size);
+
 extern size_t generate_no_name_response(const void *query, size_t q_size,
 					out void *response,
 					size_t response_size);
@@ -0,0 +1,165 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "ebr.h"
+#include "logger.h"
+#include "unidef.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* 每retire这么多次尝试推进一次epoch */
+#define EBR_COLLECT_INTERVAL 64
+#define EBR_NUM_EPOCHS 3
+
+typedef struct ebr_thread {
+	/* (epoch << 1) | active，只由所属线程写 */
+	atomic_uint_fast64_t state;
+	struct ebr_thread *next;
+} ebr_thread;
+
+typedef struct ebr_garbage {
+	void *ptr;
+	void (*free_fn)(void *);
+	struct ebr_garbage *next;
+} ebr_garbage;
+
+static atomic_uint_fast64_t global_epoch;
+/* 线程注册后不再删除，worker线程都是常驻的 */
+static _Atomic(ebr_thread *) threads;
+
+static _Thread_local ebr_thread *self;
+static _Thread_local unsigned nesting;
+
+/* 以下变量受limbo_lock保护 */
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static ebr_garbage *limbo[EBR_NUM_EPOCHS];
+static size_t num_retired;
+
+static void __register_thread(void)
+{
+	self = (ebr_thread *)malloc(sizeof(ebr_thread));
+	if (self == NULL) {
+		logger_write(LOGGER_ERROR,
+			     "ebr_enter(): Failed to allocate thread record.");
+		exit(1);
+	}
+	atomic_init(&self->state, 0);
+
+	ebr_thread *head = atomic_load(&threads);
+	do {
+		self->next = head;
+	} while (!atomic_compare_exchange_weak(&threads, &head, self));
+}
+
+void ebr_enter(void)
+{
+	if (nesting++)
+		return;
+	if (self == NULL)
+		__register_thread();
+
+	/* 写入后再确认一次，避免在读取epoch和宣告之间epoch被推进 */
+	uint_fast64_t epoch;
+	do {
+		epoch = atomic_load(&global_epoch);
+		atomic_store_explicit(&self->state, (epoch << 1) | 1,
+				      memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+	} while (atomic_load(&global_epoch) != epoch);
+}
+
+void ebr_exit(void)
+{
+	if (--nesting)
+		return;
+	atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+/**
+ * 所有活跃的读者都已看到当前epoch时推进一个epoch，
+ * 并取出两个epoch之前retire的内存。调用者须持有limbo_lock。
+ * @return 可以释放的内存
+ */
+static ebr_garbage *__try_advance(void)
+{
+	uint_fast64_t epoch = atomic_load(&global_epoch);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	for (ebr_thread *t = atomic_load(&threads); t != NULL; t = t->next) {
+		uint_fast64_t state =
+			atomic_load_explicit(&t->state, memory_order_acquire);
+		if ((state & 1) && (state >> 1) != epoch)
+			return NULL;
+	}
+
+	atomic_store(&global_epoch, epoch + 1);
+	size_t idx = (epoch + 1) % EBR_NUM_EPOCHS;
+	ebr_garbage *res = limbo[idx];
+	limbo[idx] = NULL;
+	return res;
+}
+
+static void __free_garbage(ebr_garbage *garbage)
+{
+	while (garbage != NULL) {
+		ebr_garbage *next = garbage->next;
+		garbage->free_fn(garbage->ptr);
+		free(garbage);
+		garbage = next;
+	}
+}
+
+void ebr_retire(void *ptr, void (*free_fn)(void *))
+{
+	if (ptr == NULL)
+		return;
+
+	ebr_garbage *node = (ebr_garbage *)malloc(sizeof(ebr_garbage));
+	node->ptr = ptr;
+	node->free_fn = free_fn;
+
+	ebr_garbage *garbage = NULL;
+	pthread_mutex_lock(&limbo_lock);
+	size_t idx = atomic_load(&global_epoch) % EBR_NUM_EPOCHS;
+	node->next = limbo[idx];
+	limbo[idx] = node;
+	if (++num_retired % EBR_COLLECT_INTERVAL == 0)
+		garbage = __try_advance();
+	pthread_mutex_unlock(&limbo_lock);
+
+	__free_garbage(garbage);
+}
+
+void ebr_collect(void)
+{
+	pthread_mutex_lock(&limbo_lock);
+	ebr_garbage *garbage = __try_advance();
+	pthread_mutex_unlock(&limbo_lock);
+
+	__free_garbage(garbage);
+}
@@ -0,0 +1,47 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_EBR_H_
+#define CORE_EBR_H_
+
+/**
+ * Epoch-based reclamation。读者在ebr_enter()和ebr_exit()之间不加锁地访问共享数据，
+ * 写者把不再可达的内存交给ebr_retire()，等所有读者都离开当时的epoch后才真正释放。
+ */
+
+/* 进入读临界区，可以嵌套。临界区内不应阻塞，否则会推迟所有内存的释放 */
+extern void ebr_enter(void);
+extern void ebr_exit(void);
+
+/**
+ * ptr已经从共享结构中摘下，读者离开当前epoch后调用free_fn(ptr)。
+ * 可以在任意线程调用，包括读临界区内。
+ */
+extern void ebr_retire(void *ptr, void (*free_fn)(void *));
+
+/* 尝试推进epoch，并释放已经安全的内存 */
+extern void ebr_collect(void);
+
+#endif /* CORE_EBR_H_ */
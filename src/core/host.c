@@ -64,12 +64,12 @@ void read_host(const char *path)
 	}
 	char buf[1024], ip_buf[1024];
 
-	while (!feof(host)) {
-		fscanf(host, "%s%s", ip_buf, buf);
+	while (fscanf(host, "%1023s%1023s", ip_buf, buf) == 2) {
 		host_add_record(buf, ip_buf);
 		logger_write(LOGGER_DEBUG, "read_host(): adding host %s %s.",
 			     buf, ip_buf);
 	}
+	fclose(host);
 }
 
 a_answer_t *host_query(const char *domain)
@@ -24,6 +24,7 @@
 
 #include "inverse_query.h"
 #include "cache.h"
+#include "config.h"
 #include "dns.h"
 #include "logger.h"
 
@@ -33,11 +34,13 @@
 static size_t __set_answer_header(const request_data *request, out void *answer)
 {
 	memcpy(answer, request->data, request->size);
-	set_header_info(answer, HEADER_FLAGS, FLAGS_RESPONSE_NO_ERROR);
+	set_header_info(answer, HEADER_FLAGS,
+			response_flags(request->data, RCODE_NO_ERROR));
 	return request->size;
 }
 
-size_t inverse_query_a(const request_data *request, out void *answer)
+static size_t __inverse_query_a(const request_data *request, out void *answer,
+				 out BOOL *stale, out BOOL *refresh)
 {
 #ifdef __DEBUG__
 	assert(request != NULL);
@@ -60,7 +63,8 @@ size_t inverse_query_a(const request_data *request, out void *answer)
 		     url);
 
 	while (len_url && num_cname_answers < 100) {
-		cname_answers[num_cname_answers] = query_CNAME_record(url);
+		cname_answers[num_cname_answers] =
+			query_CNAME_record(url, refresh);
 		if (cname_answers[num_cname_answers] == NULL)
 			break;
 
@@ -69,6 +73,13 @@ size_t inverse_query_a(const request_data *request, out void *answer)
 			"inverse_query_a(): Get CNAME:\n  Domain: %s\n  CNAME: %s\n",
 			url, cname_answers[num_cname_answers]->cname);
 
+		if (answer_timeout(cname_answers[num_cname_answers])) {
+			if (!answer_stale_usable(
+				    cname_answers[num_cname_answers]))
+				return 0;
+			*stale = TRUE;
+		}
+
 		strcpy(url, cname_answers[num_cname_answers]->cname);
 		len_url = strlen(url);
 		num_cname_answers++;
@@ -111,7 +122,7 @@ size_t inverse_query_a(const request_data *request, out void *answer)
 		"inverse_query_a(): Query A Record\n  Bias: %u\n  Url: %s\n",
 		bias, url);
 
-	list *a_rec_list = query_A_record(url);
+	list *a_rec_list = query_A_record(url, refresh);
 
 	if (a_rec_list == NULL) {
 		logger_write(LOGGER_INFO,
@@ -127,11 +138,14 @@ size_t inverse_query_a(const request_data *request, out void *answer)
 	{
 		a_answer_t *a_ans = (a_answer_t *)i->value;
 		if (answer_timeout(a_ans)) {
-			logger_write(
-				LOGGER_INFO,
-				"inverse_query_a(): Record %s TTL timeout.",
-				a_ans->domain);
-			return 0;
+			if (!answer_stale_usable(a_ans)) {
+				logger_write(
+					LOGGER_INFO,
+					"inverse_query_a(): Record %s TTL timeout.",
+					a_ans->domain);
+				return 0;
+			}
+			*stale = TRUE;
 		}
 
 		len_buf = generate_single_a_response(bias, a_ans,
@@ -148,7 +162,9 @@ size_t inverse_query_a(const request_data *request, out void *answer)
 	return res;
 }
 
-size_t inverse_query_aaaa(const request_data *request, out void *answer)
+static size_t __inverse_query_aaaa(const request_data *request,
+				   out void *answer, out BOOL *stale,
+				   out BOOL *refresh)
 {
 #ifdef __DEBUG__
 	assert(request != NULL);
@@ -170,7 +186,8 @@ size_t inverse_query_aaaa(const request_data *request, out void *answer)
 		     "inverse_query_aaaa(): Trying to query url: %s", url);
 
 	while (len_url && num_cname_answers < 100) {
-		cname_answers[num_cname_answers] = query_CNAME_record(url);
+		cname_answers[num_cname_answers] =
+			query_CNAME_record(url, refresh);
 		if (cname_answers[num_cname_answers] == NULL)
 			break;
 
@@ -179,6 +196,13 @@ size_t inverse_query_aaaa(const request_data *request, out void *answer)
 			"inverse_query_aaaa(): Get CNAME:\n  Domain: %s\n  CNAME: %s\n",
 			url, cname_answers[num_cname_answers]->cname);
 
+		if (answer_timeout(cname_answers[num_cname_answers])) {
+			if (!answer_stale_usable(
+				    cname_answers[num_cname_answers]))
+				return 0;
+			*stale = TRUE;
+		}
+
 		strcpy(url, cname_answers[num_cname_answers]->cname);
 		len_url = strlen(url);
 		num_cname_answers++;
@@ -221,7 +245,7 @@ size_t inverse_query_aaaa(const request_data *request, out void *answer)
 		"inverse_query_aaaa(): Query AAAA Record\n  Bias: %u\n  Url: %s\n",
 		bias, url);
 
-	list *aaaa_rec_list = query_AAAA_record(url);
+	list *aaaa_rec_list = query_AAAA_record(url, refresh);
 
 	if (aaaa_rec_list == NULL) {
 		logger_write(LOGGER_INFO,
@@ -238,11 +262,14 @@ size_t inverse_query_aaaa(const request_data *request, out void *answer)
 	{
 		aaaa_answer_t *aaaa_ans = (aaaa_answer_t *)i->value;
 		if (answer_timeout(aaaa_ans)) {
-			logger_write(
-				LOGGER_INFO,
-				"inverse_query_aaaa(): Record %s TTL timeout.",
-				aaaa_ans->domain);
-			return 0;
+			if (!answer_stale_usable(aaaa_ans)) {
+				logger_write(
+					LOGGER_INFO,
+					"inverse_query_aaaa(): Record %s TTL timeout.",
+					aaaa_ans->domain);
+				return 0;
+			}
+			*stale = TRUE;
 		}
 
 		len_buf = generate_single_aaaa_response(
@@ -258,3 +285,137 @@ size_t inverse_query_aaaa(const request_data *request, out void *answer)
 			 "inverse_query_aaaa(): Final Result:", answer, res);
 	return res;
 }
+
+/* 构造回复期间一直处于读临界区，保证查到的记录不会被释放 */
+size_t inverse_query_a(const request_data *request, out void *answer,
+		       out BOOL *refresh)
+{
+	BOOL stale = FALSE;
+	*refresh = FALSE;
+	cache_read_begin();
+	size_t res = __inverse_query_a(request, answer, &stale, refresh);
+	cache_read_end();
+
+	if (!res)
+		return 0;
+	if (stale) {
+		set_response_ttl(answer, res, get_config()->serve_stale_ttl);
+		*refresh = TRUE;
+	}
+	return res;
+}
+
+size_t inverse_query_aaaa(const request_data *request, out void *answer,
+			  out BOOL *refresh)
+{
+	BOOL stale = FALSE;
+	*refresh = FALSE;
+	cache_read_begin();
+	size_t res = __inverse_query_aaaa(request, answer, &stale, refresh);
+	cache_read_end();
+
+	if (!res)
+		return 0;
+	if (stale) {
+		set_response_ttl(answer, res, get_config()->serve_stale_ttl);
+		*refresh = TRUE;
+	}
+	return res;
+}
+
+size_t inverse_query_cname_tail(const request_data *request, out void *query,
+				size_t query_size)
+{
+	uint16_t *qtype_ptr =
+		get_query_info(request->data, QUERY_TYPE, request->size);
+	char url[DOMAIN_NAME_MAX_LENGTH] = { 0 };
+
+	if (qtype_ptr == NULL || (GET_TYPE_PTR_TYPE(qtype_ptr) != TYPE_A &&
+				  GET_TYPE_PTR_TYPE(qtype_ptr) != TYPE_AAAA))
+		return 0;
+	if (!get_query_url(request->data, request->size, url,
+			   DOMAIN_NAME_MAX_LENGTH))
+		return 0;
+
+	int num_cname_answers = 0;
+	size_t res = 0;
+	cache_read_begin();
+	while (num_cname_answers < 100) {
+		cname_answer_t *rec = query_CNAME_record(url, NULL);
+		if (rec == NULL)
+			break;
+		if (answer_timeout(rec)) {
+			num_cname_answers = 0;
+			break;
+		}
+
+		strcpy(url, rec->cname);
+		num_cname_answers++;
+	}
+	cache_read_end();
+
+	/* 链太长时可能有环，交给upstream处理 */
+	if (num_cname_answers > 0 && num_cname_answers < 100)
+		res = generate_query(request->data, request->size, url, query,
+				     query_size);
+	if (res)
+		logger_write(LOGGER_INFO,
+			     "inverse_query_cname_tail(): %d CNAME records cached, querying the tail only.",
+			     num_cname_answers);
+	return res;
+}
+
+size_t inverse_query_negative(const request_data *request, out void *answer,
+			      size_t answer_size)
+{
+	char url[DOMAIN_NAME_MAX_LENGTH] = { 0 };
+	uint16_t *qtype_ptr =
+		get_query_info(request->data, QUERY_TYPE, request->size);
+
+	if (qtype_ptr == NULL ||
+	    !get_query_url(request->data, request->size, url,
+			   DOMAIN_NAME_MAX_LENGTH))
+		return 0;
+
+	size_t res = 0;
+	cache_read_begin();
+	negative_answer_t *rec =
+		query_negative_record(url, GET_TYPE_PTR_TYPE(qtype_ptr));
+	if (rec != NULL)
+		res = generate_negative_response(request->data, request->size,
+						 rec, answer, answer_size);
+	cache_read_end();
+
+	if (res)
+		logger_write(LOGGER_INFO,
+			     "inverse_query_negative(): Negative hit: %s", url);
+	return res;
+}
+
+size_t inverse_query_rrset(const request_data *request, out void *answer,
+			   size_t answer_size)
+{
+	char url[DOMAIN_NAME_MAX_LENGTH] = { 0 };
+	uint16_t *qtype_ptr =
+		get_query_info(request->data, QUERY_TYPE, request->size);
+
+	if (qtype_ptr == NULL ||
+	    !get_query_url(request->data, request->size, url,
+			   DOMAIN_NAME_MAX_LENGTH))
+		return 0;
+
+	size_t res = 0;
+	cache_read_begin();
+	rrset_answer_t *rec =
+		query_rrset_record(url, GET_TYPE_PTR_TYPE(qtype_ptr));
+	if (rec != NULL)
+		res = generate_rrset_response(request->data, request->size,
+					      rec, answer, answer_size);
+	cache_read_end();
+
+	if (res)
+		logger_write(LOGGER_INFO,
+			     "inverse_query_rrset(): Cache hit: %s, type: %u",
+			     url, GET_TYPE_PTR_TYPE(qtype_ptr));
+	return res;
+}
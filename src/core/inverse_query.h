@@ -30,7 +30,37 @@
 
 #include <stddef.h>
 
-extern size_t inverse_query_a(const request_data *request, out void *answer);
-extern size_t inverse_query_aaaa(const request_data *request, out void *answer);
+/**
+ * 用缓存的CNAME链和A/AAAA记录构造回复。
+ * 链上有过期但还能使用的记录时，回复的TTL都改为serve_stale_ttl。
+ * 有记录已过期或需要预取时设置refresh，调用者应在后台刷新。
+ * @return 回复的大小，没有缓存或记录已过期时返回0
+ */
+extern size_t inverse_query_a(const request_data *request, out void *answer,
+			      out BOOL *refresh);
+extern size_t inverse_query_aaaa(const request_data *request, out void *answer,
+				 out BOOL *refresh);
+
+/**
+ * A/AAAA查询的CNAME链都已缓存且未过期，只是缺少末端的记录时，生成只查询链末端域名的请求。
+ * 收到回复并更新cache后，再用inverse_query_a()/inverse_query_aaaa()回复原来的请求。
+ * @return 请求的大小，没有可用的CNAME链时返回0
+ */
+extern size_t inverse_query_cname_tail(const request_data *request,
+				       out void *query, size_t query_size);
+
+/**
+ * 用缓存的NXDOMAIN/NODATA回复任意类型的查询
+ * @return 回复的大小，没有缓存或answer_size不够时返回0
+ */
+extern size_t inverse_query_negative(const request_data *request,
+				     out void *answer, size_t answer_size);
+
+/**
+ * 用缓存的记录集合回复MX、TXT等类型的查询
+ * @return 回复的大小，没有缓存或answer_size不够时返回0
+ */
+extern size_t inverse_query_rrset(const request_data *request,
+				  out void *answer, size_t answer_size);
 
 #endif /* CORE_INVERSE_QUERY_H_ */
\ No newline at end of file
@@ -0,0 +1,429 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "pending_query.h"
+#include "dns.h"
+#include "logger.h"
+#include "unidef.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PENDING_TABLE_SIZE 65536
+#define PENDING_INDEX_SIZE 65536
+
+static pthread_mutex_t pending_table_mutex;
+static pending_query *pending_table[PENDING_TABLE_SIZE];
+static size_t pending_table_count;
+static uint32_t pending_serial;
+static size_t pending_saved;
+static size_t pending_dropped;
+static void (*pending_timeout_handler)(pending_query *query);
+
+/* 按question索引正在进行的查询，用于合并相同的请求 */
+static pending_query *pending_index[PENDING_INDEX_SIZE];
+
+static BOOL __get_question(const void *data, size_t size, uint8_t **begin,
+			   size_t *question_size)
+{
+	uint8_t *q_begin = get_query_info(data, QUERY_BEGIN, size);
+	uint8_t *q_end = get_query_info(data, QUERY_END, size);
+
+	if (q_begin == NULL || q_end == NULL)
+		return FALSE;
+	if (q_end - q_begin > PENDING_QUESTION_MAX_SIZE)
+		return FALSE;
+
+	*begin = q_begin;
+	*question_size = q_end - q_begin;
+	return TRUE;
+}
+
+/* 域名部分不区分大小写，type和class必须完全相同 */
+static BOOL __question_equal(const uint8_t *a, const uint8_t *b, size_t size)
+{
+	for (size_t i = 0; i + 4 < size; i++)
+		if (tolower(a[i]) != tolower(b[i]))
+			return FALSE;
+	return memcmp(a + size - 4, b + size - 4, 4) == 0;
+}
+
+/* FNV-1a */
+static size_t __question_hash(const uint8_t *question, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= question[i];
+		hash *= 16777619u;
+	}
+	return hash & (PENDING_INDEX_SIZE - 1);
+}
+
+/**
+ * 查找question完全相同的查询。
+ * 不忽略大小写，这样合并后的回复中question与每个客户端发出的完全一致。
+ */
+static pending_query *__index_find(const pending_query *query)
+{
+	pending_query *iter =
+		pending_index[__question_hash(query->question,
+					      query->question_size)];
+
+	for (; iter != NULL; iter = iter->index_next)
+		if (iter->question_size == query->question_size &&
+		    !memcmp(iter->question, query->question,
+			    query->question_size))
+			return iter;
+	return NULL;
+}
+
+static void __index_insert(pending_query *query)
+{
+	size_t hash = __question_hash(query->question, query->question_size);
+	query->index_next = pending_index[hash];
+	pending_index[hash] = query;
+}
+
+static void __index_remove(pending_query *query)
+{
+	pending_query **iter = &pending_index[__question_hash(
+		query->question, query->question_size)];
+
+	for (; *iter != NULL; iter = &(*iter)->index_next) {
+		if (*iter == query) {
+			*iter = query->index_next;
+			break;
+		}
+	}
+	query->index_next = NULL;
+}
+
+void pending_query_init(void)
+{
+	pthread_mutex_init(&pending_table_mutex, NULL);
+	memset(pending_table, 0, sizeof(pending_table));
+	memset(pending_index, 0, sizeof(pending_index));
+	pending_table_count = 0;
+	pending_saved = 0;
+	logger_write(LOGGER_DEBUG,
+		     "pending_query_init(): Pending table initialization finished.");
+}
+
+void pending_query_set_timeout_handler(void (*handler)(pending_query *query))
+{
+	pending_timeout_handler = handler;
+}
+
+pending_query *create_pending_query(const void *query, size_t size,
+				    SOCKET client_sock,
+				    const SOCKADDR_IN *client)
+{
+	uint8_t *q_begin = NULL;
+	size_t q_size = 0;
+
+	if (size < sizeof(dns_header) ||
+	    !__get_question(query, size, &q_begin, &q_size))
+		return NULL;
+
+	pending_query *res = (pending_query *)malloc(sizeof(pending_query));
+	res->upstream_id = 0;
+	res->origin_id = get_header_info(query, HEADER_ID);
+	res->serial = 0;
+	res->num_attempts = 0;
+	res->retries = 0;
+	res->ctx = NULL;
+	res->packet = NULL;
+	res->packet_size = 0;
+	res->truncated = NULL;
+	res->truncated_size = 0;
+	res->timer = TIMER_INVALID_ID;
+	res->client_sock = client_sock;
+	res->udp_size = DNS_SERVER_MIN(get_udp_payload_size(query, size),
+				       RAW_DATA_MAX_SIZE);
+	if (client != NULL)
+		res->client = *client;
+	else
+		memset(&res->client, 0, sizeof(res->client));
+	res->origin = NULL;
+	res->origin_size = 0;
+	res->waiters = NULL;
+	res->num_waiters = 0;
+	res->index_next = NULL;
+	res->question_size = q_size;
+	memcpy(res->question, q_begin, q_size);
+	return res;
+}
+
+void pending_query_set_packet(pending_query *query, const void *packet,
+			      size_t size)
+{
+	query->packet = (uint8_t *)malloc(size);
+	memcpy(query->packet, packet, size);
+	query->packet_size = size;
+}
+
+void pending_query_set_truncated(pending_query *query, const void *reply,
+				 size_t size)
+{
+	free(query->truncated);
+	query->truncated = (uint8_t *)malloc(size);
+	memcpy(query->truncated, reply, size);
+	query->truncated_size = size;
+}
+
+void pending_query_set_origin(pending_query *query, const void *request,
+			      size_t size)
+{
+	query->origin = (uint8_t *)malloc(size);
+	memcpy(query->origin, request, size);
+	query->origin_size = size;
+}
+
+void free_pending_query(pending_query *query)
+{
+	pending_waiter *waiter = query->waiters;
+	while (waiter != NULL) {
+		pending_waiter *next = waiter->next;
+		free(waiter->origin);
+		free(waiter);
+		waiter = next;
+	}
+	free(query->origin);
+	free(query->packet);
+	free(query->truncated);
+	free(query);
+}
+
+/**
+ * timer回调。arg由upstream_id和serial组成，query可能已经被pending_query_take取走
+ */
+static void __pending_query_timeout(void *arg)
+{
+	uint16_t id = (uint16_t)(uintptr_t)arg;
+
+	pthread_mutex_lock(&pending_table_mutex);
+	pending_query *query = pending_table[id];
+	if (query == NULL ||
+	    (((uintptr_t)query->serial << 16) | id) != (uintptr_t)arg) {
+		pthread_mutex_unlock(&pending_table_mutex);
+		return;
+	}
+
+	pending_table[id] = NULL;
+	pending_table_count--;
+	__index_remove(query);
+	pthread_mutex_unlock(&pending_table_mutex);
+
+	logger_write(LOGGER_DEBUG,
+		     "__pending_query_timeout(): Upstream query %04x timeout.",
+		     id);
+	if (pending_timeout_handler != NULL)
+		pending_timeout_handler(query);
+	else
+		free_pending_query(query);
+}
+
+/* 调用者持有pending_table_mutex */
+static void __arm_timer(pending_query *query, unsigned int timeout_ms)
+{
+	uintptr_t arg = ((uintptr_t)query->serial << 16) | query->upstream_id;
+	query->timer = timer_add(timeout_ms, __pending_query_timeout,
+				 (void *)arg);
+}
+
+PENDING_ADD_RESULT pending_query_add(pending_query *query,
+				     unsigned int timeout_ms)
+{
+	pthread_mutex_lock(&pending_table_mutex);
+	pending_query *inflight = __index_find(query);
+	if (inflight != NULL && query->client_sock == PENDING_NO_CLIENT) {
+		pthread_mutex_unlock(&pending_table_mutex);
+		free(query->packet);
+		free(query);
+		return PENDING_JOINED;
+	}
+	if (inflight != NULL && inflight->num_waiters == PENDING_MAX_WAITERS) {
+		pending_dropped++;
+		pthread_mutex_unlock(&pending_table_mutex);
+		free_pending_query(query);
+		return PENDING_DROPPED;
+	}
+	if (inflight != NULL) {
+		pending_waiter *waiter =
+			(pending_waiter *)malloc(sizeof(pending_waiter));
+		waiter->origin_id = query->origin_id;
+		waiter->client_sock = query->client_sock;
+		waiter->client = query->client;
+		waiter->udp_size = query->udp_size;
+		waiter->origin = query->origin;
+		waiter->origin_size = query->origin_size;
+		waiter->next = inflight->waiters;
+		inflight->waiters = waiter;
+		inflight->num_waiters++;
+		pending_saved++;
+		pthread_mutex_unlock(&pending_table_mutex);
+
+		free(query->packet);
+		free(query);
+		return PENDING_JOINED;
+	}
+
+	if (pending_table_count == PENDING_TABLE_SIZE) {
+		pthread_mutex_unlock(&pending_table_mutex);
+		logger_write(LOGGER_WARNING,
+			     "pending_query_add(): Pending table is full.");
+		return PENDING_FULL;
+	}
+
+	/* 随机起点，线性探测空闲ID */
+	uint16_t id = (uint16_t)rand();
+	while (pending_table[id] != NULL)
+		id++;
+
+	query->upstream_id = id;
+	query->serial = pending_serial++;
+	pending_table[id] = query;
+	pending_table_count++;
+	__index_insert(query);
+
+	/* 在锁内注册timer，保证回调执行前query->timer已经赋值 */
+	__arm_timer(query, timeout_ms);
+	pthread_mutex_unlock(&pending_table_mutex);
+	return PENDING_ADDED;
+}
+
+BOOL pending_query_retry(pending_query *query, unsigned int timeout_ms,
+			 uint16_t *upstream_id)
+{
+	pthread_mutex_lock(&pending_table_mutex);
+	if (pending_table_count == PENDING_TABLE_SIZE) {
+		pthread_mutex_unlock(&pending_table_mutex);
+		return FALSE;
+	}
+
+	/* ID被占用时，之前的发送的回复不会再匹配 */
+	uint16_t id = query->upstream_id;
+	while (pending_table[id] != NULL)
+		id++;
+
+	query->upstream_id = id;
+	*upstream_id = id;
+	pending_table[id] = query;
+	pending_table_count++;
+	__index_insert(query);
+	__arm_timer(query, timeout_ms);
+	pthread_mutex_unlock(&pending_table_mutex);
+	return TRUE;
+}
+
+BOOL pending_query_hedge(uint16_t upstream_id, uint32_t serial,
+			 const pending_attempt *attempt)
+{
+	BOOL res = FALSE;
+
+	pthread_mutex_lock(&pending_table_mutex);
+	pending_query *query = pending_table[upstream_id];
+	if (query != NULL && query->serial == serial &&
+	    query->num_attempts < PENDING_MAX_ATTEMPTS) {
+		res = TRUE;
+		for (size_t i = 0; i < query->num_attempts; i++)
+			if (query->attempts[i].upstream == attempt->upstream)
+				res = FALSE;
+	}
+	if (res)
+		query->attempts[query->num_attempts++] = *attempt;
+	pthread_mutex_unlock(&pending_table_mutex);
+	return res;
+}
+
+pending_attempt *pending_query_attempt(pending_query *query, SOCKET sock,
+				       uint32_t conn_serial)
+{
+	for (size_t i = 0; i < query->num_attempts; i++)
+		if (query->attempts[i].sock == sock &&
+		    query->attempts[i].conn_serial == conn_serial)
+			return &query->attempts[i];
+	return NULL;
+}
+
+pending_query *pending_query_take(SOCKET upstream_sock, uint32_t conn_serial,
+				  const void *reply, size_t size)
+{
+	uint8_t *q_begin = NULL;
+	size_t q_size = 0;
+
+	if (size < sizeof(dns_header) ||
+	    !__get_question(reply, size, &q_begin, &q_size))
+		return NULL;
+
+	uint16_t id = get_header_info(reply, HEADER_ID);
+
+	pthread_mutex_lock(&pending_table_mutex);
+	pending_query *res = pending_table[id];
+	if (res == NULL ||
+	    pending_query_attempt(res, upstream_sock, conn_serial) == NULL ||
+	    res->question_size != q_size ||
+	    !__question_equal(res->question, q_begin, q_size)) {
+		pthread_mutex_unlock(&pending_table_mutex);
+		return NULL;
+	}
+
+	pending_table[id] = NULL;
+	pending_table_count--;
+	__index_remove(res);
+	pthread_mutex_unlock(&pending_table_mutex);
+
+	timer_cancel(res->timer);
+	return res;
+}
+
+size_t pending_query_count(void)
+{
+	pthread_mutex_lock(&pending_table_mutex);
+	size_t res = pending_table_count;
+	pthread_mutex_unlock(&pending_table_mutex);
+	return res;
+}
+
+size_t pending_query_saved(void)
+{
+	pthread_mutex_lock(&pending_table_mutex);
+	size_t res = pending_saved;
+	pthread_mutex_unlock(&pending_table_mutex);
+	return res;
+}
+
+size_t pending_query_dropped(void)
+{
+	pthread_mutex_lock(&pending_table_mutex);
+	size_t res = pending_dropped;
+	pthread_mutex_unlock(&pending_table_mutex);
+	return res;
+}
@@ -0,0 +1,202 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_PENDING_QUERY_H_
+#define CORE_PENDING_QUERY_H_
+
+#include "socket.h"
+#include "timer.h"
+#include "unidef.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Question section: name (at most 255 bytes) + type + class */
+#define PENDING_QUESTION_MAX_SIZE 260
+
+/* 后台刷新cache的查询没有客户端，收到回复后只更新cache */
+#define PENDING_NO_CLIENT ((SOCKET)-1)
+
+/* 同一个查询最多发送的次数，包括hedge和超时重传 */
+#define PENDING_MAX_ATTEMPTS 4
+
+/* 同一个查询最多挂的waiter数，超出的请求直接丢弃，客户端会自己重试 */
+#define PENDING_MAX_WAITERS 64
+
+struct upstream_ctx;
+
+/* 查询的一次发送，每次发给不同的upstream */
+typedef struct pending_attempt {
+	int upstream; /* Index of the upstream server. */
+	SOCKET sock; /* The socket query is sent from. */
+	uint64_t sent_us; /* 发送的时间，用于计算RTT */
+	BOOL hedge; /* 由hedge发出，而不是超时重传 */
+	BOOL probe; /* 熔断后放行的探测，探测中只有它超时才重新熔断 */
+	BOOL tcp; /* sock为tcp_pool的连接 */
+	uint32_t conn_serial; /* tcp时为连接的序号，socket被新连接复用时用来区分，UDP为0 */
+	BOOL handshake; /* tcp连接在发送时还没有建立，RTT包含握手，不作为样本 */
+	BOOL timeout; /* 已经超时，仍然接受它的回复 */
+} pending_attempt;
+
+/* 与正在进行的查询相同的后续请求，共享同一个upstream回复 */
+typedef struct pending_waiter {
+	uint16_t origin_id;
+	SOCKET client_sock;
+	SOCKADDR_IN client;
+	uint16_t udp_size; /* 同pending_query.udp_size */
+	uint8_t *origin; /* 同pending_query.origin */
+	size_t origin_size;
+	struct pending_waiter *next;
+} pending_waiter;
+
+typedef struct pending_query {
+	uint16_t upstream_id; /* ID used when talking to upstream server. */
+	uint16_t origin_id; /* ID of the client's query. */
+	uint32_t serial; /* Distinguish queries reusing the same upstream_id. */
+	/* 按发送的先后排列，回复从其中任何一个socket到达都有效 */
+	pending_attempt attempts[PENDING_MAX_ATTEMPTS];
+	size_t num_attempts;
+	size_t retries; /* 超时重传的次数 */
+	const struct upstream_ctx *ctx; /* 重传时从同一组socket发送 */
+	/* 发给upstream的报文，用于超时重传，ID在发送时替换 */
+	uint8_t *packet;
+	size_t packet_size;
+	/* UDP回复被截断、改用TCP重新查询时保存截断的回复，TCP也没有回复时交给客户端 */
+	uint8_t *truncated;
+	size_t truncated_size;
+	timer_id timer;
+	SOCKET client_sock; /* The socket query is received from. */
+	SOCKADDR_IN client;
+	uint16_t udp_size; /* 客户端能接收的UDP报文大小，更大的回复被截断 */
+	/* 只查询CNAME链末端时为客户端原来的请求，回复要由cache重新构造 */
+	uint8_t *origin;
+	size_t origin_size;
+	pending_waiter *waiters;
+	size_t num_waiters;
+	struct pending_query *index_next; /* question索引中同一个桶的下一项 */
+	size_t question_size;
+	uint8_t question[PENDING_QUESTION_MAX_SIZE];
+} pending_query;
+
+typedef enum PENDING_ADD_RESULT {
+	PENDING_ADDED = 0, /* 已放入pending table，调用者需要向upstream发送 */
+	PENDING_JOINED = 1, /* 已有相同的查询在进行中，query已被释放 */
+	PENDING_FULL = 2, /* pending table已满，query的所有权仍属于调用者 */
+	PENDING_DROPPED = 3 /* 相同的查询的waiter已达上限，query已被释放 */
+} PENDING_ADD_RESULT;
+
+extern void pending_query_init(void);
+
+/**
+ * 设置query超时被移除时的回调。回调获得query的所有权，
+ * 可以用pending_query_retry()把它放回pending table，否则应释放它。
+ * 没有设置回调时query直接被释放。
+ */
+extern void pending_query_set_timeout_handler(
+	void (*handler)(pending_query *query));
+
+/**
+ * 根据请求创建一个pending query。question和origin_id从query中复制。
+ * client_sock为PENDING_NO_CLIENT时client可以为NULL。
+ * @return 若query不是合法请求则返回NULL
+ */
+extern pending_query *create_pending_query(const void *query, size_t size,
+					   SOCKET client_sock,
+					   const SOCKADDR_IN *client);
+
+/**
+ * 复制发给upstream的报文，超时重传时使用
+ */
+extern void pending_query_set_packet(pending_query *query, const void *packet,
+				     size_t size);
+
+/**
+ * 复制被截断的UDP回复，改用TCP后仍然没有回复时使用
+ */
+extern void pending_query_set_truncated(pending_query *query, const void *reply,
+					size_t size);
+
+/**
+ * 复制客户端原来的请求，表示query只是为了补全它的CNAME链
+ */
+extern void pending_query_set_origin(pending_query *query, const void *request,
+				     size_t size);
+
+/**
+ * 释放query及其所有waiter
+ */
+extern void free_pending_query(pending_query *query);
+
+/**
+ * 若已有question完全相同的查询在等待upstream回复，则把query作为waiter挂在它上面（single-flight），
+ * 没有客户端的query直接释放，waiter已有PENDING_MAX_WAITERS个时丢弃query；否则将query放入pending table，并为其分配一个未被占用的upstream_id。
+ * timeout_ms后若仍未收到回复，query会被移除并释放。
+ */
+extern PENDING_ADD_RESULT pending_query_add(pending_query *query,
+					    unsigned int timeout_ms);
+
+/**
+ * 把超时回调中的query放回pending table，尽量沿用原来的upstream_id，
+ * 不与相同的查询合并。之后再用upstream_id发送query->attempts中新加的一次，
+ * 此时之前的发送的回复可能已经取走了query，不能再访问它。
+ * @return pending table已满时返回FALSE，query的所有权仍属于调用者
+ */
+extern BOOL pending_query_retry(pending_query *query, unsigned int timeout_ms,
+				out uint16_t *upstream_id);
+
+/**
+ * 若ID为upstream_id、序号为serial的查询仍在等待回复，且没有发给过attempt->upstream，
+ * 记录它又按attempt发送了一次（hedge），之后所有发送的回复都能匹配。
+ * @return 查询已经结束或不能再发送时返回FALSE，调用者不应再发送
+ */
+extern BOOL pending_query_hedge(uint16_t upstream_id, uint32_t serial,
+				const pending_attempt *attempt);
+
+/**
+ * @param conn_serial 同pending_attempt.conn_serial
+ * @return query从sock发出的那一次发送，没有时返回NULL
+ */
+extern pending_attempt *pending_query_attempt(pending_query *query,
+					      SOCKET sock,
+					      uint32_t conn_serial);
+
+/**
+ * 按ID查找从query->attempts中任何一个socket（及conn_serial）发出且与reply的question相匹配的pending query，并将其从pending table中移除。
+ * 调用者获得返回值的所有权，需要同时回复其中的waiter，使用后调用free_pending_query()。
+ * @return 若没有匹配的pending query则返回NULL
+ */
+extern pending_query *pending_query_take(SOCKET upstream_sock,
+					 uint32_t conn_serial,
+					 const void *reply, size_t size);
+
+extern size_t pending_query_count(void);
+
+/* 因挂在已有查询上而省下的upstream查询数 */
+extern size_t pending_query_saved(void);
+
+/* 因相同的查询waiter已满而丢弃的请求数 */
+extern size_t pending_query_dropped(void);
+
+#endif /* CORE_PENDING_QUERY_H_ */
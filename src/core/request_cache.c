@@ -26,57 +26,175 @@
 #define _GNU_SOURCE
 
 #include "request_cache.h"
+#include "config.h"
 #include "logger.h"
+#include "model/ring_buffer.h"
 #include "unidef.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct request_node {
-	request_data *data;
-	struct request_node *next;
-} request_node;
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
-typedef struct request_queue {
-	size_t size;
-	request_node *begin, *end;
-} request_queue;
+/* 自适应自旋次数的下限 */
+#define REQUEST_MIN_SPIN 16
 
-pthread_mutex_t request_cache_mutex;
 pthread_t request_cache_thread;
-request_queue request_cache_pool;
+ring_buffer *request_cache_pool;
 int request_cache_pool_inited;
 
-static request_node *new_node()
+/**
+ * 空闲request_data的freelist，容量即high-water mark。
+ * 超出容量的请求释放时直接free，由ring_dropped()计数。
+ */
+static ring_buffer *request_free_pool;
+static atomic_size_t request_pool_hits;
+static atomic_size_t request_pool_misses;
+static atomic_size_t request_in_use;
+
+/**
+ * 空闲的工作线程在request_event上park。
+ * 每放入一个请求request_event加一，若有线程在等待则唤醒其中一个。
+ */
+static atomic_uint request_event;
+static atomic_uint request_waiters;
+
+#ifndef __linux__
+static pthread_mutex_t request_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_event_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void __event_wait(unsigned int key)
+{
+#ifdef __linux__
+	syscall(SYS_futex, &request_event, FUTEX_WAIT_PRIVATE, key, NULL, NULL,
+		0);
+#else
+	pthread_mutex_lock(&request_event_mutex);
+	while (atomic_load(&request_event) == key)
+		pthread_cond_wait(&request_event_cond, &request_event_mutex);
+	pthread_mutex_unlock(&request_event_mutex);
+#endif
+}
+
+static void __event_notify(void)
+{
+	atomic_fetch_add(&request_event, 1);
+	/* 与wait_request()中的fence配对，保证不会错过正在park的线程 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&request_waiters) == 0)
+		return;
+
+#ifdef __linux__
+	syscall(SYS_futex, &request_event, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+		0);
+#else
+	pthread_mutex_lock(&request_event_mutex);
+	pthread_cond_signal(&request_event_cond);
+	pthread_mutex_unlock(&request_event_mutex);
+#endif
+}
+
+static void __cpu_relax(void)
 {
-	request_node *res = (request_node *)malloc(sizeof(request_node));
-	res->data = NULL;
-	res->next = NULL;
-	return res;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
 }
 
-static request_data *listen_to_client()
+/**
+ * 优先从freelist取，freelist为空时malloc
+ */
+request_data *new_request()
 {
-	request_data *res = (request_data *)malloc(sizeof(request_data));
-	res->size = listen_to_local(&res->info, res->data, REQUEST_BUF_SIZE);
-	return res;
+	request_data *request = NULL;
+
+	if (request_free_pool != NULL)
+		request = (request_data *)ring_pop(request_free_pool);
+
+	if (request != NULL) {
+		atomic_fetch_add_explicit(&request_pool_hits, 1,
+					  memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&request_pool_misses, 1,
+					  memory_order_relaxed);
+		request = (request_data *)malloc(sizeof(request_data));
+	}
+
+	atomic_fetch_add_explicit(&request_in_use, 1, memory_order_relaxed);
+	return request;
+}
+
+/**
+ * 放回freelist，freelist已满时free
+ */
+void free_request(request_data *request)
+{
+	if (request == NULL)
+		return;
+
+	atomic_fetch_sub_explicit(&request_in_use, 1, memory_order_relaxed);
+	if (request_free_pool == NULL ||
+	    !ring_push(request_free_pool, request))
+		free(request);
 }
 
-static void push_back(request_data *data)
+void get_request_pool_stats(request_pool_stats *stats)
 {
-	request_cache_pool.end->data = data;
-	request_cache_pool.end->next = new_node();
-	request_cache_pool.end = request_cache_pool.end->next;
+	stats->hits =
+		atomic_load_explicit(&request_pool_hits, memory_order_relaxed);
+	stats->misses = atomic_load_explicit(&request_pool_misses,
+					     memory_order_relaxed);
+	stats->in_use =
+		atomic_load_explicit(&request_in_use, memory_order_relaxed);
+	stats->pooled = request_free_pool ? ring_size(request_free_pool) : 0;
+	stats->released =
+		request_free_pool ? ring_dropped(request_free_pool) : 0;
 }
 
+/**
+ * 每次最多取出batch_size个报文，收到的请求放入队列后补充新的缓冲区
+ */
 _Noreturn static void *listener_thread(void *_)
 {
+	size_t batch_size = DNS_SERVER_MAX(get_config()->batch_size, 1);
+	request_data **requests =
+		(request_data **)malloc(batch_size * sizeof(request_data *));
+	udp_msg *msgs = (udp_msg *)malloc(batch_size * sizeof(udp_msg));
+
+	for (size_t i = 0; i < batch_size; i++)
+		requests[i] = new_request();
+
 	while (1) {
-		request_data *request = listen_to_client();
-		pthread_mutex_lock(&request_cache_mutex);
-		push_back(request);
-		pthread_mutex_unlock(&request_cache_mutex);
+		for (size_t i = 0; i < batch_size; i++) {
+			msgs[i].info = &requests[i]->info;
+			msgs[i].data = requests[i]->data;
+			msgs[i].buf_size = REQUEST_BUF_SIZE;
+			msgs[i].size = 0;
+		}
+
+		size_t num = listen_to_local_batch(msgs, batch_size);
+
+		for (size_t i = 0; i < num; i++) {
+			requests[i]->size = msgs[i].size;
+			requests[i]->sock = get_local_socket();
+			if (!ring_push(request_cache_pool, requests[i])) {
+				logger_write(
+					LOGGER_DEBUG,
+					"listener_thread(): Request Cache Pool full. Request dropped.");
+				continue;
+			}
+
+			__event_notify();
+			requests[i] = new_request();
+		}
 	}
 }
 
@@ -85,10 +203,11 @@ _Noreturn static void *listener_thread(void *_)
  */
 void request_cache_init()
 {
-	pthread_mutex_init(&request_cache_mutex, NULL);
-	request_cache_pool.size = 0;
-	request_cache_pool.begin = new_node();
-	request_cache_pool.end = request_cache_pool.begin;
+	request_cache_pool =
+		create_ring_buffer(get_config()->request_queue_size);
+	if (get_config()->request_pool_size)
+		request_free_pool =
+			create_ring_buffer(get_config()->request_pool_size);
 	pthread_create(&request_cache_thread, NULL, listener_thread, NULL);
 	request_cache_pool_inited = 1;
 	logger_write(
@@ -108,12 +227,12 @@ int no_request()
 			"FATAL: no_request(): Request Cache Pool not initialized.");
 		exit(1);
 	}
-	return (request_cache_pool.begin == request_cache_pool.end);
+	return ring_size(request_cache_pool) == 0;
 }
 
 /**
  * 从请求池获取一个请求。调用该函数后，请求的指针会被从请求池中移除。
- * 因此，在完全释放指针之前，请调用free释放其空间。
+ * 因此，在完全释放指针之前，请调用free_request()归还。
  * @return 若请求池为空则返回NULL，否则返回一个请求的指针
  */
 request_data *get_request()
@@ -125,16 +244,58 @@ request_data *get_request()
 		exit(1);
 	}
 
-	pthread_mutex_lock(&request_cache_mutex);
-	if (no_request()) {
-		// logger_write(LOGGER_DEBUG, "Request Cache Pool Empty.");
-		pthread_mutex_unlock(&request_cache_mutex);
-		return NULL;
+	return (request_data *)ring_pop(request_cache_pool);
+}
+
+/**
+ * 阻塞直到获取一个请求。先自旋一段时间，仍然没有请求时park。
+ * 自旋次数根据最近的效果在REQUEST_MIN_SPIN和worker_spin之间调整。
+ */
+request_data *wait_request()
+{
+	static _Thread_local size_t spin_limit = 0;
+	size_t max_spin = get_config()->worker_spin;
+	request_data *res = NULL;
+
+	if (spin_limit == 0 || spin_limit > max_spin)
+		spin_limit = max_spin;
+
+	while (1) {
+		for (size_t i = 0; i <= spin_limit; i++) {
+			res = get_request();
+			if (res != NULL) {
+				/* 自旋等到了请求，下次可以多自旋一会 */
+				if (i && spin_limit < max_spin)
+					spin_limit = DNS_SERVER_MIN(spin_limit * 2,
+								    max_spin);
+				return res;
+			}
+			__cpu_relax();
+		}
+
+		if (spin_limit > REQUEST_MIN_SPIN)
+			spin_limit /= 2;
+
+		unsigned int key = atomic_load(&request_event);
+		atomic_fetch_add(&request_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		res = get_request();
+		if (res == NULL)
+			__event_wait(key);
+
+		atomic_fetch_sub(&request_waiters, 1);
+		if (res != NULL)
+			return res;
 	}
-	request_data *res = request_cache_pool.begin->data;
-	request_node *temp = request_cache_pool.begin;
-	request_cache_pool.begin = request_cache_pool.begin->next;
-	free(temp);
-	pthread_mutex_unlock(&request_cache_mutex);
-	return res;
-}
\ No newline at end of file
+}
+
+size_t request_queue_depth()
+{
+	return ring_size(request_cache_pool);
+}
+
+size_t request_queue_dropped()
+{
+	return ring_dropped(request_cache_pool);
+}
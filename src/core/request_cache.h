@@ -32,12 +32,36 @@
 
 typedef struct request_data {
 	size_t size;
+	SOCKET sock; /* 收到请求的socket，回复也从这里发出 */
 	SOCKADDR_IN info;
 	unsigned char data[REQUEST_BUF_SIZE];
 } request_data;
 
+typedef struct request_pool_stats {
+	size_t hits; /* 从freelist取得的次数 */
+	size_t misses; /* freelist为空而malloc的次数 */
+	size_t in_use; /* 已取出尚未归还的数量 */
+	size_t pooled; /* freelist中空闲的数量 */
+	size_t released; /* 超过high-water mark而直接free的次数 */
+} request_pool_stats;
+
 extern void request_cache_init();
+
+/**
+ * 分配和归还request_data。归还的缓冲区保留在一个无锁freelist中，
+ * 最多保留request_pool_size个，超出部分交还给malloc。
+ */
+extern request_data *new_request();
+extern void free_request(request_data *request);
+extern void get_request_pool_stats(request_pool_stats *stats);
+
 extern int no_request();
 extern request_data *get_request();
+extern request_data *wait_request();
+
+/* 当前排队的请求数 */
+extern size_t request_queue_depth();
+/* 因队列已满而被丢弃的请求数 */
+extern size_t request_queue_dropped();
 
 #endif /* CORE_REQUEST_CACHE_H_ */
\ No newline at end of file
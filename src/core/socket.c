@@ -23,22 +23,47 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include "socket.h"
+#include "config.h"
 #include "logger.h"
 #include "unidef.h"
+#include "uring.h"
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include <pthread.h>
-#include <signal.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+typedef struct send_batch {
+	SOCKET sock;
+	size_t num;
+	uint64_t first_us; /* 批次中最早的报文放入的时间 */
+	SOCKADDR_IN *infos;
+	size_t *sizes;
+	unsigned char (*bufs)[RAW_DATA_MAX_SIZE];
+} send_batch;
+
 static SOCKET local_socket;
 
+static atomic_size_t stat_recv_calls;
+static atomic_size_t stat_recv_msgs;
+static atomic_size_t stat_send_calls;
+static atomic_size_t stat_send_msgs;
+
+static _Thread_local send_batch *thread_send_batch;
+
+/* io_uring引擎下每个线程只为它监听的一个socket创建uring_ctx */
+static _Thread_local uring_ctx *thread_uring;
+static _Thread_local SOCKET thread_uring_sock = -1;
+static atomic_bool uring_unavailable;
+
 static void bind_local_port(const unsigned short port)
 {
 	local_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -64,11 +89,40 @@ static void bind_local_port(const unsigned short port)
 
 void socket_init()
 {
-	bind_local_port(DNS_PORT);
+	if (!get_config()->reuseport)
+		bind_local_port(DNS_PORT);
 	logger_write(LOGGER_DEBUG,
 		     "socket_init(): Socket initialization finished");
 }
 
+SOCKET bind_reuseport_socket(const unsigned short port)
+{
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int on = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+		logger_write(
+			LOGGER_ERROR,
+			"FATAL: bind_reuseport_socket(): Failed to set SO_REUSEPORT. ERROR CODE: %d",
+			errno);
+		exit(1);
+	}
+
+	SOCKADDR_IN info;
+	info.sin_family = AF_INET;
+	info.sin_port = htons(port);
+	info.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(sock, (SOCKADDR *)&info, sizeof(info))) {
+		logger_write(
+			LOGGER_ERROR,
+			"FATAL: bind_reuseport_socket(): Failed to bind local port %u",
+			port);
+		exit(1);
+	}
+	return sock;
+}
+
 void send_to(const SOCKET sock_id, const SOCKADDR_IN *sock_info,
 	     const unsigned char *data, const size_t size)
 {
@@ -118,95 +172,237 @@ size_t listen_to(const SOCKET sock_id, SOCKADDR_IN *sock_info,
 	}
 }
 
-static void *listen_to_middleware(void *args)
+size_t listen_to_local(SOCKADDR_IN *sock_info, unsigned char *buffer,
+		       const size_t buf_size)
+{
+	return listen_to(local_socket, sock_info, buffer, buf_size);
+}
+
+SOCKET get_local_socket()
+{
+	return local_socket;
+}
+
+/**
+ * @return 当前线程在sock上使用的uring_ctx，未启用io_uring或不可用时返回NULL
+ */
+static uring_ctx *__get_uring(const SOCKET sock)
+{
+	if (!get_config()->io_uring ||
+	    atomic_load_explicit(&uring_unavailable, memory_order_relaxed))
+		return NULL;
+
+	if (thread_uring != NULL)
+		return thread_uring_sock == sock ? thread_uring : NULL;
+
+	thread_uring = create_uring_ctx(sock);
+	if (thread_uring == NULL) {
+		atomic_store(&uring_unavailable, TRUE);
+		logger_write(
+			LOGGER_WARNING,
+			"__get_uring(): Falling back to recvmmsg/recvfrom.");
+		return NULL;
+	}
+	thread_uring_sock = sock;
+	return thread_uring;
+}
+
+int socket_poll_fd(const SOCKET sock_id)
 {
-	struct {
-		SOCKET socket;
-		SOCKADDR_IN *sock_info;
-		unsigned char *buffer;
-		size_t buf_size;
-		size_t res;
-	} *arg_ptr = args;
-	arg_ptr->res = listen_to(arg_ptr->socket, arg_ptr->sock_info,
-				 arg_ptr->buffer, arg_ptr->buf_size);
-	return NULL;
+	uring_ctx *ctx = __get_uring(sock_id);
+	return ctx != NULL ? uring_fd(ctx) : sock_id;
 }
 
-static void *listen_to_timer(void *args)
+size_t listen_to_batch(const SOCKET sock_id, udp_msg *msgs, const size_t num)
 {
-	struct {
-		unsigned int sec;
-		pthread_t main_thread;
-	} *arg_ptr = args;
-	sleep(arg_ptr->sec);
-	if (!pthread_kill(arg_ptr->main_thread, 0)) {
-		logger_write(LOGGER_DEBUG, "Listen to server timeout. skip.");
-		pthread_cancel(arg_ptr->main_thread);
+	size_t n = DNS_SERVER_MIN(num, SOCKET_MAX_BATCH);
+	if (n == 0)
+		return 0;
+
+	uring_ctx *ctx = __get_uring(sock_id);
+	if (ctx != NULL) {
+		size_t res = uring_recv_batch(ctx, msgs, n);
+		atomic_fetch_add_explicit(&stat_recv_calls, 1,
+					  memory_order_relaxed);
+		atomic_fetch_add_explicit(&stat_recv_msgs, res,
+					  memory_order_relaxed);
+		return res;
+	}
+
+#ifdef __linux__
+	struct mmsghdr hdrs[SOCKET_MAX_BATCH];
+	struct iovec iovs[SOCKET_MAX_BATCH];
+
+	for (size_t i = 0; i < n; i++) {
+		iovs[i].iov_base = msgs[i].data;
+		iovs[i].iov_len = msgs[i].buf_size;
+		memset(&hdrs[i], 0, sizeof(hdrs[i]));
+		hdrs[i].msg_hdr.msg_name = msgs[i].info;
+		hdrs[i].msg_hdr.msg_namelen = sizeof(SOCKADDR_IN);
+		hdrs[i].msg_hdr.msg_iov = &iovs[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
 	}
-	return NULL;
-}
-
-size_t listen_to_async(const SOCKET sock_id, SOCKADDR_IN *sock_info,
-		       unsigned char *buffer, const size_t buf_size,
-		       const unsigned int sec)
-{
-	pthread_t listen_thread, timer_thread;
-	struct {
-		SOCKET socket;
-		SOCKADDR_IN *sock_info;
-		unsigned char *buffer;
-		size_t buf_size;
-		size_t res;
-	} *arg_ptr = malloc(sizeof(struct {
-		SOCKET socket;
-		SOCKADDR_IN *sock_info;
-		unsigned char *buffer;
-		size_t buf_size;
-		size_t res;
-	}));
-
-	arg_ptr->socket = sock_id;
-	arg_ptr->sock_info = sock_info;
-	arg_ptr->buffer = buffer;
-	arg_ptr->buf_size = buf_size;
-	arg_ptr->res = 0;
-
-	pthread_create(&listen_thread, NULL, listen_to_middleware, arg_ptr);
-
-	struct {
-		unsigned int sec;
-		pthread_t main_thread;
-	} *timer_arg_ptr = malloc(sizeof(struct {
-		unsigned int sec;
-		pthread_t main_thread;
-	}));
-
-	timer_arg_ptr->main_thread = listen_thread;
-	timer_arg_ptr->sec = sec;
-
-	pthread_create(&timer_thread, NULL, listen_to_timer, timer_arg_ptr);
-	pthread_detach(timer_thread);
-	pthread_join(listen_thread, NULL);
-
-	// Kill timer if received data from remote DNS Server
-	if (!pthread_kill(timer_thread, 0)) {
-		pthread_cancel(timer_thread);
+
+	int res = recvmmsg(sock_id, hdrs, n, MSG_WAITFORONE, NULL);
+	if (res <= 0) {
+		logger_write(LOGGER_WARNING,
+			     "listen_to_batch(): recvmmsg failed. ERROR CODE: %d",
+			     errno);
+		return 0;
 	}
 
-	size_t res = arg_ptr->res;
+	for (int i = 0; i < res; i++)
+		msgs[i].size = hdrs[i].msg_len;
+#else
+	size_t res = listen_to(sock_id, msgs[0].info, msgs[0].data,
+			       msgs[0].buf_size);
+	if (res == 0)
+		return 0;
+	msgs[0].size = res;
+	res = 1;
+#endif
 
-	free(arg_ptr);
-	free(timer_arg_ptr);
+	atomic_fetch_add_explicit(&stat_recv_calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stat_recv_msgs, res, memory_order_relaxed);
 	return res;
 }
 
-size_t listen_to_local(SOCKADDR_IN *sock_info, unsigned char *buffer,
-		       const size_t buf_size)
+size_t listen_to_local_batch(udp_msg *msgs, const size_t num)
 {
-	return listen_to(local_socket, sock_info, buffer, buf_size);
+	return listen_to_batch(local_socket, msgs, num);
 }
 
-SOCKET get_local_socket()
+static uint64_t __now_us(void)
 {
-	return local_socket;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static send_batch *__get_send_batch(void)
+{
+	if (thread_send_batch != NULL)
+		return thread_send_batch;
+
+	size_t size = DNS_SERVER_MAX(get_config()->batch_size, 1);
+	send_batch *batch = (send_batch *)malloc(sizeof(send_batch));
+	batch->sock = -1;
+	batch->num = 0;
+	batch->first_us = 0;
+	batch->infos = (SOCKADDR_IN *)malloc(size * sizeof(SOCKADDR_IN));
+	batch->sizes = (size_t *)malloc(size * sizeof(size_t));
+	batch->bufs = malloc(size * RAW_DATA_MAX_SIZE);
+
+	thread_send_batch = batch;
+	return batch;
+}
+
+static void __send_batch(send_batch *batch)
+{
+	size_t sent = 0;
+
+#ifdef __linux__
+	struct mmsghdr hdrs[SOCKET_MAX_BATCH];
+	struct iovec iovs[SOCKET_MAX_BATCH];
+
+	while (sent < batch->num) {
+		size_t n = DNS_SERVER_MIN(batch->num - sent, SOCKET_MAX_BATCH);
+
+		for (size_t i = 0; i < n; i++) {
+			iovs[i].iov_base = batch->bufs[sent + i];
+			iovs[i].iov_len = batch->sizes[sent + i];
+			memset(&hdrs[i], 0, sizeof(hdrs[i]));
+			hdrs[i].msg_hdr.msg_name = &batch->infos[sent + i];
+			hdrs[i].msg_hdr.msg_namelen = sizeof(SOCKADDR_IN);
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int res = sendmmsg(batch->sock, hdrs, n, 0);
+		atomic_fetch_add_explicit(&stat_send_calls, 1,
+					  memory_order_relaxed);
+
+		if (res <= 0) {
+			/* 跳过发送失败的报文 */
+			logger_write(LOGGER_WARNING,
+				     "__send_batch(): Failed to send data. ERROR CODE: %d",
+				     errno);
+			sent++;
+			continue;
+		}
+
+		atomic_fetch_add_explicit(&stat_send_msgs, res,
+					  memory_order_relaxed);
+		sent += res;
+	}
+#else
+	for (; sent < batch->num; sent++) {
+		send_to(batch->sock, &batch->infos[sent], batch->bufs[sent],
+			batch->sizes[sent]);
+		atomic_fetch_add_explicit(&stat_send_calls, 1,
+					  memory_order_relaxed);
+		atomic_fetch_add_explicit(&stat_send_msgs, 1,
+					  memory_order_relaxed);
+	}
+#endif
+
+	batch->num = 0;
+}
+
+void send_to_batched(const SOCKET sock_id, const SOCKADDR_IN *sock_info,
+		     const unsigned char *data, const size_t size)
+{
+	if (size > RAW_DATA_MAX_SIZE) {
+		send_to(sock_id, sock_info, data, size);
+		return;
+	}
+
+	send_batch *batch = __get_send_batch();
+	size_t batch_size = DNS_SERVER_MAX(get_config()->batch_size, 1);
+
+	if (batch->num && batch->sock != sock_id)
+		__send_batch(batch);
+
+	if (batch->num == 0) {
+		batch->sock = sock_id;
+		batch->first_us = __now_us();
+	}
+
+	batch->infos[batch->num] = *sock_info;
+	batch->sizes[batch->num] = size;
+	memcpy(batch->bufs[batch->num], data, size);
+	batch->num++;
+
+	if (batch->num >= batch_size)
+		__send_batch(batch);
+	else
+		check_send_batch();
+}
+
+void flush_send_batch(void)
+{
+	if (thread_send_batch != NULL && thread_send_batch->num)
+		__send_batch(thread_send_batch);
+}
+
+void check_send_batch(void)
+{
+	send_batch *batch = thread_send_batch;
+	if (batch == NULL || batch->num == 0)
+		return;
+
+	if (__now_us() - batch->first_us >= get_config()->batch_flush_us)
+		__send_batch(batch);
+}
+
+void get_socket_stats(socket_stats *stats)
+{
+	stats->recv_calls = atomic_load_explicit(&stat_recv_calls,
+						 memory_order_relaxed);
+	stats->recv_msgs = atomic_load_explicit(&stat_recv_msgs,
+						memory_order_relaxed);
+	stats->send_calls = atomic_load_explicit(&stat_send_calls,
+						 memory_order_relaxed);
+	stats->send_msgs = atomic_load_explicit(&stat_send_msgs,
+						memory_order_relaxed);
 }
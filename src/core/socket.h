@@ -44,21 +44,72 @@ typedef int SOCKET;
 
 #define DNS_PORT 53
 
+/* recvmmsg一次最多取出的报文数 */
+#define SOCKET_MAX_BATCH 256
+
+/* 批量收发时的单个UDP报文 */
+typedef struct udp_msg {
+	SOCKADDR_IN *info;
+	unsigned char *data;
+	size_t buf_size;
+	size_t size; /* 收到的数据大小 */
+} udp_msg;
+
+typedef struct socket_stats {
+	size_t recv_calls;
+	size_t recv_msgs;
+	size_t send_calls;
+	size_t send_msgs;
+} socket_stats;
+
+/**
+ * 共享模式下绑定唯一的本地socket；reuseport模式下不做任何事，
+ * 由各线程调用bind_reuseport_socket()创建自己的socket。
+ */
 extern void socket_init();
 
+/**
+ * 创建一个设置了SO_REUSEPORT的UDP socket并绑定到port，内核负责在这些socket间分配请求。
+ */
+extern SOCKET bind_reuseport_socket(const unsigned short port);
+
 extern void send_to(const SOCKET sock_id, const SOCKADDR_IN *sock_info,
 		    const unsigned char *data, const size_t size);
 
 extern size_t listen_to(const SOCKET sock_id, SOCKADDR_IN *sock_info,
 			unsigned char *buffer, const size_t buf_size);
 
-extern size_t listen_to_async(const SOCKET sock_id, SOCKADDR_IN *sock_info,
-			      unsigned char *buffer, const size_t buf_size,
-			      const unsigned int sec);
-
 extern size_t listen_to_local(SOCKADDR_IN *sock_info, unsigned char *buffer,
 			      const size_t buf_size);
 
+/**
+ * 阻塞直到收到至少一个报文，然后一次性取出已到达的报文，最多num个。
+ * @return 收到的报文数量
+ */
+extern size_t listen_to_batch(const SOCKET sock_id, udp_msg *msgs,
+			      const size_t num);
+
+/**
+ * @return 等待sock_id可读时应当poll的fd。启用io_uring时为ring的fd，否则就是sock_id本身
+ */
+extern int socket_poll_fd(const SOCKET sock_id);
+
+extern size_t listen_to_local_batch(udp_msg *msgs, const size_t num);
+
+/**
+ * 将报文放入当前线程的发送批次。批次满、目标socket改变或超过batch_flush_us时发送。
+ */
+extern void send_to_batched(const SOCKET sock_id, const SOCKADDR_IN *sock_info,
+			    const unsigned char *data, const size_t size);
+
+/* 立即发送当前线程批次中的所有报文 */
+extern void flush_send_batch(void);
+
+/* 若当前线程批次中最早的报文已超过batch_flush_us，则发送整个批次 */
+extern void check_send_batch(void);
+
+extern void get_socket_stats(socket_stats *stats);
+
 extern SOCKET get_local_socket();
 
 #endif /* CORE_SOCKET_H_ */
\ No newline at end of file
@@ -0,0 +1,444 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "tcp_pool.h"
+#include "logger.h"
+#include "timer.h"
+#include "unidef.h"
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* 没有事件时I/O线程检查空闲连接的间隔 */
+#define TCP_POOL_TICK_MS 1000
+
+typedef struct tcp_conn {
+	SOCKET sock;
+	uint32_t serial; /* 区分复用同一个socket的连接 */
+	int upstream;
+	BOOL connected;
+	size_t inflight; /* 已发送还没有收到回复的查询数 */
+	uint64_t active_ms; /* 最后一次发送或收到回复的时间 */
+	/* 上次收到回复后第一次发送的时间，没有等待回复的发送时为0 */
+	uint64_t wait_ms;
+	/* 连接建立前或内核缓冲区满时，还没有写出的数据 */
+	uint8_t *wbuf;
+	size_t wbuf_size;
+	size_t wbuf_cap;
+	/* 只由I/O线程访问，最多是一个不完整的报文 */
+	uint8_t rbuf[2 + TCP_DNS_MAX_SIZE];
+	size_t rbuf_size;
+} tcp_conn;
+
+/* pool[upstream * TCP_POOL_MAX_CONNS + i]，空位为NULL。连接只由I/O线程关闭和释放 */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static tcp_conn **pool;
+static SOCKADDR_IN *pool_addrs;
+static size_t pool_num;
+static tcp_reply_handler pool_handler;
+static tcp_pool_stats pool_stats;
+static uint32_t pool_serial;
+
+/* 唤醒I/O线程，使其重新收集需要poll的连接 */
+static int wake_pipe[2];
+
+static void __wake(void)
+{
+	char c = 0;
+	if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		logger_write(LOGGER_WARNING,
+			     "__wake(): Failed to wake TCP pool thread.");
+}
+
+static void __log_addr(LOGGER_LEVEL level, const char *msg, int upstream)
+{
+	unsigned char *addr =
+		(unsigned char *)&pool_addrs[upstream].sin_addr.s_addr;
+	logger_write(level, "%s %u.%u.%u.%u.", msg, addr[0], addr[1],
+		     addr[2], addr[3]);
+}
+
+/**
+ * 开始非阻塞地连接upstream，调用者持有pool_lock
+ */
+static tcp_conn *__open(int upstream)
+{
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return NULL;
+
+	int one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if (connect(sock, (const SOCKADDR *)&pool_addrs[upstream],
+		    sizeof(SOCKADDR_IN)) < 0 &&
+	    errno != EINPROGRESS) {
+		__log_addr(LOGGER_WARNING,
+			   "__open(): Failed to connect over TCP to", upstream);
+		close(sock);
+		return NULL;
+	}
+
+	tcp_conn *conn = (tcp_conn *)malloc(sizeof(tcp_conn));
+	conn->sock = sock;
+	/* 0表示UDP的发送，回绕时跳过 */
+	if (++pool_serial == 0)
+		pool_serial = 1;
+	conn->serial = pool_serial;
+	conn->upstream = upstream;
+	conn->connected = FALSE;
+	conn->inflight = 0;
+	conn->active_ms = timer_now_ms();
+	conn->wait_ms = 0;
+	conn->wbuf = NULL;
+	conn->wbuf_size = 0;
+	conn->wbuf_cap = 0;
+	conn->rbuf_size = 0;
+	pool_stats.opened++;
+	__log_addr(LOGGER_DEBUG, "__open(): Connecting over TCP to", upstream);
+	return conn;
+}
+
+/* 调用者持有pool_lock */
+static tcp_conn *__find(SOCKET sock, uint32_t serial)
+{
+	for (size_t i = 0; i < pool_num * TCP_POOL_MAX_CONNS; i++)
+		if (pool[i] != NULL && pool[i]->sock == sock &&
+		    pool[i]->serial == serial)
+			return pool[i];
+	return NULL;
+}
+
+static void __append(tcp_conn *conn, const void *data, size_t size)
+{
+	if (conn->wbuf_size + size > conn->wbuf_cap) {
+		conn->wbuf_cap = DNS_SERVER_MAX(2 * conn->wbuf_cap,
+					       conn->wbuf_size + size);
+		conn->wbuf = (uint8_t *)realloc(conn->wbuf, conn->wbuf_cap);
+	}
+	memcpy(conn->wbuf + conn->wbuf_size, data, size);
+	conn->wbuf_size += size;
+}
+
+/**
+ * 尽量写出缓冲区中的数据，调用者持有pool_lock
+ * @return 连接出错时返回FALSE
+ */
+static BOOL __flush(tcp_conn *conn)
+{
+	while (conn->wbuf_size > 0) {
+		ssize_t n = send(conn->sock, conn->wbuf, conn->wbuf_size,
+				 MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ||
+			       errno == EINTR;
+
+		memmove(conn->wbuf, conn->wbuf + n, conn->wbuf_size - n);
+		conn->wbuf_size -= n;
+	}
+	return TRUE;
+}
+
+/* 从pool中移除conn，之后tcp_pool_get()和tcp_pool_send()都找不到它。调用者持有pool_lock */
+static void __detach(tcp_conn *conn)
+{
+	for (size_t i = 0; i < pool_num * TCP_POOL_MAX_CONNS; i++)
+		if (pool[i] == conn)
+			pool[i] = NULL;
+}
+
+/* conn必须已经从pool中移除，只在I/O线程中调用 */
+static void __close(tcp_conn *conn)
+{
+	/* 还在等待的查询由pending table超时后重传 */
+	__log_addr(LOGGER_DEBUG, "__close(): Closed TCP connection to",
+		   conn->upstream);
+	close(conn->sock);
+	free(conn->wbuf);
+	free(conn);
+}
+
+/**
+ * 读取连接上已经到达的数据，每个完整的回复调用一次pool_handler
+ * @return 连接被关闭或出错时返回FALSE
+ */
+static BOOL __read(tcp_conn *conn)
+{
+	ssize_t n = recv(conn->sock, conn->rbuf + conn->rbuf_size,
+			 sizeof(conn->rbuf) - conn->rbuf_size, 0);
+	if (n == 0)
+		return FALSE;
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR;
+	conn->rbuf_size += n;
+
+	size_t pos = 0;
+	while (conn->rbuf_size - pos >= 2) {
+		size_t size = ((size_t)conn->rbuf[pos] << 8) | conn->rbuf[pos + 1];
+		if (conn->rbuf_size - pos - 2 < size)
+			break;
+
+		pthread_mutex_lock(&pool_lock);
+		if (conn->inflight > 0)
+			conn->inflight--;
+		conn->active_ms = timer_now_ms();
+		conn->wait_ms = 0;
+		pool_stats.replies++;
+		pthread_mutex_unlock(&pool_lock);
+
+		pool_handler(conn->upstream, conn->sock, conn->serial,
+			     conn->rbuf + pos + 2, size);
+		pos += 2 + size;
+	}
+	memmove(conn->rbuf, conn->rbuf + pos, conn->rbuf_size - pos);
+	conn->rbuf_size -= pos;
+	return TRUE;
+}
+
+static void __handle_events(tcp_conn *conn, short revents)
+{
+	BOOL ok = TRUE;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!conn->connected && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err == 0) {
+			conn->connected = TRUE;
+			conn->active_ms = timer_now_ms();
+		} else {
+			ok = FALSE;
+			__log_addr(LOGGER_WARNING,
+				   "__handle_events(): Failed to connect over TCP to",
+				   conn->upstream);
+		}
+	}
+	if (ok && conn->connected && (revents & POLLOUT))
+		ok = __flush(conn);
+	pthread_mutex_unlock(&pool_lock);
+
+	if (ok && (revents & (POLLIN | POLLERR | POLLHUP)))
+		ok = __read(conn);
+	if (!ok) {
+		pthread_mutex_lock(&pool_lock);
+		__detach(conn);
+		pthread_mutex_unlock(&pool_lock);
+		__close(conn);
+	}
+}
+
+static void __close_idle(void)
+{
+	size_t max = pool_num * TCP_POOL_MAX_CONNS;
+	tcp_conn *idle[max];
+	size_t num = 0;
+
+	/* 判断和移除在同一次加锁中完成，否则移除前可能有新的查询发到这个连接上。
+	 * now也要在加锁后读取，否则可能早于active_ms */
+	pthread_mutex_lock(&pool_lock);
+	uint64_t now = timer_now_ms();
+	for (size_t i = 0; i < max; i++) {
+		tcp_conn *conn = pool[i];
+		if (conn == NULL)
+			continue;
+		/* 空闲，或者upstream这么久没有回复（包括连接一直没有建立） */
+		if ((conn->wait_ms == 0 &&
+		     now - conn->active_ms >= TCP_POOL_IDLE_MS) ||
+		    (conn->wait_ms != 0 &&
+		     now - conn->wait_ms >= TCP_POOL_IDLE_MS)) {
+			idle[num++] = conn;
+			pool[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	for (size_t i = 0; i < num; i++)
+		__close(idle[i]);
+}
+
+_Noreturn static void *tcp_pool_thread(void *arg)
+{
+	size_t max = pool_num * TCP_POOL_MAX_CONNS;
+	struct pollfd *fds =
+		(struct pollfd *)malloc((max + 1) * sizeof(struct pollfd));
+	tcp_conn **polled = (tcp_conn **)malloc(max * sizeof(tcp_conn *));
+
+	while (1) {
+		size_t num = 0;
+
+		fds[0].fd = wake_pipe[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		pthread_mutex_lock(&pool_lock);
+		for (size_t i = 0; i < max; i++) {
+			tcp_conn *conn = pool[i];
+			if (conn == NULL)
+				continue;
+
+			fds[num + 1].fd = conn->sock;
+			fds[num + 1].events = POLLIN;
+			if (!conn->connected || conn->wbuf_size > 0)
+				fds[num + 1].events |= POLLOUT;
+			fds[num + 1].revents = 0;
+			polled[num++] = conn;
+		}
+		pthread_mutex_unlock(&pool_lock);
+
+		if (poll(fds, num + 1, TCP_POOL_TICK_MS) > 0) {
+			char buf[64];
+			if (fds[0].revents & POLLIN)
+				while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+					;
+			for (size_t i = 0; i < num; i++)
+				if (fds[i + 1].revents)
+					__handle_events(polled[i],
+							fds[i + 1].revents);
+		}
+		__close_idle();
+	}
+}
+
+void tcp_pool_init(const SOCKADDR_IN *addrs, size_t num,
+		   tcp_reply_handler handler)
+{
+	pool_num = num;
+	pool_handler = handler;
+	pool_addrs = (SOCKADDR_IN *)malloc(num * sizeof(SOCKADDR_IN));
+	memcpy(pool_addrs, addrs, num * sizeof(SOCKADDR_IN));
+	pool = (tcp_conn **)calloc(num * TCP_POOL_MAX_CONNS, sizeof(tcp_conn *));
+	memset(&pool_stats, 0, sizeof(pool_stats));
+
+	if (pipe(wake_pipe) < 0) {
+		logger_write(LOGGER_ERROR,
+			     "tcp_pool_init(): Failed to create pipe.");
+		exit(1);
+	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, tcp_pool_thread, NULL);
+	pthread_detach(thread);
+	logger_write(LOGGER_DEBUG,
+		     "tcp_pool_init(): TCP pool initialization finished.");
+}
+
+SOCKET tcp_pool_get(int upstream, uint32_t *serial, BOOL *connected)
+{
+	tcp_conn **slots = &pool[upstream * TCP_POOL_MAX_CONNS];
+	tcp_conn *best = NULL;
+	int empty = -1;
+
+	pthread_mutex_lock(&pool_lock);
+	for (int i = 0; i < TCP_POOL_MAX_CONNS; i++) {
+		if (slots[i] == NULL) {
+			if (empty < 0)
+				empty = i;
+		} else if (best == NULL || slots[i]->inflight < best->inflight) {
+			best = slots[i];
+		}
+	}
+	if ((best == NULL || best->inflight >= TCP_POOL_PIPELINE) &&
+	    empty >= 0) {
+		tcp_conn *conn = __open(upstream);
+		if (conn != NULL) {
+			slots[empty] = conn;
+			best = conn;
+			__wake();
+		}
+	}
+	SOCKET res = -1;
+	if (best != NULL) {
+		res = best->sock;
+		*serial = best->serial;
+		*connected = best->connected;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return res;
+}
+
+BOOL tcp_pool_send(SOCKET conn_sock, uint32_t serial, const void *data,
+		   size_t size)
+{
+	if (size > TCP_DNS_MAX_SIZE)
+		return FALSE;
+
+	pthread_mutex_lock(&pool_lock);
+	tcp_conn *conn = __find(conn_sock, serial);
+	if (conn == NULL) {
+		pthread_mutex_unlock(&pool_lock);
+		return FALSE;
+	}
+
+	uint8_t len[2] = { (uint8_t)(size >> 8), (uint8_t)size };
+	__append(conn, len, sizeof(len));
+	__append(conn, data, size);
+	conn->active_ms = timer_now_ms();
+	if (conn->wait_ms == 0)
+		conn->wait_ms = conn->active_ms;
+	conn->inflight++;
+	pool_stats.queries++;
+
+	/* 写不完或出错时交给I/O线程处理 */
+	if (conn->connected)
+		__flush(conn);
+	BOOL wake = conn->wbuf_size > 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (wake)
+		__wake();
+	return TRUE;
+}
+
+void tcp_pool_abandon(SOCKET conn_sock, uint32_t serial)
+{
+	pthread_mutex_lock(&pool_lock);
+	tcp_conn *conn = __find(conn_sock, serial);
+	if (conn != NULL && conn->inflight > 0)
+		conn->inflight--;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void get_tcp_pool_stats(tcp_pool_stats *stats)
+{
+	pthread_mutex_lock(&pool_lock);
+	*stats = pool_stats;
+	stats->connections = 0;
+	for (size_t i = 0; i < pool_num * TCP_POOL_MAX_CONNS; i++)
+		if (pool[i] != NULL)
+			stats->connections++;
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,92 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#ifndef CORE_TCP_POOL_H_
+#define CORE_TCP_POOL_H_
+
+#include "socket.h"
+#include "unidef.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 每个upstream最多的连接数，每个连接上同时等待回复的查询达到PIPELINE后才新建连接 */
+#define TCP_POOL_MAX_CONNS 4
+#define TCP_POOL_PIPELINE 64
+/* 连接空闲或发出的查询这么久没有回复时关闭，连接建立也不能超过这个时间 */
+#define TCP_POOL_IDLE_MS 10000
+
+/* TCP上的DNS报文带2字节长度前缀，最大长度为65535 */
+#define TCP_DNS_MAX_SIZE 65535
+
+/**
+ * 收到回复时的回调，在I/O线程中执行。conn和serial为tcp_pool_get()返回的连接，
+ * data在回调返回后失效。
+ */
+typedef void (*tcp_reply_handler)(int upstream, SOCKET conn, uint32_t serial,
+				  const uint8_t *data, size_t size);
+
+typedef struct tcp_pool_stats {
+	size_t connections; /* 当前打开的连接数 */
+	size_t opened; /* 累计建立的连接数 */
+	size_t queries;
+	size_t replies;
+} tcp_pool_stats;
+
+/**
+ * 初始化连接池，并创建唯一的I/O线程。连接在第一次使用时才建立，之后保持打开，
+ * 多个查询在同一个连接上pipelining（RFC 7766），按ID匹配回复。
+ * @param addrs 各个upstream的地址，下标即tcp_pool_get()的upstream
+ */
+extern void tcp_pool_init(const SOCKADDR_IN *addrs, size_t num,
+			  tcp_reply_handler handler);
+
+/**
+ * 选择upstream等待回复的查询最少的连接，都已经有TCP_POOL_PIPELINE个查询时新建一个。
+ * 连接关闭后socket可能被新的连接复用，因此连接由socket和serial共同标识。
+ * @param serial 连接的序号，不为0
+ * @param connected 连接是否已经建立，否则查询的RTT包含握手的时间
+ * @return 连接的socket，用于tcp_pool_send()和匹配回复；无法建立连接时返回-1
+ */
+extern SOCKET tcp_pool_get(int upstream, out uint32_t *serial,
+			   out BOOL *connected);
+
+/**
+ * 在conn上发送一个DNS报文，不阻塞。连接还没有建立或内核缓冲区已满时，剩下的数据由I/O线程发送。
+ * @return conn已经关闭时返回FALSE
+ */
+extern BOOL tcp_pool_send(SOCKET conn, uint32_t serial, const void *data,
+			  size_t size);
+
+/**
+ * 在conn上发送的一个查询超时，不再计入等待回复的查询数。
+ * 之后仍然可能收到它的回复，那时计数会少算一个，直到减到0为止。
+ */
+extern void tcp_pool_abandon(SOCKET conn, uint32_t serial);
+
+extern void get_tcp_pool_stats(out tcp_pool_stats *stats);
+
+#endif /* CORE_TCP_POOL_H_ */
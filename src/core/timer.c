@@ -0,0 +1,382 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "timer.h"
+#include "logger.h"
+#include "unidef.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* timer_entry按块分配，块的地址不会改变 */
+#define TIMER_BLOCK_BITS 10
+#define TIMER_BLOCK_SIZE (1 << TIMER_BLOCK_BITS)
+#define TIMER_MAX_BLOCKS 4096
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+
+typedef struct timer_entry {
+	struct timer_entry *pre, *next;
+	uint64_t expires; /* In ticks(ms). */
+	timer_callback callback;
+	void *arg;
+	uint32_t index;
+	uint32_t generation;
+	BOOL pending;
+} timer_entry;
+
+/* 每个slot是一个带哨兵的双向循环链表 */
+typedef struct timer_slot {
+	timer_entry head;
+} timer_slot;
+
+typedef struct timer_fired {
+	timer_callback callback;
+	void *arg;
+} timer_fired;
+
+static pthread_mutex_t timer_mutex;
+static pthread_cond_t timer_cond;
+static pthread_t timer_thread;
+
+static timer_slot timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t timer_current_tick;
+static size_t timer_pending_count;
+/* timer线程睡眠到的时间，timer_add()在更早的timer到来时唤醒它；不在定时等待时为0 */
+static uint64_t timer_wait_until;
+
+static timer_entry *timer_blocks[TIMER_MAX_BLOCKS];
+static size_t timer_num_blocks;
+static timer_entry *timer_free_list;
+
+uint64_t timer_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void __slot_init(timer_slot *slot)
+{
+	slot->head.pre = slot->head.next = &slot->head;
+}
+
+static BOOL __slot_empty(const timer_slot *slot)
+{
+	return slot->head.next == &slot->head;
+}
+
+static void __slot_push(timer_slot *slot, timer_entry *entry)
+{
+	entry->pre = slot->head.pre;
+	entry->next = &slot->head;
+	slot->head.pre->next = entry;
+	slot->head.pre = entry;
+}
+
+static void __entry_unlink(timer_entry *entry)
+{
+	entry->pre->next = entry->next;
+	entry->next->pre = entry->pre;
+	entry->pre = entry->next = NULL;
+}
+
+static timer_entry *__new_entry(void)
+{
+	if (timer_free_list == NULL) {
+		if (timer_num_blocks == TIMER_MAX_BLOCKS)
+			return NULL;
+
+		timer_entry *block = (timer_entry *)malloc(
+			TIMER_BLOCK_SIZE * sizeof(timer_entry));
+		memset(block, 0, TIMER_BLOCK_SIZE * sizeof(timer_entry));
+
+		for (int i = TIMER_BLOCK_SIZE - 1; i >= 0; i--) {
+			block[i].index =
+				(timer_num_blocks << TIMER_BLOCK_BITS) | i;
+			block[i].generation = 1;
+			block[i].next = timer_free_list;
+			timer_free_list = &block[i];
+		}
+		timer_blocks[timer_num_blocks++] = block;
+	}
+
+	timer_entry *res = timer_free_list;
+	timer_free_list = res->next;
+	res->pre = res->next = NULL;
+	return res;
+}
+
+static void __free_entry(timer_entry *entry)
+{
+	entry->pending = FALSE;
+	entry->generation++;
+	entry->callback = NULL;
+	entry->arg = NULL;
+	entry->next = timer_free_list;
+	timer_free_list = entry;
+}
+
+static timer_entry *__get_entry(timer_id id)
+{
+	uint32_t index = (uint32_t)id;
+	uint32_t block = index >> TIMER_BLOCK_BITS;
+
+	if (block >= timer_num_blocks)
+		return NULL;
+
+	timer_entry *res =
+		&timer_blocks[block][index & (TIMER_BLOCK_SIZE - 1)];
+	if (res->generation != (uint32_t)(id >> 32) || !res->pending)
+		return NULL;
+	return res;
+}
+
+/* 根据剩余时间将timer放入对应层级的slot */
+static void __wheel_insert(timer_entry *entry)
+{
+	uint64_t expires = entry->expires;
+
+	if (expires < timer_current_tick)
+		expires = timer_current_tick;
+
+	uint64_t delta = expires - timer_current_tick;
+	int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	size_t index = (expires >> (TIMER_WHEEL_BITS * level)) &
+		       TIMER_WHEEL_MASK;
+	__slot_push(&timer_wheel[level][index], entry);
+}
+
+/* 将高层级slot中的timer重新分配到低层级 */
+static size_t __cascade(int level)
+{
+	size_t index = (timer_current_tick >> (TIMER_WHEEL_BITS * level)) &
+		       TIMER_WHEEL_MASK;
+	timer_slot *slot = &timer_wheel[level][index];
+
+	while (!__slot_empty(slot)) {
+		timer_entry *entry = slot->head.next;
+		__entry_unlink(entry);
+		__wheel_insert(entry);
+	}
+	return index;
+}
+
+/**
+ * 推进一个tick，将到期的timer放入fired中
+ */
+static size_t __tick(timer_fired **fired, size_t *fired_cap, size_t num_fired)
+{
+	size_t index = timer_current_tick & TIMER_WHEEL_MASK;
+
+	if (index == 0) {
+		for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+			if (__cascade(level) != 0)
+				break;
+	}
+
+	timer_slot *slot = &timer_wheel[0][index];
+	while (!__slot_empty(slot)) {
+		timer_entry *entry = slot->head.next;
+		__entry_unlink(entry);
+
+		if (num_fired == *fired_cap) {
+			*fired_cap *= 2;
+			*fired = (timer_fired *)realloc(
+				*fired, *fired_cap * sizeof(timer_fired));
+		}
+		(*fired)[num_fired].callback = entry->callback;
+		(*fired)[num_fired].arg = entry->arg;
+		num_fired++;
+
+		__free_entry(entry);
+		timer_pending_count--;
+	}
+
+	timer_current_tick++;
+	return num_fired;
+}
+
+/**
+ * 时间轮下一次需要处理的tick：第0层是最早到期的timer，更高层是最早的非空slot被
+ * 分配到低层的时间，这时再重新计算。只在时间轮不为空时调用
+ */
+static uint64_t __next_wake(void)
+{
+	uint64_t res = UINT64_MAX;
+
+	for (size_t k = 0; k < TIMER_WHEEL_SIZE; k++) {
+		uint64_t tick = timer_current_tick + k;
+		if (!__slot_empty(&timer_wheel[0][tick & TIMER_WHEEL_MASK])) {
+			res = tick;
+			break;
+		}
+	}
+
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		int shift = TIMER_WHEEL_BITS * level;
+		for (size_t k = 0; k <= TIMER_WHEEL_SIZE; k++) {
+			uint64_t tick = ((timer_current_tick >> shift) + k) << shift;
+			if (tick >= res)
+				break;
+			if (tick < timer_current_tick)
+				continue;
+			if (!__slot_empty(&timer_wheel[level][(tick >> shift) &
+							      TIMER_WHEEL_MASK])) {
+				res = tick;
+				break;
+			}
+		}
+	}
+	return res;
+}
+
+/* 调用者持有timer_mutex */
+static void __wait_until(uint64_t ms)
+{
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+
+	timer_wait_until = ms;
+	pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+	timer_wait_until = 0;
+}
+
+_Noreturn static void *timer_thread_main(void *_)
+{
+	size_t fired_cap = 64;
+	timer_fired *fired = (timer_fired *)malloc(fired_cap * sizeof(timer_fired));
+
+	while (1) {
+		size_t num_fired = 0;
+
+		pthread_mutex_lock(&timer_mutex);
+		while (timer_pending_count == 0)
+			pthread_cond_wait(&timer_cond, &timer_mutex);
+
+		uint64_t now = timer_now_ms();
+		while (timer_current_tick <= now)
+			num_fired = __tick(&fired, &fired_cap, num_fired);
+
+		/* 不轮询，睡眠到下一个timer到期 */
+		if (num_fired == 0 && timer_pending_count > 0)
+			__wait_until(__next_wake());
+		pthread_mutex_unlock(&timer_mutex);
+
+		for (size_t i = 0; i < num_fired; i++)
+			fired[i].callback(fired[i].arg);
+	}
+}
+
+void timer_init(void)
+{
+	/* 与timer_now_ms()使用同一个时钟，不受系统时间调整的影响 */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&timer_mutex, NULL);
+	pthread_cond_init(&timer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (int i = 0; i < TIMER_WHEEL_LEVELS; i++)
+		for (int j = 0; j < TIMER_WHEEL_SIZE; j++)
+			__slot_init(&timer_wheel[i][j]);
+
+	timer_current_tick = timer_now_ms();
+	timer_pending_count = 0;
+	timer_wait_until = 0;
+	timer_num_blocks = 0;
+	timer_free_list = NULL;
+
+	pthread_create(&timer_thread, NULL, timer_thread_main, NULL);
+	logger_write(LOGGER_DEBUG, "timer_init(): Timer initialization finished.");
+}
+
+timer_id timer_add(uint64_t timeout_ms, timer_callback callback, void *arg)
+{
+	if (timeout_ms > TIMER_MAX_TIMEOUT_MS)
+		timeout_ms = TIMER_MAX_TIMEOUT_MS;
+
+	pthread_mutex_lock(&timer_mutex);
+	timer_entry *entry = __new_entry();
+	if (entry == NULL) {
+		pthread_mutex_unlock(&timer_mutex);
+		logger_write(LOGGER_WARNING,
+			     "timer_add(): Too many timers. Ignored.");
+		return TIMER_INVALID_ID;
+	}
+
+	/* 时间轮空闲时timer线程不推进tick，先追上当前时间 */
+	if (timer_pending_count == 0)
+		timer_current_tick = timer_now_ms();
+
+	entry->expires = timer_now_ms() + timeout_ms;
+	entry->callback = callback;
+	entry->arg = arg;
+	entry->pending = TRUE;
+	__wheel_insert(entry);
+
+	timer_id res = ((timer_id)entry->generation << 32) | entry->index;
+	if (timer_pending_count++ == 0 ||
+	    (timer_wait_until != 0 && entry->expires < timer_wait_until))
+		pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_mutex);
+	return res;
+}
+
+BOOL timer_cancel(timer_id id)
+{
+	pthread_mutex_lock(&timer_mutex);
+	timer_entry *entry = __get_entry(id);
+	if (entry == NULL) {
+		pthread_mutex_unlock(&timer_mutex);
+		return FALSE;
+	}
+
+	__entry_unlink(entry);
+	__free_entry(entry);
+	timer_pending_count--;
+	pthread_mutex_unlock(&timer_mutex);
+	return TRUE;
+}
+
+size_t timer_count(void)
+{
+	pthread_mutex_lock(&timer_mutex);
+	size_t res = timer_pending_count;
+	pthread_mutex_unlock(&timer_mutex);
+	return res;
+}
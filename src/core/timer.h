@@ -0,0 +1,70 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_TIMER_H_
+#define CORE_TIMER_H_
+
+#include "unidef.h"
+
+#include <stdint.h>
+
+/* 4 levels * 8 bits, the longest timeout is about 49 days. */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_MAX_TIMEOUT_MS 0xffffffffULL
+
+typedef uint64_t timer_id;
+typedef void (*timer_callback)(void *arg);
+
+#define TIMER_INVALID_ID 0
+
+/**
+ * 初始化分层时间轮（精度为1ms），并创建唯一的timer线程。
+ * 调用timer其他相关函数前必须调用该函数。
+ */
+extern void timer_init(void);
+
+/**
+ * @return 单调时钟，单位为毫秒
+ */
+extern uint64_t timer_now_ms(void);
+
+/**
+ * 注册一个timeout_ms毫秒后触发的timer。callback在timer线程中执行，不应阻塞。
+ * @return 用于timer_cancel的ID
+ */
+extern timer_id timer_add(uint64_t timeout_ms, timer_callback callback,
+			  void *arg);
+
+/**
+ * 取消一个timer。
+ * @return 若timer已经触发（或正在触发）则返回FALSE，此时callback已经或即将被执行
+ */
+extern BOOL timer_cancel(timer_id id);
+
+extern size_t timer_count(void);
+
+#endif /* CORE_TIMER_H_ */
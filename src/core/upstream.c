@@ -0,0 +1,979 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "upstream.h"
+#include "cache.h"
+#include "config.h"
+#include "dns.h"
+#include "inverse_query.h"
+#include "logger.h"
+#include "pending_query.h"
+#include "socket.h"
+#include "tcp_pool.h"
+#include "timer.h"
+#include "unidef.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const remote_dns[NUM_UPSTREAM] = { "119.29.29.29",
+						      "180.76.76.76",
+						      "114.114.114.114",
+						      "1.1.1.1" };
+static SOCKADDR_IN rmdns_info[NUM_UPSTREAM];
+
+typedef struct upstream_health {
+	upstream_stats stats;
+	size_t consecutive_timeouts;
+	uint64_t probe_at_ms; /* 熔断后下一次探测的时间，探测中时为探测没有结果、再放行一个的时间 */
+	uint64_t backoff_ms;
+	uint64_t measured_ms; /* 上次收到RTT样本或放行一个查询重新测量的时间 */
+	uint32_t rtt_samples[UPSTREAM_RTT_SAMPLES]; /* 环形缓冲区 */
+	size_t rtt_count;
+} upstream_health;
+
+/* 所有工作线程和接收线程共享，每次转发、回复和超时都要更新 */
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static upstream_health health[NUM_UPSTREAM];
+/* 还能hedge的查询数的100倍，每转发一个查询增加hedge_percent */
+static size_t hedge_credit;
+
+/* 等待发给第二个upstream的查询，data中已经换成了upstream ID */
+typedef struct hedge_task {
+	const upstream_ctx *ctx;
+	int primary;
+	uint16_t upstream_id;
+	uint32_t serial;
+	size_t size;
+	uint8_t data[];
+} hedge_task;
+
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * 超时率越高，RTT看起来越大；没有样本的服务器分数为0，会被优先尝试
+ */
+static uint64_t __weight(const upstream_health *h, uint64_t srtt_us)
+{
+	return srtt_us * (1000 + 4 * h->stats.fail_permille) / 1000;
+}
+
+static uint64_t __score(const upstream_health *h)
+{
+	return __weight(h, h->stats.srtt_us);
+}
+
+/**
+ * 距离上次测量每过UPSTREAM_DECAY_MS，SRTT看起来减小1/8，保存的值不变
+ */
+static uint64_t __decayed_score(const upstream_health *h, uint64_t now)
+{
+	uint64_t srtt_us = h->stats.srtt_us;
+	uint64_t periods = now > h->measured_ms ?
+				   (now - h->measured_ms) / UPSTREAM_DECAY_MS :
+				   0;
+
+	/* 64次之后只剩不到2e-4 */
+	for (periods = DNS_SERVER_MIN(periods, 64); periods > 0; periods--)
+		srtt_us -= srtt_us >> 3;
+	return __weight(h, srtt_us);
+}
+
+/**
+ * 选择没有熔断并且分数最小的服务器。熔断的服务器到了探测时间时优先选择，用于探测，
+ * 并在同一次加锁中标记为探测中，其他线程不会同时选中它，每次只放行一个探测。
+ * 比较时SRTT随距离上次测量的时间衰减，较慢的服务器因此只因衰减而胜出时，
+ * 放行这一个查询重新测量，并从现在起重新衰减，和负载无关。
+ * @param probe 选中的是放行的探测
+ */
+static int __select_upstream(unsigned int worker, out BOOL *probe)
+{
+	int res = -1, best = -1;
+	int fallback = worker % NUM_UPSTREAM;
+	uint64_t res_score = 0;
+
+	*probe = FALSE;
+	pthread_mutex_lock(&health_lock);
+	uint64_t now = timer_now_ms();
+	for (int k = 0; k < NUM_UPSTREAM; k++) {
+		int i = (worker + k) % NUM_UPSTREAM;
+		upstream_health *h = &health[i];
+
+		/* 探测没有发出（合并到已有查询或pending table已满）也没有结果时，
+		 * 过了backoff_ms再放行一个 */
+		if (h->stats.state != UPSTREAM_CLOSED && now >= h->probe_at_ms) {
+			h->stats.state = UPSTREAM_HALF_OPEN;
+			h->probe_at_ms = now + h->backoff_ms;
+			res = i;
+			*probe = TRUE;
+			logger_write(LOGGER_DEBUG,
+				     "__select_upstream(): Probing upstream %s.",
+				     remote_dns[i]);
+			break;
+		}
+		if (h->stats.state != UPSTREAM_CLOSED) {
+			if (health[fallback].stats.state == UPSTREAM_CLOSED ||
+			    (h->stats.state == UPSTREAM_OPEN &&
+			     h->probe_at_ms < health[fallback].probe_at_ms))
+				fallback = i;
+			continue;
+		}
+		uint64_t score = __decayed_score(h, now);
+		if (res < 0 || score < res_score) {
+			res = i;
+			res_score = score;
+		}
+		if (best < 0 || __score(h) < __score(&health[best]))
+			best = i;
+	}
+	if (res < 0) {
+		res = fallback;
+	} else if (res != best && health[res].stats.state == UPSTREAM_CLOSED) {
+		health[res].measured_ms = now;
+		logger_write(LOGGER_DEBUG,
+			     "__select_upstream(): Remeasuring upstream %s.",
+			     remote_dns[res]);
+	}
+	pthread_mutex_unlock(&health_lock);
+	return res;
+}
+
+/**
+ * 查询确实发给了upstream
+ */
+static void __upstream_sent(int upstream)
+{
+	upstream_health *h = &health[upstream];
+
+	pthread_mutex_lock(&health_lock);
+	h->stats.queries++;
+	hedge_credit = DNS_SERVER_MIN(hedge_credit + get_config()->hedge_percent,
+				      100 * UPSTREAM_HEDGE_BURST);
+	pthread_mutex_unlock(&health_lock);
+}
+
+static int __cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * RTT有少数很大的样本时，rttvar也会很大，不能用srtt + k * rttvar估计分位数，
+ * 因此保存最近的样本直接计算。预算为hedge_percent时，在p(100 - hedge_percent)处hedge，
+ * 预算就不会被只比平时稍慢的查询用完；预算更多时也只在p90之后hedge。
+ */
+static void __update_tail(upstream_health *h, uint64_t rtt_us)
+{
+	h->rtt_samples[h->rtt_count++ % UPSTREAM_RTT_SAMPLES] =
+		(uint32_t)DNS_SERVER_MIN(rtt_us, UINT32_MAX);
+	if (h->rtt_count % (UPSTREAM_RTT_SAMPLES / 4) != 0)
+		return;
+
+	size_t n = DNS_SERVER_MIN(h->rtt_count, UPSTREAM_RTT_SAMPLES);
+	uint32_t sorted[UPSTREAM_RTT_SAMPLES];
+	memcpy(sorted, h->rtt_samples, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), __cmp_u32);
+	size_t percent = DNS_SERVER_MIN(get_config()->hedge_percent, 10);
+	h->stats.tail_us = sorted[(n - 1) * (100 - percent) / 100];
+}
+
+/**
+ * 按RFC 6298更新平滑RTT和RTT偏差，调用者持有health_lock
+ */
+static void __update_rtt(upstream_health *h, uint64_t rtt_us)
+{
+	__update_tail(h, rtt_us);
+	h->measured_ms = timer_now_ms();
+
+	if (h->stats.srtt_us == 0) {
+		h->stats.srtt_us = rtt_us;
+		h->stats.rttvar_us = rtt_us / 2;
+	} else {
+		uint64_t delta = h->stats.srtt_us > rtt_us ?
+					 h->stats.srtt_us - rtt_us :
+					 rtt_us - h->stats.srtt_us;
+		h->stats.rttvar_us = (3 * h->stats.rttvar_us + delta) / 4;
+		h->stats.srtt_us = (7 * h->stats.srtt_us + rtt_us) / 8;
+	}
+	/* 衰减到0会被当作没有样本 */
+	if (h->stats.srtt_us == 0)
+		h->stats.srtt_us = 1;
+}
+
+/**
+ * @param rtt_us 为0时没有可用的RTT样本
+ * @param hedge 回复来自hedge，比之前的发送先到
+ */
+static void __upstream_reply(int upstream, uint64_t rtt_us, BOOL hedge)
+{
+	upstream_health *h = &health[upstream];
+
+	pthread_mutex_lock(&health_lock);
+	h->stats.replies++;
+	if (hedge)
+		h->stats.hedge_wins++;
+	h->consecutive_timeouts = 0;
+	h->stats.fail_permille = h->stats.fail_permille * 7 / 8;
+	if (h->stats.state != UPSTREAM_CLOSED) {
+		h->stats.state = UPSTREAM_CLOSED;
+		h->backoff_ms = UPSTREAM_PROBE_MIN_MS;
+		logger_write(LOGGER_WARNING,
+			     "__upstream_reply(): Upstream %s recovered.",
+			     remote_dns[upstream]);
+	}
+	if (rtt_us > 0)
+		__update_rtt(h, rtt_us);
+	pthread_mutex_unlock(&health_lock);
+}
+
+/**
+ * 更晚的发送先收到了回复，upstream之后的回复被丢弃，也不会再超时。
+ * 它的RTT至少为elapsed_us，只在比srtt大时作为样本，并和超时一样计入超时率，
+ * 否则不回复的服务器在hedge的掩护下看起来很快，也不会被熔断。
+ * elapsed_us为0时没有可用的RTT样本，只计入超时率。
+ */
+static void __upstream_lost(int upstream, uint64_t elapsed_us)
+{
+	upstream_health *h = &health[upstream];
+
+	pthread_mutex_lock(&health_lock);
+	h->stats.fail_permille = (h->stats.fail_permille * 7 + 1000) / 8;
+	if (elapsed_us > h->stats.srtt_us)
+		__update_rtt(h, elapsed_us);
+	pthread_mutex_unlock(&health_lock);
+}
+
+/* 调用者持有health_lock */
+static uint64_t __rto_us(const upstream_health *h)
+{
+	if (h->stats.srtt_us == 0)
+		return UPSTREAM_RTO_MAX_MS * 1000;
+	uint64_t res = h->stats.srtt_us + 4 * h->stats.rttvar_us;
+	return DNS_SERVER_MIN(DNS_SERVER_MAX(res, UPSTREAM_RTO_MIN_MS * 1000),
+			      UPSTREAM_RTO_MAX_MS * 1000);
+}
+
+/* TCP的发送可能要先建立连接，RTO加倍。调用者持有health_lock */
+static uint64_t __attempt_rto_us(const pending_attempt *attempt)
+{
+	uint64_t res = __rto_us(&health[attempt->upstream]);
+	return attempt->tcp ? 2 * res : res;
+}
+
+static uint64_t __rto_ms(int upstream)
+{
+	pthread_mutex_lock(&health_lock);
+	uint64_t res = __rto_us(&health[upstream]);
+	pthread_mutex_unlock(&health_lock);
+	return (res + 999) / 1000;
+}
+
+/**
+ * 一次发送超过RTO没有回复，调用者持有health_lock。
+ * 探测中只有探测本身超时才重新熔断，熔断前发出的查询晚到的超时只计入统计。
+ */
+static void __attempt_timeout(const pending_attempt *attempt)
+{
+	int upstream = attempt->upstream;
+	upstream_health *h = &health[upstream];
+
+	h->stats.timeouts++;
+	h->consecutive_timeouts++;
+	h->stats.fail_permille = (h->stats.fail_permille * 7 + 1000) / 8;
+
+	if (h->stats.state == UPSTREAM_HALF_OPEN && attempt->probe) {
+		h->backoff_ms = DNS_SERVER_MIN(2 * h->backoff_ms,
+					       UPSTREAM_PROBE_MAX_MS);
+		h->stats.state = UPSTREAM_OPEN;
+		h->probe_at_ms = timer_now_ms() + h->backoff_ms;
+	} else if (h->stats.state == UPSTREAM_CLOSED &&
+		   h->consecutive_timeouts >= UPSTREAM_BREAKER_FAILURES) {
+		h->stats.state = UPSTREAM_OPEN;
+		h->probe_at_ms = timer_now_ms() + h->backoff_ms;
+		logger_write(
+			LOGGER_WARNING,
+			"__attempt_timeout(): Upstream %s timed out %zu times in a row. Circuit opened.",
+			remote_dns[upstream], h->consecutive_timeouts);
+	}
+}
+
+/**
+ * 选择query还没有发过的、没有熔断并且分数最小的服务器，调用者持有health_lock
+ * @return 没有时返回-1
+ */
+static int __select_retry(const pending_query *query)
+{
+	int res = -1;
+
+	for (int i = 0; i < NUM_UPSTREAM; i++) {
+		BOOL sent = FALSE;
+		for (size_t k = 0; k < query->num_attempts; k++)
+			if (query->attempts[k].upstream == i)
+				sent = TRUE;
+		if (sent || health[i].stats.state != UPSTREAM_CLOSED)
+			continue;
+		if (res < 0 || __score(&health[i]) < __score(&health[res]))
+			res = i;
+	}
+	return res;
+}
+
+/**
+ * 填写发给upstream的一次发送。tcp时从连接池取一个连接，无法连接时退回ctx中的UDP socket
+ */
+static void __set_attempt(pending_attempt *attempt, const upstream_ctx *ctx,
+			  int upstream, BOOL tcp, BOOL hedge)
+{
+	uint32_t serial = 0;
+	BOOL connected = TRUE;
+	SOCKET conn = tcp ? tcp_pool_get(upstream, &serial, &connected) : -1;
+
+	attempt->upstream = upstream;
+	attempt->sock = conn >= 0 ? conn : ctx->socks[upstream];
+	attempt->sent_us = __now_us();
+	attempt->hedge = hedge;
+	attempt->probe = FALSE;
+	attempt->tcp = conn >= 0;
+	attempt->conn_serial = conn >= 0 ? serial : 0;
+	attempt->handshake = conn >= 0 && !connected;
+	attempt->timeout = FALSE;
+}
+
+static void __send_attempt(const pending_attempt *attempt, const void *data,
+			   size_t size)
+{
+	if (!attempt->tcp)
+		send_to(attempt->sock, &rmdns_info[attempt->upstream], data,
+			size);
+	else if (!tcp_pool_send(attempt->sock, attempt->conn_serial, data,
+				size))
+		/* 连接刚被关闭，和丢包一样等超时重传 */
+		logger_write(LOGGER_DEBUG,
+			     "__send_attempt(): TCP connection to %s closed.",
+			     remote_dns[attempt->upstream]);
+}
+
+/**
+ * 用ID为id的reply回复客户端，超过客户端的UDP报文大小时只回复截断后的副本
+ */
+static void __reply_client(SOCKET sock, const SOCKADDR_IN *client,
+			   uint16_t udp_size, uint16_t id, raw_data *reply)
+{
+	set_header_info(reply->data, HEADER_ID, id);
+	if (reply->size <= udp_size) {
+		send_to_batched(sock, client, reply->data, reply->size);
+		return;
+	}
+
+	uint8_t buf[RAW_DATA_MAX_SIZE];
+	memcpy(buf, reply->data, reply->size);
+	size_t size = truncate_response(buf, reply->size);
+	if (size)
+		send_to_batched(sock, client, buf, size);
+}
+
+/**
+ * 回复query的客户端和合并进来的请求，只查询了CNAME链末端的请求除外
+ */
+static void __reply_clients(const pending_query *query, raw_data *reply)
+{
+	if (query->client_sock != PENDING_NO_CLIENT && query->origin == NULL)
+		__reply_client(query->client_sock, &query->client,
+			       query->udp_size, query->origin_id, reply);
+
+	/* 合并进来的请求用同一个回复，只需换成各自的ID */
+	for (pending_waiter *waiter = query->waiters; waiter != NULL;
+	     waiter = waiter->next)
+		if (waiter->origin == NULL)
+			__reply_client(waiter->client_sock, &waiter->client,
+				       waiter->udp_size, waiter->origin_id,
+				       reply);
+}
+
+/**
+ * pending table的超时回调。已经等够RTO的发送记为超时；还有发送没到RTO时继续等待，
+ * 否则在upstream_retries次之内重传给另一个服务器，都不行时放弃query（有截断的回复时回复它）。
+ */
+static void __upstream_timeout(pending_query *query)
+{
+	uint64_t now_us = __now_us();
+	uint64_t wait_us = 0;
+	int upstream = -1;
+
+	pthread_mutex_lock(&health_lock);
+	for (size_t i = 0; i < query->num_attempts; i++) {
+		pending_attempt *attempt = &query->attempts[i];
+		if (attempt->timeout)
+			continue;
+
+		uint64_t rto_us = __attempt_rto_us(attempt);
+		uint64_t elapsed_us = now_us - attempt->sent_us;
+		/* timer的精度为1ms */
+		if (elapsed_us + 1000 >= rto_us) {
+			attempt->timeout = TRUE;
+			__attempt_timeout(attempt);
+			/* 否则连接上等待的查询数只增不减，新的查询都去新建连接 */
+			if (attempt->tcp)
+				tcp_pool_abandon(attempt->sock,
+						 attempt->conn_serial);
+		} else if (wait_us == 0 || rto_us - elapsed_us < wait_us) {
+			wait_us = rto_us - elapsed_us;
+		}
+	}
+	/* 已经有截断的回复时不再找其他upstream，尽快交给客户端，由它自己改用TCP */
+	if (wait_us == 0 && query->packet != NULL && query->truncated == NULL &&
+	    query->retries < get_config()->upstream_retries &&
+	    query->num_attempts < PENDING_MAX_ATTEMPTS)
+		upstream = __select_retry(query);
+	if (upstream >= 0)
+		health[upstream].stats.retransmits++;
+	pthread_mutex_unlock(&health_lock);
+
+	if (wait_us == 0 && upstream < 0) {
+		/* TCP也没有回复时，至少把截断的UDP回复交给客户端 */
+		if (query->truncated != NULL) {
+			raw_data reply;
+			memcpy(reply.data, query->truncated,
+			       query->truncated_size);
+			reply.size = query->truncated_size;
+			__reply_clients(query, &reply);
+			flush_send_batch();
+		}
+		free_pending_query(query);
+		return;
+	}
+
+	pending_attempt attempt;
+	if (upstream >= 0) {
+		__set_attempt(&attempt, query->ctx, upstream,
+			      get_config()->upstream_tcp, FALSE);
+		query->attempts[query->num_attempts++] = attempt;
+		query->retries++;
+
+		pthread_mutex_lock(&health_lock);
+		wait_us = __attempt_rto_us(&attempt);
+		pthread_mutex_unlock(&health_lock);
+	}
+
+	uint8_t buf[REQUEST_BUF_SIZE];
+	size_t size = query->packet_size;
+	uint16_t id;
+	if (upstream >= 0)
+		memcpy(buf, query->packet, size);
+	if (!pending_query_retry(query, (wait_us + 999) / 1000, &id)) {
+		free_pending_query(query);
+		return;
+	}
+	if (upstream < 0)
+		return;
+
+	set_header_info(buf, HEADER_ID, id);
+	logger_write(LOGGER_DEBUG,
+		     "__upstream_timeout(): Retransmitting query %04x to %s.",
+		     get_header_info(buf, HEADER_ID), remote_dns[upstream]);
+	__send_attempt(&attempt, buf, size);
+}
+
+static BOOL __forward_query(const upstream_ctx *ctx, int upstream,
+			    BOOL probe, pending_query *query,
+			    const void *data, size_t size);
+
+static uint64_t __hedge_delay_ms(int upstream)
+{
+	pthread_mutex_lock(&health_lock);
+	uint64_t tail_us = health[upstream].stats.tail_us;
+	pthread_mutex_unlock(&health_lock);
+
+	if (tail_us == 0)
+		return UPSTREAM_RTO_MAX_MS / 4;
+	uint64_t res = (tail_us + 999) / 1000;
+	return DNS_SERVER_MIN(res, UPSTREAM_RTO_MAX_MS / 2);
+}
+
+static BOOL __hedge_available(void)
+{
+	pthread_mutex_lock(&health_lock);
+	BOOL res = hedge_credit >= 100;
+	pthread_mutex_unlock(&health_lock);
+	return res;
+}
+
+/**
+ * 选择除primary外分数最小的没有熔断的服务器，并扣除一次hedge的预算
+ * @return 预算不足或没有可用的服务器时返回-1
+ */
+static int __hedge_reserve(int primary)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&health_lock);
+	if (hedge_credit >= 100) {
+		for (int i = 0; i < NUM_UPSTREAM; i++) {
+			if (i == primary ||
+			    health[i].stats.state != UPSTREAM_CLOSED)
+				continue;
+			if (res < 0 || __score(&health[i]) < __score(&health[res]))
+				res = i;
+		}
+		if (res >= 0)
+			hedge_credit -= 100;
+	}
+	pthread_mutex_unlock(&health_lock);
+	return res;
+}
+
+/**
+ * 查询仍在等待回复时发给第二个upstream，否则退还预算
+ */
+static void __hedge_send(const hedge_task *task)
+{
+	int upstream = __hedge_reserve(task->primary);
+	if (upstream < 0)
+		return;
+
+	pending_attempt attempt;
+	__set_attempt(&attempt, task->ctx, upstream, get_config()->upstream_tcp,
+		      TRUE);
+	BOOL pending = pending_query_hedge(task->upstream_id, task->serial,
+					   &attempt);
+
+	pthread_mutex_lock(&health_lock);
+	if (pending)
+		health[upstream].stats.hedged++;
+	else
+		hedge_credit += 100;
+	pthread_mutex_unlock(&health_lock);
+
+	if (pending)
+		__send_attempt(&attempt, task->data, task->size);
+}
+
+static void __hedge_timeout(void *arg)
+{
+	hedge_task *task = (hedge_task *)arg;
+	__hedge_send(task);
+	free(task);
+}
+
+/**
+ * 刚发给primary的查询在hedge延迟后还没有回复时，再发给另一个upstream。
+ * timer不取消，查询已经结束时回调什么也不做。
+ */
+static void __hedge(const upstream_ctx *ctx, int primary, uint16_t upstream_id,
+		    uint32_t serial, const void *data, size_t size)
+{
+	if (!__hedge_available())
+		return;
+
+	hedge_task *task = (hedge_task *)malloc(sizeof(hedge_task) + size);
+	task->ctx = ctx;
+	task->primary = primary;
+	task->upstream_id = upstream_id;
+	task->serial = serial;
+	task->size = size;
+	memcpy(task->data, data, size);
+
+	if (get_config()->hedge_race)
+		__hedge_timeout(task);
+	else
+		timer_add(__hedge_delay_ms(primary), __hedge_timeout, task);
+}
+
+/**
+ * 链末端的记录已经更新到cache，用cache回复客户端原来的请求。
+ * 末端没有可用的记录时（如NXDOMAIN）把原来的请求完整地转发给upstream。
+ */
+static void __answer_origin(const upstream_ctx *ctx, int upstream,
+			    const uint8_t *origin, size_t origin_size,
+			    SOCKET client_sock, const SOCKADDR_IN *client)
+{
+	request_data request;
+	uint8_t answer[RAW_DATA_MAX_SIZE];
+	BOOL refresh = FALSE;
+	size_t answer_size = 0;
+
+	memcpy(request.data, origin, origin_size);
+	request.size = origin_size;
+	request.sock = client_sock;
+	request.info = *client;
+
+	uint16_t *qtype_ptr =
+		get_query_info(request.data, QUERY_TYPE, request.size);
+	if (qtype_ptr != NULL && GET_TYPE_PTR_TYPE(qtype_ptr) == TYPE_A)
+		answer_size = inverse_query_a(&request, answer, &refresh);
+	else if (qtype_ptr != NULL)
+		answer_size = inverse_query_aaaa(&request, answer, &refresh);
+
+	if (answer_size) {
+		send_to_batched(client_sock, client, answer, answer_size);
+		return;
+	}
+
+	logger_write(LOGGER_DEBUG,
+		     "__answer_origin(): CNAME tail not resolved, forwarding the whole query.");
+	pending_query *query = create_pending_query(request.data, request.size,
+						    client_sock, client);
+	if (query != NULL)
+		__forward_query(ctx, upstream, FALSE, query, request.data,
+				request.size);
+}
+
+/**
+ * UDP回复被截断时，在同一个upstream的TCP连接上重新查询，query放回pending table
+ * @return 不能改用TCP时返回FALSE，调用者照常把截断的回复交给客户端
+ */
+static BOOL __retry_tcp(pending_query *query, pending_attempt *truncated,
+			const raw_data *reply)
+{
+	int upstream = truncated->upstream;
+
+	if (query->packet == NULL || query->num_attempts >= PENDING_MAX_ATTEMPTS)
+		return FALSE;
+
+	pending_attempt attempt;
+	__set_attempt(&attempt, query->ctx, upstream, TRUE, FALSE);
+	if (!attempt.tcp)
+		return FALSE;
+
+	pthread_mutex_lock(&health_lock);
+	uint64_t rto_us = __attempt_rto_us(&attempt);
+	pthread_mutex_unlock(&health_lock);
+
+	/* UDP的这次发送已经有了回复，不再超时 */
+	truncated->timeout = TRUE;
+	pending_query_set_truncated(query, reply->data, reply->size);
+	query->attempts[query->num_attempts++] = attempt;
+
+	uint8_t buf[REQUEST_BUF_SIZE];
+	size_t size = query->packet_size;
+	uint16_t id;
+	memcpy(buf, query->packet, size);
+	if (!pending_query_retry(query, (rto_us + 999) / 1000, &id)) {
+		query->num_attempts--;
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&health_lock);
+	health[upstream].stats.tcp_fallbacks++;
+	pthread_mutex_unlock(&health_lock);
+
+	set_header_info(buf, HEADER_ID, id);
+	logger_write(LOGGER_DEBUG,
+		     "__retry_tcp(): Reply to %04x truncated, retrying %s over TCP.",
+		     id, remote_dns[upstream]);
+	__send_attempt(&attempt, buf, size);
+	return TRUE;
+}
+
+/**
+ * 处理从sock（UDP socket，或序号为conn_serial的TCP连接）收到的upstream的回复
+ */
+static void __dispatch_reply(SOCKET sock, uint32_t conn_serial, int upstream,
+			     raw_data *reply)
+{
+	pending_query *query = pending_query_take(sock, conn_serial,
+						  reply->data, reply->size);
+	if (query == NULL) {
+		logger_write(
+			LOGGER_DEBUG,
+			"__dispatch_reply(): No pending query matches reply from %s. It may be timeout.",
+			remote_dns[upstream]);
+		return;
+	}
+
+	/* 每次发送都发给不同的服务器，RTT样本没有歧义；等待TCP握手的发送不作为样本 */
+	uint64_t now_us = __now_us();
+	pending_attempt *winner =
+		pending_query_attempt(query, sock, conn_serial);
+	__upstream_reply(upstream,
+			 winner->handshake ? 0 : now_us - winner->sent_us,
+			 winner->hedge);
+	for (pending_attempt *attempt = query->attempts; attempt < winner;
+	     attempt++)
+		if (!attempt->timeout)
+			__upstream_lost(attempt->upstream,
+					attempt->handshake ?
+						0 :
+						now_us - attempt->sent_us);
+
+	BOOL truncated = get_header_info(reply->data, HEADER_FLAGS) & FLAGS_TC;
+	if (truncated && !winner->tcp && __retry_tcp(query, winner, reply))
+		return;
+
+	__reply_clients(query, reply);
+	/* 后台刷新合并了客户端的请求时也算作客户端的查询 */
+	if (query->client_sock != PENDING_NO_CLIENT || query->waiters != NULL)
+		cache_count_client_reply();
+
+	/* 截断的回复只有一部分记录，原样交给客户端，但不能缓存 */
+	if (!truncated)
+		update_cache(reply);
+
+	/* 只查询了CNAME链末端的请求，在cache更新后拼接完整的回复 */
+	if (query->origin != NULL)
+		__answer_origin(query->ctx, upstream, query->origin,
+				query->origin_size, query->client_sock,
+				&query->client);
+	for (pending_waiter *waiter = query->waiters; waiter != NULL;
+	     waiter = waiter->next)
+		if (waiter->origin != NULL)
+			__answer_origin(query->ctx, upstream, waiter->origin,
+					waiter->origin_size,
+					waiter->client_sock, &waiter->client);
+	free_pending_query(query);
+}
+
+static void __handle_reply(const upstream_ctx *ctx, int upstream,
+			   raw_data *reply, const SOCKADDR_IN *from)
+{
+	if (from->sin_addr.s_addr != rmdns_info[upstream].sin_addr.s_addr ||
+	    from->sin_port != rmdns_info[upstream].sin_port) {
+		logger_write(
+			LOGGER_WARNING,
+			"__handle_reply(): Reply not from upstream %s. Ignored.",
+			remote_dns[upstream]);
+		return;
+	}
+
+	__dispatch_reply(ctx->socks[upstream], 0, upstream, reply);
+}
+
+/**
+ * tcp_pool的回调，在连接池的I/O线程中执行
+ */
+static void __handle_tcp_reply(int upstream, SOCKET conn, uint32_t serial,
+			       const uint8_t *data, size_t size)
+{
+	raw_data reply;
+
+	if (size < sizeof(dns_header))
+		return;
+
+	reply.size = DNS_SERVER_MIN(size, RAW_DATA_MAX_SIZE);
+	memcpy(reply.data, data, reply.size);
+	/* 放不下的回复只能截断后交给客户端，TC的回复也不会被缓存 */
+	if (size > RAW_DATA_MAX_SIZE)
+		reply.size = truncate_response(reply.data, reply.size);
+	if (reply.size == 0)
+		return;
+
+	__dispatch_reply(conn, serial, upstream, &reply);
+	flush_send_batch();
+}
+
+_Noreturn static void *upstream_listener_thread(void *arg)
+{
+	upstream_ctx *ctx = (upstream_ctx *)arg;
+	struct pollfd fds[NUM_UPSTREAM];
+
+	upstream_fill_pollfds(ctx, fds);
+
+	while (1) {
+		if (poll(fds, NUM_UPSTREAM, -1) <= 0)
+			continue;
+
+		upstream_handle_pollfds(ctx, fds);
+		flush_send_batch();
+	}
+}
+
+void upstream_init(void)
+{
+	pending_query_init();
+	pending_query_set_timeout_handler(__upstream_timeout);
+
+	for (size_t i = 0; i < NUM_UPSTREAM; i++) {
+		rmdns_info[i].sin_family = AF_INET;
+		rmdns_info[i].sin_port = htons(DNS_PORT);
+		rmdns_info[i].sin_addr.s_addr = inet_addr(remote_dns[i]);
+
+		memset(&health[i], 0, sizeof(health[i]));
+		health[i].stats.address = remote_dns[i];
+		health[i].stats.state = UPSTREAM_CLOSED;
+		health[i].backoff_ms = UPSTREAM_PROBE_MIN_MS;
+	}
+	tcp_pool_init(rmdns_info, NUM_UPSTREAM, __handle_tcp_reply);
+
+	logger_write(LOGGER_DEBUG,
+		     "upstream_init(): Upstream initialization finished.");
+}
+
+upstream_ctx *create_upstream_ctx(void)
+{
+	upstream_ctx *ctx = (upstream_ctx *)malloc(sizeof(upstream_ctx));
+
+	for (size_t i = 0; i < NUM_UPSTREAM; i++) {
+		ctx->socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		logger_write(LOGGER_DEBUG,
+			     "Initialize Remote Socket %s succeeded.",
+			     remote_dns[i]);
+	}
+	return ctx;
+}
+
+void upstream_start_listener(upstream_ctx *ctx)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, upstream_listener_thread, ctx);
+	pthread_detach(thread);
+}
+
+size_t upstream_fill_pollfds(const upstream_ctx *ctx, struct pollfd *fds)
+{
+	for (int i = 0; i < NUM_UPSTREAM; i++) {
+		fds[i].fd = ctx->socks[i];
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	return NUM_UPSTREAM;
+}
+
+void upstream_handle_pollfds(upstream_ctx *ctx, const struct pollfd *fds)
+{
+	raw_data reply;
+	SOCKADDR_IN from;
+
+	for (int i = 0; i < NUM_UPSTREAM; i++) {
+		if (!(fds[i].revents & POLLIN))
+			continue;
+
+		reply.size = listen_to(ctx->socks[i], &from, reply.data,
+				       RAW_DATA_MAX_SIZE);
+		if (reply.size >= sizeof(dns_header))
+			__handle_reply(ctx, i, &reply, &from);
+	}
+}
+
+/**
+ * 把query放入pending table，并从ctx中对应的socket向upstream发送data
+ * @param probe 是否为__select_upstream()放行的探测
+ */
+static BOOL __forward_query(const upstream_ctx *ctx, int upstream,
+			    BOOL probe, pending_query *query,
+			    const void *data, size_t size)
+{
+	/* 后台刷新没有客户端在等待，不需要hedge */
+	BOOL hedge = get_config()->hedge &&
+		     query->client_sock != PENDING_NO_CLIENT;
+
+	/* 加入pending table后回复随时可能到达，发送时间要提前设置 */
+	query->ctx = ctx;
+	__set_attempt(&query->attempts[0], ctx, upstream,
+		      get_config()->upstream_tcp, FALSE);
+	query->attempts[0].probe = probe;
+	query->num_attempts = 1;
+	/* 超时重传和回复被截断后改用TCP都要重新发送 */
+	pending_query_set_packet(query, data, size);
+	pending_attempt attempt = query->attempts[0];
+	switch (pending_query_add(query, __rto_ms(upstream))) {
+	case PENDING_ADDED:
+		__upstream_sent(upstream);
+		break;
+	case PENDING_JOINED:
+	case PENDING_DROPPED:
+		return TRUE;
+	case PENDING_FULL:
+		free_pending_query(query);
+		return FALSE;
+	}
+
+	uint8_t buf[REQUEST_BUF_SIZE];
+	uint16_t upstream_id = query->upstream_id;
+	uint32_t serial = query->serial;
+	memcpy(buf, data, size);
+	set_header_info(buf, HEADER_ID, upstream_id);
+
+	/* 发送后query可能已经被接收线程取走，不能再访问 */
+	__send_attempt(&attempt, buf, size);
+	if (hedge)
+		__hedge(ctx, upstream, upstream_id, serial, buf, size);
+	return TRUE;
+}
+
+static BOOL __forward(upstream_ctx *ctx, unsigned int worker,
+		      const request_data *request, SOCKET client_sock,
+		      const SOCKADDR_IN *client)
+{
+	pending_query *query = create_pending_query(
+		request->data, request->size, client_sock, client);
+	if (query == NULL) {
+		logger_write(
+			LOGGER_WARNING,
+			"upstream_forward(): Bad query request. Ignored.");
+		return FALSE;
+	}
+
+	BOOL probe = FALSE;
+	int upstream = __select_upstream(worker, &probe);
+	return __forward_query(ctx, upstream, probe, query, request->data,
+			       request->size);
+}
+
+BOOL upstream_forward(upstream_ctx *ctx, unsigned int worker,
+		      const request_data *request)
+{
+	return __forward(ctx, worker, request, request->sock, &request->info);
+}
+
+BOOL upstream_refresh(upstream_ctx *ctx, unsigned int worker,
+		      const request_data *request)
+{
+	return __forward(ctx, worker, request, PENDING_NO_CLIENT, NULL);
+}
+
+BOOL upstream_forward_tail(upstream_ctx *ctx, unsigned int worker,
+			   const request_data *request, const void *tail,
+			   size_t tail_size)
+{
+	pending_query *query = create_pending_query(
+		tail, tail_size, request->sock, &request->info);
+	if (query == NULL)
+		return upstream_forward(ctx, worker, request);
+
+	BOOL probe = FALSE;
+	int upstream = __select_upstream(worker, &probe);
+	pending_query_set_origin(query, request->data, request->size);
+	return __forward_query(ctx, upstream, probe, query, tail, tail_size);
+}
+
+void get_upstream_stats(upstream_stats stats[NUM_UPSTREAM])
+{
+	pthread_mutex_lock(&health_lock);
+	for (int i = 0; i < NUM_UPSTREAM; i++)
+		stats[i] = health[i].stats;
+	pthread_mutex_unlock(&health_lock);
+}
@@ -0,0 +1,140 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_UPSTREAM_H_
+#define CORE_UPSTREAM_H_
+
+#include "request_cache.h"
+#include "unidef.h"
+
+#include <poll.h>
+#include <stdint.h>
+
+#define NUM_UPSTREAM 4
+
+/* 每次发送的超时为SRTT + 4 * RTTVAR（RFC 6298），限制在MIN和MAX之间，没有样本时为MAX */
+#define UPSTREAM_RTO_MIN_MS 50
+#define UPSTREAM_RTO_MAX_MS 1000
+
+/* 连续超时这么多次后熔断，之后每隔backoff发送一个探测查询，失败时backoff加倍 */
+#define UPSTREAM_BREAKER_FAILURES 3
+#define UPSTREAM_PROBE_MIN_MS 1000
+#define UPSTREAM_PROBE_MAX_MS 60000
+
+/* 比较时没有新样本的服务器的SRTT每隔这么久减小1/8，使较慢的服务器偶尔被重新测量 */
+#define UPSTREAM_DECAY_MS 1000
+
+/* 空闲一段时间后最多连续hedge的查询数 */
+#define UPSTREAM_HEDGE_BURST 10
+/* 用最近这么多个RTT样本计算hedge的延迟，每收到1/4个样本重新计算一次 */
+#define UPSTREAM_RTT_SAMPLES 64
+
+typedef enum UPSTREAM_STATE {
+	UPSTREAM_CLOSED = 0, /* 正常 */
+	UPSTREAM_OPEN = 1, /* 熔断，到时间后才发送探测 */
+	UPSTREAM_HALF_OPEN = 2, /* 已放行一个探测查询，等待结果 */
+} UPSTREAM_STATE;
+
+typedef struct upstream_stats {
+	const char *address;
+	UPSTREAM_STATE state;
+	uint64_t srtt_us; /* 平滑的RTT，没有样本时为0 */
+	uint64_t rttvar_us;
+	uint64_t tail_us; /* hedge的延迟，见upstream_forward() */
+	unsigned fail_permille; /* 超时率的指数平均 */
+	size_t queries;
+	size_t replies;
+	size_t timeouts;
+	size_t retransmits; /* 其他服务器超时后重传过来的查询 */
+	size_t hedged; /* 作为第二个upstream收到的查询 */
+	size_t hedge_wins; /* 其中比第一个upstream先回复的 */
+	size_t tcp_fallbacks; /* UDP回复被截断后改用TCP重新查询的次数 */
+} upstream_stats;
+
+/**
+ * 一组连接到各个upstream服务器的socket。
+ * 共享模式下所有工作线程共用一个，由单独的接收线程处理回复；
+ * reuseport模式下每个线程拥有自己的一个，并在自己的事件循环中处理回复。
+ */
+typedef struct upstream_ctx {
+	SOCKET socks[NUM_UPSTREAM];
+} upstream_ctx;
+
+/**
+ * 初始化upstream服务器地址和pending table。
+ */
+extern void upstream_init(void);
+
+extern upstream_ctx *create_upstream_ctx(void);
+
+/**
+ * 创建线程接收ctx中所有socket上的回复。
+ */
+extern void upstream_start_listener(upstream_ctx *ctx);
+
+/**
+ * 将ctx的socket填入fds，用于在调用者自己的poll中等待回复。
+ * @return 填入的数量，即NUM_UPSTREAM
+ */
+extern size_t upstream_fill_pollfds(const upstream_ctx *ctx,
+				    out struct pollfd *fds);
+
+/**
+ * 处理poll之后fds中可读的socket上的回复。
+ */
+extern void upstream_handle_pollfds(upstream_ctx *ctx,
+				    const struct pollfd *fds);
+
+/**
+ * 将请求转发给upstream服务器后立即返回，不等待回复。
+ * 回复由接收线程根据pending table转发给客户端并更新cache。
+ * 在没有熔断的服务器中选择平滑RTT（按超时率加权）最小的一个。
+ * 开启hedge时，回复比最近RTT样本的p(100 - hedge_percent)（至多p90）还慢的查询，
+ * 会在预算内再发给第二好的服务器，两者中先到的回复有效。
+ * 超时后在upstream_retries次之内重传给还没有发过的服务器。
+ * @param worker 多个服务器一样快时用于分散
+ * @return 若请求不合法或pending table已满则返回FALSE
+ */
+extern BOOL upstream_forward(upstream_ctx *ctx, unsigned int worker,
+			     const request_data *request);
+
+/**
+ * 和upstream_forward()相同，但回复只用于更新cache，不发送给客户端。
+ * 同一个问题已经在查询中时不再重复发送。
+ */
+extern BOOL upstream_refresh(upstream_ctx *ctx, unsigned int worker,
+			     const request_data *request);
+
+/**
+ * 只向upstream查询request的CNAME链末端（见inverse_query_cname_tail()），
+ * 收到回复后用缓存的CNAME链和新的记录回复request。
+ */
+extern BOOL upstream_forward_tail(upstream_ctx *ctx, unsigned int worker,
+				  const request_data *request,
+				  const void *tail, size_t tail_size);
+
+extern void get_upstream_stats(out upstream_stats stats[NUM_UPSTREAM]);
+
+#endif /* CORE_UPSTREAM_H_ */
@@ -0,0 +1,349 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_SQ_ENTRIES 8
+/* multishot recvmsg会产生大量CQE，CQ要足够大以免溢出 */
+#define URING_CQ_ENTRIES 4096
+/* provided buffer数量，必须是2的幂 */
+#define URING_NUM_BUFS 1024
+/* 每个buffer依次存放io_uring_recvmsg_out、源地址和报文 */
+#define URING_BUF_SIZE 2048
+#define URING_BUF_GROUP 0
+
+struct uring_ctx {
+	int fd;
+	SOCKET sock;
+
+	void *ring_ptr;
+	size_t ring_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *buf_ring;
+	unsigned char *bufs;
+	uint16_t buf_tail;
+
+	struct msghdr msg; /* multishot recvmsg只使用其中的namelen和controllen */
+	unsigned to_submit;
+	BOOL armed;
+};
+
+static int __uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int __uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			 unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int __uring_register(int fd, unsigned opcode, void *arg,
+			    unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void __uring_destroy(uring_ctx *ctx)
+{
+	if (ctx->buf_ring != NULL && ctx->buf_ring != MAP_FAILED)
+		munmap(ctx->buf_ring,
+		       URING_NUM_BUFS * sizeof(struct io_uring_buf));
+	if (ctx->sqes != NULL && ctx->sqes != MAP_FAILED)
+		munmap(ctx->sqes, ctx->sqes_size);
+	if (ctx->ring_ptr != NULL && ctx->ring_ptr != MAP_FAILED)
+		munmap(ctx->ring_ptr, ctx->ring_size);
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	free(ctx->bufs);
+	free(ctx);
+}
+
+/**
+ * 把buffer放回provided buffer ring，调用__publish_bufs()后内核才可见
+ */
+static void __recycle_buf(uring_ctx *ctx, uint16_t bid)
+{
+	struct io_uring_buf *buf =
+		&ctx->buf_ring->bufs[ctx->buf_tail & (URING_NUM_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(ctx->bufs +
+					   (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ctx->buf_tail++;
+}
+
+static void __publish_bufs(uring_ctx *ctx)
+{
+	__atomic_store_n(&ctx->buf_ring->tail, ctx->buf_tail,
+			 __ATOMIC_RELEASE);
+}
+
+/**
+ * 在socket上挂一个multishot recvmsg，直到被内核终止前会持续产生CQE
+ */
+static void __arm_recv(uring_ctx *ctx)
+{
+	unsigned tail = *ctx->sq_tail;
+	unsigned index = tail & *ctx->sq_mask;
+	struct io_uring_sqe *sqe = &ctx->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ctx->sock;
+	sqe->addr = (uint64_t)(uintptr_t)&ctx->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+
+	ctx->sq_array[index] = index;
+	__atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ctx->to_submit++;
+	ctx->armed = TRUE;
+}
+
+uring_ctx *create_uring_ctx(const SOCKET sock)
+{
+	uring_ctx *ctx = (uring_ctx *)calloc(1, sizeof(uring_ctx));
+	struct io_uring_params params;
+
+	ctx->fd = -1;
+	ctx->sock = sock;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	ctx->fd = __uring_setup(URING_SQ_ENTRIES, &params);
+	if (ctx->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		logger_write(
+			LOGGER_WARNING,
+			"create_uring_ctx(): io_uring is not available. ERROR CODE: %d",
+			errno);
+		__uring_destroy(ctx);
+		return NULL;
+	}
+
+	size_t sq_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->ring_size = DNS_SERVER_MAX(sq_size, cq_size);
+	ctx->ring_ptr = mmap(NULL, ctx->ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ctx->fd,
+			     IORING_OFF_SQ_RING);
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_SQES);
+	ctx->buf_ring = mmap(NULL,
+			     URING_NUM_BUFS * sizeof(struct io_uring_buf),
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ctx->bufs = (unsigned char *)malloc((size_t)URING_NUM_BUFS *
+					    URING_BUF_SIZE);
+	if (ctx->ring_ptr == MAP_FAILED || ctx->sqes == MAP_FAILED ||
+	    ctx->buf_ring == MAP_FAILED || ctx->bufs == NULL) {
+		logger_write(LOGGER_WARNING,
+			     "create_uring_ctx(): Failed to map io_uring.");
+		__uring_destroy(ctx);
+		return NULL;
+	}
+
+	unsigned char *ring = (unsigned char *)ctx->ring_ptr;
+	ctx->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	ctx->sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+	ctx->sq_array = (unsigned *)(ring + params.sq_off.array);
+	ctx->cq_head = (unsigned *)(ring + params.cq_off.head);
+	ctx->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	ctx->cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ctx->buf_ring;
+	reg.ring_entries = URING_NUM_BUFS;
+	reg.bgid = URING_BUF_GROUP;
+
+	if (__uring_register(ctx->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		logger_write(
+			LOGGER_WARNING,
+			"create_uring_ctx(): Failed to register provided buffers. ERROR CODE: %d",
+			errno);
+		__uring_destroy(ctx);
+		return NULL;
+	}
+
+	for (uint16_t i = 0; i < URING_NUM_BUFS; i++)
+		__recycle_buf(ctx, i);
+	__publish_bufs(ctx);
+
+	ctx->msg.msg_namelen = sizeof(SOCKADDR_IN);
+	__arm_recv(ctx);
+	if (__uring_enter(ctx->fd, ctx->to_submit, 0, 0) < 0) {
+		logger_write(
+			LOGGER_WARNING,
+			"create_uring_ctx(): Failed to submit multishot recvmsg. ERROR CODE: %d",
+			errno);
+		__uring_destroy(ctx);
+		return NULL;
+	}
+	ctx->to_submit = 0;
+
+	logger_write(LOGGER_DEBUG,
+		     "create_uring_ctx(): io_uring engine ready on socket %d.",
+		     sock);
+	return ctx;
+}
+
+int uring_fd(const uring_ctx *ctx)
+{
+	return ctx->fd;
+}
+
+/**
+ * 处理一个CQE
+ * @return 若取出了一个报文则返回TRUE
+ */
+static BOOL __handle_cqe(uring_ctx *ctx, const struct io_uring_cqe *cqe,
+			 udp_msg *msg)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ctx->armed = FALSE;
+
+	if (cqe->res < 0) {
+		if (cqe->res != -ENOBUFS)
+			logger_write(
+				LOGGER_WARNING,
+				"uring_recv_batch(): recvmsg failed. ERROR CODE: %d",
+				-cqe->res);
+		return FALSE;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return FALSE;
+
+	uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	unsigned char *buf = ctx->bufs + (size_t)bid * URING_BUF_SIZE;
+	const struct io_uring_recvmsg_out *hdr =
+		(const struct io_uring_recvmsg_out *)buf;
+	const unsigned char *name = buf + sizeof(*hdr);
+	const unsigned char *payload = name + ctx->msg.msg_namelen;
+	size_t avail = URING_BUF_SIZE - (size_t)(payload - buf);
+	size_t size = DNS_SERVER_MIN((size_t)hdr->payloadlen, avail);
+
+	size = DNS_SERVER_MIN(size, msg->buf_size);
+	if (hdr->namelen >= sizeof(SOCKADDR_IN))
+		memcpy(msg->info, name, sizeof(SOCKADDR_IN));
+	memcpy(msg->data, payload, size);
+	msg->size = size;
+
+	__recycle_buf(ctx, bid);
+	return TRUE;
+}
+
+size_t uring_recv_batch(uring_ctx *ctx, udp_msg *msgs, const size_t num)
+{
+	size_t n = 0;
+
+	while (n == 0 && num > 0) {
+		if (!ctx->armed)
+			__arm_recv(ctx);
+
+		unsigned head = *ctx->cq_head;
+		unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail || ctx->to_submit) {
+			int res = __uring_enter(ctx->fd, ctx->to_submit,
+						head == tail ? 1 : 0,
+						IORING_ENTER_GETEVENTS);
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+				logger_write(
+					LOGGER_WARNING,
+					"uring_recv_batch(): io_uring_enter failed. ERROR CODE: %d",
+					errno);
+				return 0;
+			}
+			ctx->to_submit = 0;
+			continue;
+		}
+
+		for (; head != tail && n < num; head++) {
+			if (__handle_cqe(ctx,
+					 &ctx->cqes[head & *ctx->cq_mask],
+					 &msgs[n]))
+				n++;
+		}
+		__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+		__publish_bufs(ctx);
+	}
+	return n;
+}
+
+#else
+
+uring_ctx *create_uring_ctx(const SOCKET sock)
+{
+	return NULL;
+}
+
+int uring_fd(const uring_ctx *ctx)
+{
+	return -1;
+}
+
+size_t uring_recv_batch(uring_ctx *ctx, udp_msg *msgs, const size_t num)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CORE_URING_H_
+#define CORE_URING_H_
+
+#include "socket.h"
+#include "unidef.h"
+
+#include <stddef.h>
+
+/**
+ * 基于io_uring的接收引擎。在socket上挂一个multishot recvmsg，
+ * 内核把报文直接写进预先注册的provided buffer ring，一次io_uring_enter可以取回多个报文。
+ * 内核不支持时create_uring_ctx()返回NULL，调用者应退回recvmmsg。
+ */
+typedef struct uring_ctx uring_ctx;
+
+extern uring_ctx *create_uring_ctx(const SOCKET sock);
+
+/**
+ * @return 可以poll的fd，有完成事件时可读
+ */
+extern int uring_fd(const uring_ctx *ctx);
+
+/**
+ * 至少等待一个报文，最多取出num个，拷贝到msgs中后立即归还缓冲区。
+ * @return 取出的报文数
+ */
+extern size_t uring_recv_batch(uring_ctx *ctx, udp_msg *msgs, const size_t num);
+
+#endif /* CORE_URING_H_ */
@@ -26,136 +26,327 @@
 #define _GNU_SOURCE
 
 #include "core/cache.h"
+#include "core/config.h"
 #include "core/dns.h"
 #include "core/host.h"
 #include "core/inverse_query.h"
 #include "core/logger.h"
+#include "core/pending_query.h"
 #include "core/request_cache.h"
 #include "core/socket.h"
+#include "core/tcp_pool.h"
+#include "core/timer.h"
+#include "core/upstream.h"
 #include "test.h"
 #include "unidef.h"
 
 #include <assert.h>
 #include <ctype.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-static const char *const remote_dns[] = { "119.29.29.29", "180.76.76.76",
-					  "114.114.114.114", "1.1.1.1" };
-static SOCKET rmdns_sks[4];
-static SOCKADDR_IN rmdns_info[4];
+#define STATUS_REPORT_INTERVAL_MS 60000
+/* 没有EDNS时UDP回复的大小上限，由记录重新构造的回复不超过该值 */
+#define CACHE_REPLY_MAX_SIZE 512
+
+typedef struct worker_args {
+	unsigned int id;
+	upstream_ctx *upstream;
+} worker_args;
 
 static void program_start();
-static void handle_request(unsigned char id);
+static void report_status(void *_);
+static void *handle_request(void *arg);
+static void *handle_request_reuseport(void *arg);
+static void handle_single_request(unsigned int id, upstream_ctx *upstream,
+				  request_data *request);
 
 static BOOL handle_in_host(request_data *request);
-static BOOL handle_in_cache(request_data *request);
-static void handle_in_remote_server(unsigned char id, request_data *request,
-				    raw_data *remote_data);
+static BOOL handle_in_cache(unsigned int id, upstream_ctx *upstream,
+			    request_data *request);
+static void handle_in_remote_server(unsigned int id, upstream_ctx *upstream,
+				    request_data *request);
 
 int main()
 {
+	/* 先屏蔽退出信号再创建其他线程，由主线程统一等待 */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
 	program_start();
-	pthread_t hts[4];
 
-	for (int i = 0; i < 4; i++) {
-		pthread_create(&hts[i], NULL, (void *)handle_request,
-			       (void *)(unsigned long long)i);
-		pthread_detach(hts[i]);
+	size_t num_threads = config_threads();
+	BOOL reuseport = get_config()->reuseport;
+	upstream_ctx *shared_upstream = NULL;
+
+	if (!reuseport) {
+		shared_upstream = create_upstream_ctx();
+		upstream_start_listener(shared_upstream);
+	}
+
+	logger_write(LOGGER_INFO, "main(): Starting %zu %s threads.",
+		     num_threads, reuseport ? "reuseport" : "worker");
+
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_t thread;
+		worker_args *args = (worker_args *)malloc(sizeof(worker_args));
+		args->id = (unsigned int)i;
+		args->upstream = shared_upstream;
+
+		pthread_create(&thread, NULL,
+			       reuseport ? handle_request_reuseport :
+					   handle_request,
+			       args);
+		pthread_detach(thread);
 	}
-	pthread_exit(NULL);
+
+	int sig = 0;
+	sigwait(&signals, &sig);
+	logger_write(LOGGER_INFO, "main(): Received signal %d. Exiting.", sig);
+	if (get_config()->cache_snapshot[0] != '\0')
+		save_cache_snapshot(get_config()->cache_snapshot);
 	return 0;
 }
 
 static void program_start()
 {
 	logger_init("./info.log", LOGGER_INFO, LOGGER_TARGET_CONSOLE);
+	read_config(CONFIG_DEFAULT_PATH);
 
+	timer_init();
 	socket_init();
-	request_cache_init();
+	/* reuseport模式下各线程直接从自己的socket接收，不需要共享队列 */
+	if (!get_config()->reuseport)
+		request_cache_init();
 	init_cache_pools();
 	read_host("./host");
+	upstream_init();
+
+	timer_add(STATUS_REPORT_INTERVAL_MS, report_status, NULL);
+}
+
+/**
+ * 定期输出运行状态
+ */
+static void report_status(void *_)
+{
+	socket_stats stats;
+	get_socket_stats(&stats);
+
+	if (!get_config()->reuseport)
+		logger_write(
+			LOGGER_DEBUG,
+			"report_status(): Request queue depth: %zu, dropped: %zu.",
+			request_queue_depth(), request_queue_dropped());
+	logger_write(
+		LOGGER_DEBUG,
+		"report_status(): Average batch fill: recv %.2f (%zu/%zu), send %.2f (%zu/%zu).",
+		stats.recv_calls ? (double)stats.recv_msgs / stats.recv_calls :
+				   0.0,
+		stats.recv_msgs, stats.recv_calls,
+		stats.send_calls ? (double)stats.send_msgs / stats.send_calls :
+				   0.0,
+		stats.send_msgs, stats.send_calls);
+
+	cache_stats cache;
+	get_cache_stats(&cache);
+	logger_write(LOGGER_DEBUG,
+		     "report_status(): Cache entries: %zu, bytes: %zu, evicted: %zu, reaped: %zu, prefetched: %zu, useful: %zu.",
+		     cache.entries, cache.bytes, cache.evicted, cache.reaped,
+		     cache.prefetched, cache.prefetch_useful);
+
+	logger_write(LOGGER_DEBUG,
+		     "report_status(): Pending upstream queries: %zu, saved by coalescing: %zu, dropped over waiter limit: %zu.",
+		     pending_query_count(), pending_query_saved(),
+		     pending_query_dropped());
+
+	static const char *const upstream_states[] = { "up", "open",
+						       "probing" };
+	upstream_stats upstreams[NUM_UPSTREAM];
+	get_upstream_stats(upstreams);
+	for (int i = 0; i < NUM_UPSTREAM; i++)
+		logger_write(
+			LOGGER_DEBUG,
+			"report_status(): Upstream %s (%s): srtt %.1fms, rttvar %.1fms, tail %.1fms, fail %.1f%%, queries: %zu, replies: %zu, timeouts: %zu, retransmits: %zu, hedged: %zu, hedge wins: %zu, tcp fallbacks: %zu.",
+			upstreams[i].address,
+			upstream_states[upstreams[i].state],
+			upstreams[i].srtt_us / 1000.0,
+			upstreams[i].rttvar_us / 1000.0,
+			upstreams[i].tail_us / 1000.0,
+			upstreams[i].fail_permille / 10.0, upstreams[i].queries,
+			upstreams[i].replies, upstreams[i].timeouts,
+			upstreams[i].retransmits, upstreams[i].hedged,
+			upstreams[i].hedge_wins, upstreams[i].tcp_fallbacks);
+
+	tcp_pool_stats tcp;
+	get_tcp_pool_stats(&tcp);
+	logger_write(LOGGER_DEBUG,
+		     "report_status(): Upstream TCP connections: %zu, opened: %zu, queries: %zu, replies: %zu.",
+		     tcp.connections, tcp.opened, tcp.queries, tcp.replies);
 
-	for (size_t i = 0; i < 4; i++) {
-		rmdns_sks[i] = socket(AF_INET, SOCK_DGRAM, 0);
-		rmdns_info[i].sin_family = AF_INET;
-		rmdns_info[i].sin_port = htons(53);
-		rmdns_info[i].sin_addr.s_addr = inet_addr(remote_dns[i]);
-		logger_write(LOGGER_DEBUG,
-			     "Initialize Remote Socket %s succeeded.",
-			     remote_dns[i]);
+	if (!get_config()->reuseport) {
+		request_pool_stats pool;
+		get_request_pool_stats(&pool);
+		logger_write(
+			LOGGER_DEBUG,
+			"report_status(): Request pool hits: %zu, misses: %zu, in use: %zu, pooled: %zu, released: %zu.",
+			pool.hits, pool.misses, pool.in_use, pool.pooled,
+			pool.released);
 	}
+
+	timer_add(STATUS_REPORT_INTERVAL_MS, report_status, NULL);
 }
 
-static void handle_request(const unsigned char id)
+/**
+ * 共享模式：从共享队列中取请求处理，upstream的回复由单独的接收线程处理
+ */
+static void *handle_request(void *arg)
 {
+	worker_args *args = (worker_args *)arg;
 	request_data *request;
-	raw_data recv_buf;
 
 	logger_write(LOGGER_DEBUG,
-		     "handle_request(%u): Create thread succeeded.", id);
+		     "handle_request(%u): Create thread succeeded.", args->id);
 
 	while (1) {
 		request = get_request();
 		if (request == NULL) {
-			sleepms(10);
-			continue;
+			/* 队列空闲时先把攒下的回复发出去 */
+			flush_send_batch();
+			request = wait_request();
 		}
 
-		if (request->size < sizeof(dns_header)) {
+		handle_single_request(args->id, args->upstream, request);
+		free_request(request);
+		check_send_batch();
+	}
+	return NULL;
+}
+
+/**
+ * reuseport模式：每个线程绑定一个CPU，拥有自己的本地socket和upstream socket，
+ * 在同一个poll循环中接收请求、处理upstream回复，线程之间不共享队列。
+ */
+static void *handle_request_reuseport(void *arg)
+{
+	worker_args *args = (worker_args *)arg;
+
+#ifdef __linux__
+	long num_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpu > 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(args->id % num_cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
 			logger_write(
-				LOGGER_DEBUG,
-				"handle_request(): Request data smaller than dns_header. This may be a fake request. Ignored.");
-			free(request);
-			continue;
-		}
+				LOGGER_WARNING,
+				"handle_request_reuseport(%u): Failed to set CPU affinity.",
+				args->id);
+	}
+#endif
 
-		if (handle_in_host(request)) {
-			free(request);
-			continue;
-		} else if (handle_in_cache(request)) {
-			free(request);
+	SOCKET sock = bind_reuseport_socket(DNS_PORT);
+	upstream_ctx *upstream = create_upstream_ctx();
+
+	size_t batch_size = DNS_SERVER_MIN(
+		DNS_SERVER_MAX(get_config()->batch_size, 1), SOCKET_MAX_BATCH);
+	request_data *requests =
+		(request_data *)malloc(batch_size * sizeof(request_data));
+	udp_msg msgs[SOCKET_MAX_BATCH];
+	struct pollfd fds[NUM_UPSTREAM + 1];
+
+	fds[0].fd = socket_poll_fd(sock);
+	fds[0].events = POLLIN;
+	upstream_fill_pollfds(upstream, fds + 1);
+
+	logger_write(LOGGER_DEBUG,
+		     "handle_request_reuseport(%u): Create thread succeeded.",
+		     args->id);
+
+	while (1) {
+		if (poll(fds, NUM_UPSTREAM + 1, -1) <= 0)
 			continue;
-		} else {
-			handle_in_remote_server(id, request, &recv_buf);
 
-			if (recv_buf.size)
-				update_cache(&recv_buf);
+		if (fds[0].revents & POLLIN) {
+			for (size_t i = 0; i < batch_size; i++) {
+				msgs[i].info = &requests[i].info;
+				msgs[i].data = requests[i].data;
+				msgs[i].buf_size = REQUEST_BUF_SIZE;
+				msgs[i].size = 0;
+			}
+
+			size_t num = listen_to_batch(sock, msgs, batch_size);
+			for (size_t i = 0; i < num; i++) {
+				requests[i].size = msgs[i].size;
+				requests[i].sock = sock;
+				handle_single_request(args->id, upstream,
+						      &requests[i]);
+			}
 		}
 
-		free(request);
+		upstream_handle_pollfds(upstream, fds + 1);
+		flush_send_batch();
 	}
+	return NULL;
 }
 
-static void handle_in_remote_server(unsigned char id, request_data *request,
-				    raw_data *recv_buf)
+/**
+ * 处理一个请求，不释放request
+ */
+static void handle_single_request(unsigned int id, upstream_ctx *upstream,
+				  request_data *request)
 {
-	uint16_t oid = 0, gid = rand();
+	if (request->size < sizeof(dns_header)) {
+		logger_write(
+			LOGGER_DEBUG,
+			"handle_request(): Request data smaller than dns_header. This may be a fake request. Ignored.");
+		return;
+	}
 
-	oid = get_header_info(request->data, HEADER_ID);
-	set_header_info(request->data, HEADER_ID, gid);
+	if (!handle_in_host(request) &&
+	    !handle_in_cache(id, upstream, request))
+		handle_in_remote_server(id, upstream, request);
+}
 
-	send_to(rmdns_sks[id], &rmdns_info[id], request->data, request->size);
-	recv_buf->size = listen_to_async(rmdns_sks[id], &rmdns_info[id],
-					 recv_buf->data, 1024, 1);
+/**
+ * 转发给upstream后立即返回，回复由upstream接收线程处理
+ */
+static void handle_in_remote_server(unsigned int id, upstream_ctx *upstream,
+				    request_data *request)
+{
+	uint8_t tail[REQUEST_BUF_SIZE];
+	size_t tail_size =
+		inverse_query_cname_tail(request, tail, sizeof(tail));
 
-	if (!recv_buf->size)
+	if (tail_size) {
+		if (!upstream_forward_tail(upstream, id, request, tail,
+					   tail_size))
+			logger_write(
+				LOGGER_WARNING,
+				"handle_in_remote_server(): Failed to forward request to upstream.");
 		return;
-
-	set_header_info(recv_buf->data, HEADER_ID, oid);
-
-	send_to(get_local_socket(), &request->info, recv_buf->data,
-		recv_buf->size);
+	}
+	if (!upstream_forward(upstream, id, request))
+		logger_write(
+			LOGGER_WARNING,
+			"handle_in_remote_server(): Failed to forward request to upstream.");
 }
 
 /**
- * inverse query
+ * inverse query。命中过期但还能使用的记录或需要预取时，先回复客户端，再在后台刷新
  */
-static BOOL handle_in_cache(request_data *request)
+static BOOL handle_in_cache(unsigned int id, upstream_ctx *upstream,
+			    request_data *request)
 {
 #ifdef __DEBUG__
 	assert(request != NULL);
@@ -172,13 +363,35 @@ static BOOL handle_in_cache(request_data *request)
 	}
 
 	uint16_t qtype = GET_TYPE_PTR_TYPE(qtype_ptr);
-	uint8_t reply[512] = { 0 };
+	/* 整包缓存命中时原样返回upstream的回复，可能超过512字节 */
+	uint8_t reply[RAW_DATA_MAX_SIZE];
 	size_t reply_size = 0;
+	BOOL refresh = FALSE;
+
+	reply_size = query_packet_record(request->data, request->size, reply,
+					 sizeof(reply), &refresh);
+	if (!reply_size)
+		reply_size = inverse_query_negative(request, reply,
+						    CACHE_REPLY_MAX_SIZE);
+	if (reply_size) {
+		/* 经TCP得到的回复可能超过客户端的UDP报文大小 */
+		if (reply_size > get_udp_payload_size(request->data,
+						      request->size))
+			reply_size = truncate_response(reply, reply_size);
+		send_to_batched(request->sock, &request->info, reply,
+				reply_size);
+		if (refresh)
+			upstream_refresh(upstream, id, request);
+		return TRUE;
+	}
 
 	if (qtype == TYPE_A) {
-		reply_size = inverse_query_a(request, reply);
+		reply_size = inverse_query_a(request, reply, &refresh);
 	} else if (qtype == TYPE_AAAA) {
-		reply_size = inverse_query_aaaa(request, reply);
+		reply_size = inverse_query_aaaa(request, reply, &refresh);
+	} else if (rrset_cacheable(qtype)) {
+		reply_size = inverse_query_rrset(request, reply,
+						 CACHE_REPLY_MAX_SIZE);
 	} else {
 		return FALSE;
 	}
@@ -186,7 +399,9 @@ static BOOL handle_in_cache(request_data *request)
 	if (!reply_size)
 		return FALSE;
 
-	send_to(get_local_socket(), &request->info, reply, reply_size);
+	send_to_batched(request->sock, &request->info, reply, reply_size);
+	if (refresh)
+		upstream_refresh(upstream, id, request);
 	return TRUE;
 }
 
@@ -251,7 +466,8 @@ static BOOL handle_in_host(request_data *request)
 		memcpy(reply, request->data, request->size);
 		reply_size = request->size;
 
-		set_header_info(reply, HEADER_FLAGS, FLAGS_RESPONSE_NO_ERROR);
+		set_header_info(reply, HEADER_FLAGS,
+				response_flags(request->data, RCODE_NO_ERROR));
 		set_header_info(reply, HEADER_ANSWER, 1);
 
 		reply_size += generate_single_a_response(0xc00c, ans,
@@ -260,6 +476,6 @@ static BOOL handle_in_host(request_data *request)
 
 	logger_write_raw(LOGGER_INFO, "Query in host(): Url -- %s", reply,
 			 reply_size);
-	send_to(get_local_socket(), &request->info, reply, reply_size);
+	send_to_batched(request->sock, &request->info, reply, reply_size);
 	return TRUE;
 }
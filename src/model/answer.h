@@ -66,6 +66,53 @@ typedef struct cname_answer {
 	char cname[DOMAIN_NAME_MAX_LENGTH];
 } cname_answer_t;
 
+/**
+ * NXDOMAIN或NODATA回复（RFC 2308）。soa是authority中的SOA记录，
+ * 其中的域名已解压缩，TTL字段在回复时按剩余时间填写。
+ */
+typedef struct negative_answer {
+	char domain[DOMAIN_NAME_MAX_LENGTH];
+	time_t last_update;
+	uint32_t ttl; /* min(SOA的TTL, SOA MINIMUM) */
+	uint16_t qtype;
+	uint16_t rcode;
+	uint16_t soa_ttl_offset;
+	uint16_t soa_size;
+	uint8_t soa[];
+} negative_answer_t;
+
+/**
+ * A、AAAA、CNAME以外类型的记录集合，同一个域名同一个类型的记录放在一起。
+ * rdata中依次存放每条记录：rdlength、rdata中域名的偏移（没有为RRSET_NO_NAME）、
+ * 解压缩后的rdata，前两项为主机字节序。
+ */
+typedef struct rrset_answer {
+	char domain[DOMAIN_NAME_MAX_LENGTH];
+	time_t last_update;
+	uint32_t ttl; /* 所有记录中最小的TTL */
+	uint16_t type;
+	uint16_t num;
+	uint16_t size; /* rdata的总字节数 */
+	uint8_t rdata[];
+} rrset_answer_t;
+
+#define RRSET_NO_NAME 0xffff
+
+/**
+ * upstream的完整回复。命中时复制data，修改ID和question，
+ * 再把ttl_offsets处的每个TTL减去经过的时间。
+ */
+typedef struct packet_answer {
+	time_t last_update;
+	uint32_t ttl; /* 所有TTL中最小的 */
+	uint16_t size;
+	uint16_t num_ttl;
+	uint8_t buf[]; /* num_ttl个TTL字段的偏移，后面是回复 */
+} packet_answer_t;
+
+#define packet_ttl_offsets(ans) ((uint16_t *)(ans)->buf)
+#define packet_data(ans) ((ans)->buf + (ans)->num_ttl * sizeof(uint16_t))
+
 #define answer_timeout(ans) (time(NULL) - ((ans)->last_update) >= ((ans)->ttl))
 #define answer_ttl(ans) (((ans)->ttl) - (time(NULL) - ((ans)->last_update)))
 
@@ -0,0 +1,336 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "hash_table.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a，域名部分按小写计算 */
+static uint32_t __hash(const char *key, size_t key_len, uint16_t type)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < key_len; i++) {
+		hash ^= (uint8_t)tolower((unsigned char)key[i]);
+		hash *= 16777619u;
+	}
+	hash ^= type;
+	hash *= 16777619u;
+	return hash;
+}
+
+static BOOL __key_equal(const struct __hash_node *node, uint32_t hash,
+			const char *key, size_t key_len, uint16_t type)
+{
+	if (node->hash != hash || node->type != type ||
+	    node->key_len != key_len)
+		return FALSE;
+
+	for (size_t i = 0; i < key_len; i++)
+		if ((unsigned char)node->key[i] !=
+		    tolower((unsigned char)key[i]))
+			return FALSE;
+	return TRUE;
+}
+
+/* node距离其理想位置的探测距离 */
+static size_t __probe_distance(const struct __hash_slots *slots, size_t pos,
+			       uint32_t hash)
+{
+	return (pos - (hash & slots->mask)) & slots->mask;
+}
+
+static struct __hash_slots *__create_slots(size_t size)
+{
+	struct __hash_slots *slots = (struct __hash_slots *)calloc(
+		1, sizeof(struct __hash_slots) +
+			   size * sizeof(struct __hash_node *));
+	slots->mask = size - 1;
+	return slots;
+}
+
+static void __retire_now(void *ptr, void (*free_fn)(void *))
+{
+	free_fn(ptr);
+}
+
+/* 写者读取槽位 */
+static struct __hash_node *__get(const struct __hash_slots *slots, size_t pos)
+{
+	return atomic_load_explicit(
+		(_Atomic(struct __hash_node *) *)&slots->nodes[pos],
+		memory_order_relaxed);
+}
+
+/* 发布槽位，读者看到指针时节点已初始化完毕 */
+static void __set(struct __hash_slots *slots, size_t pos,
+		  struct __hash_node *node)
+{
+	atomic_store_explicit(&slots->nodes[pos], node, memory_order_release);
+}
+
+static struct __hash_slots *__slots(const hash_table *table)
+{
+	return atomic_load_explicit(
+		(_Atomic(struct __hash_slots *) *)&table->slots,
+		memory_order_acquire);
+}
+
+hash_table *create_hash_table(size_t capacity)
+{
+	size_t size = 16;
+	while (size < capacity)
+		size <<= 1;
+
+	hash_table *result = (hash_table *)malloc(sizeof(hash_table));
+	atomic_init(&result->slots, __create_slots(size));
+	result->size = 0;
+	result->retire = __retire_now;
+	return result;
+}
+
+void destroy_hash_table(hash_table *table, void (*free_value)(void *))
+{
+	if (table == NULL)
+		return;
+
+	struct __hash_slots *slots = __slots(table);
+	for (size_t i = 0; i <= slots->mask; i++) {
+		struct __hash_node *node = __get(slots, i);
+		if (node == NULL)
+			continue;
+		if (free_value != NULL)
+			free_value(atomic_load(&node->value));
+		free(node);
+	}
+	free(slots);
+	free(table);
+}
+
+void hash_table_set_retire(hash_table *table,
+			   void (*retire)(void *ptr, void (*free_fn)(void *)))
+{
+	table->retire = retire != NULL ? retire : __retire_now;
+}
+
+/**
+ * Robin Hood插入：探测距离更短的node让位给距离更长的
+ */
+static void __place(struct __hash_slots *slots, struct __hash_node *node)
+{
+	size_t pos = node->hash & slots->mask;
+	size_t dist = 0;
+
+	while (1) {
+		struct __hash_node *cur = __get(slots, pos);
+		if (cur == NULL) {
+			__set(slots, pos, node);
+			return;
+		}
+
+		size_t cur_dist = __probe_distance(slots, pos, cur->hash);
+		if (cur_dist < dist) {
+			__set(slots, pos, node);
+			node = cur;
+			dist = cur_dist;
+		}
+
+		pos = (pos + 1) & slots->mask;
+		dist++;
+	}
+}
+
+/**
+ * 在新数组中重新放置所有node后一次性替换，读者看到的要么是旧数组要么是新数组
+ */
+static void __resize(hash_table *table, size_t size)
+{
+	struct __hash_slots *old = __slots(table);
+	struct __hash_slots *slots = __create_slots(size);
+
+	for (size_t i = 0; i <= old->mask; i++) {
+		struct __hash_node *node = __get(old, i);
+		if (node != NULL)
+			__place(slots, node);
+	}
+	atomic_store_explicit(&table->slots, slots, memory_order_release);
+	table->retire(old, free);
+}
+
+/**
+ * @param node 找到的node。写者随后可以用返回的位置修改槽位，读者只应使用node
+ * @return node所在的位置，不存在时返回-1
+ */
+static long __find_pos(const struct __hash_slots *slots, uint32_t hash,
+		       const char *key, size_t key_len, uint16_t type,
+		       out struct __hash_node **node)
+{
+	size_t pos = hash & slots->mask;
+
+	for (size_t dist = 0; dist <= slots->mask; dist++) {
+		const struct __hash_node *cur = atomic_load_explicit(
+			(_Atomic(struct __hash_node *) *)&slots->nodes[pos],
+			memory_order_acquire);
+
+		/* 遇到空位或探测距离更短的node，说明key不存在 */
+		if (cur == NULL ||
+		    __probe_distance(slots, pos, cur->hash) < dist)
+			return -1;
+		if (__key_equal(cur, hash, key, key_len, type)) {
+			*node = (struct __hash_node *)cur;
+			return (long)pos;
+		}
+
+		pos = (pos + 1) & slots->mask;
+	}
+	return -1;
+}
+
+void *hash_table_insert(hash_table *table, const char *key, size_t key_len,
+			uint16_t type, void *value)
+{
+	if (table == NULL || key == NULL || key_len > UINT16_MAX)
+		return NULL;
+
+	uint32_t hash = __hash(key, key_len, type);
+	struct __hash_slots *slots = __slots(table);
+	struct __hash_node *node = NULL;
+	if (__find_pos(slots, hash, key, key_len, type, &node) >= 0)
+		return atomic_exchange_explicit(&node->value, value,
+						memory_order_acq_rel);
+
+	if ((table->size + 1) * 8 > (slots->mask + 1) * 7) {
+		__resize(table, (slots->mask + 1) * 2);
+		slots = __slots(table);
+	}
+
+	node = (struct __hash_node *)malloc(hash_table_node_size(key_len));
+	node->hash = hash;
+	node->type = type;
+	node->key_len = (uint16_t)key_len;
+	for (size_t i = 0; i < key_len; i++)
+		node->key[i] = (char)tolower((unsigned char)key[i]);
+	node->key[key_len] = '\0';
+	atomic_init(&node->value, value);
+
+	__place(slots, node);
+	table->size++;
+	return NULL;
+}
+
+void hash_table_reserve(hash_table *table, size_t num)
+{
+	size_t size = __slots(table)->mask + 1;
+	size_t target = size;
+
+	while (num * 8 > target * 7)
+		target <<= 1;
+	if (target != size)
+		__resize(table, target);
+}
+
+void *hash_table_remove(hash_table *table, const char *key, size_t key_len,
+			uint16_t type)
+{
+	if (table == NULL || key == NULL)
+		return NULL;
+
+	struct __hash_slots *slots = __slots(table);
+	struct __hash_node *removed = NULL;
+	long found = __find_pos(slots, __hash(key, key_len, type), key,
+				key_len, type, &removed);
+	if (found < 0)
+		return NULL;
+
+	size_t pos = (size_t)found;
+	void *res = atomic_load_explicit(&removed->value, memory_order_relaxed);
+
+	/* backward shift：把后面的node依次前移，直到遇到空位或已在理想位置的node */
+	while (1) {
+		size_t next = (pos + 1) & slots->mask;
+		struct __hash_node *cur = __get(slots, next);
+
+		if (cur == NULL || __probe_distance(slots, next, cur->hash) == 0)
+			break;
+		__set(slots, pos, cur);
+		pos = next;
+	}
+	__set(slots, pos, NULL);
+	table->size--;
+	table->retire(removed, free);
+	return res;
+}
+
+void *hash_table_find(const hash_table *table, const char *key,
+		      size_t key_len, uint16_t type)
+{
+	if (table == NULL || key == NULL)
+		return NULL;
+
+	/* 找到后node可能已被移走，但node本身在retire前一直有效 */
+	struct __hash_node *node = NULL;
+	if (__find_pos(__slots(table), __hash(key, key_len, type), key,
+		       key_len, type, &node) < 0)
+		return NULL;
+	return atomic_load_explicit(&node->value, memory_order_acquire);
+}
+
+size_t hash_table_size(const hash_table *table)
+{
+	return table->size;
+}
+
+size_t hash_table_capacity(const hash_table *table)
+{
+	return __slots(table)->mask + 1;
+}
+
+void *hash_table_slot(const hash_table *table, size_t index, const char **key,
+		      size_t *key_len, uint16_t *type)
+{
+	struct __hash_slots *slots = __slots(table);
+	struct __hash_node *node = __get(slots, index & slots->mask);
+
+	if (node == NULL)
+		return NULL;
+
+	*key = node->key;
+	*key_len = node->key_len;
+	*type = node->type;
+	return atomic_load_explicit(&node->value, memory_order_relaxed);
+}
+
+size_t hash_table_memory(const hash_table *table)
+{
+	return sizeof(hash_table) + sizeof(struct __hash_slots) +
+	       (__slots(table)->mask + 1) * sizeof(struct __hash_node *);
+}
+
+size_t hash_table_node_size(size_t key_len)
+{
+	return sizeof(struct __hash_node) + key_len + 1;
+}
@@ -0,0 +1,114 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MODEL_HASH_TABLE_H_
+#define MODEL_HASH_TABLE_H_
+
+#include "unidef.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* 插入后除value外不再修改，读者拿到指针后可以直接访问 */
+struct __hash_node {
+	uint32_t hash;
+	uint16_t type;
+	uint16_t key_len;
+	_Atomic(void *) value;
+	char key[]; /* 小写的域名 */
+};
+
+struct __hash_slots {
+	size_t mask;
+	_Atomic(struct __hash_node *) nodes[]; /* NULL表示空位 */
+};
+
+/**
+ * 以(域名, 类型)为key的开放寻址哈希表，使用Robin Hood探测和backward shift删除。
+ * 域名不区分大小写。
+ *
+ * 修改必须互斥。每个槽位只存放一个节点指针，扩容时整体替换槽位数组，
+ * 因此hash_table_find()可以和一个写者并发执行，前提是被删除的节点和旧的槽位数组
+ * 交给retire延迟释放（见hash_table_set_retire()）。并发修改期间正在被移动的entry
+ * 可能暂时找不到，调用者需要自行判断是否重试。
+ */
+typedef struct __hash_table {
+	_Atomic(struct __hash_slots *) slots;
+	size_t size;
+	void (*retire)(void *ptr, void (*free_fn)(void *));
+} hash_table;
+
+/**
+ * @param capacity 会被向上取整为2的幂，装载因子超过7/8时自动扩容
+ */
+extern hash_table *create_hash_table(size_t capacity);
+
+/**
+ * @param free_value 用于释放表中剩余的value，可以为NULL
+ */
+extern void destroy_hash_table(hash_table *table, void (*free_value)(void *));
+
+/**
+ * 预先扩容，使插入num个key之前不再扩容
+ */
+extern void hash_table_reserve(hash_table *table, size_t num);
+
+/**
+ * 设置被删除的节点和旧槽位数组的释放方式，默认立即free
+ */
+extern void hash_table_set_retire(hash_table *table,
+				  void (*retire)(void *ptr,
+						 void (*free_fn)(void *)));
+
+/**
+ * 插入或替换
+ * @return 被替换的value，若之前不存在则返回NULL
+ */
+extern void *hash_table_insert(hash_table *table, const char *key,
+			       size_t key_len, uint16_t type, void *value);
+extern void *hash_table_remove(hash_table *table, const char *key,
+			       size_t key_len, uint16_t type);
+extern void *hash_table_find(const hash_table *table, const char *key,
+			     size_t key_len, uint16_t type);
+
+extern size_t hash_table_size(const hash_table *table);
+extern size_t hash_table_capacity(const hash_table *table);
+
+/**
+ * 按位置访问，用于遍历。插入和删除会移动entry，遍历期间修改表可能跳过或重复访问个别entry。
+ * @return 该位置为空时返回NULL
+ */
+extern void *hash_table_slot(const hash_table *table, size_t index,
+			     out const char **key, out size_t *key_len,
+			     out uint16_t *type);
+
+/* 槽位数组占用的字节数，不含节点 */
+extern size_t hash_table_memory(const hash_table *table);
+
+/* 一个节点占用的字节数 */
+extern size_t hash_table_node_size(size_t key_len);
+
+#endif /* MODEL_HASH_TABLE_H_ */
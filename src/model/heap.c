@@ -0,0 +1,144 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "heap.h"
+
+#include <stdlib.h>
+
+heap *create_heap(size_t capacity)
+{
+	heap *result = (heap *)malloc(sizeof(heap));
+	result->capacity = capacity ? capacity : 16;
+	result->size = 0;
+	result->nodes =
+		(heap_node **)malloc(result->capacity * sizeof(heap_node *));
+	return result;
+}
+
+void destroy_heap(heap *h)
+{
+	if (h == NULL)
+		return;
+
+	free(h->nodes);
+	free(h);
+}
+
+static void __set(heap *h, size_t index, heap_node *node)
+{
+	h->nodes[index] = node;
+	node->index = index;
+}
+
+static void __sift_up(heap *h, size_t index)
+{
+	heap_node *node = h->nodes[index];
+
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (h->nodes[parent]->priority <= node->priority)
+			break;
+		__set(h, index, h->nodes[parent]);
+		index = parent;
+	}
+	__set(h, index, node);
+}
+
+static void __sift_down(heap *h, size_t index)
+{
+	heap_node *node = h->nodes[index];
+
+	while (1) {
+		size_t child = index * 2 + 1;
+		if (child >= h->size)
+			break;
+		if (child + 1 < h->size &&
+		    h->nodes[child + 1]->priority < h->nodes[child]->priority)
+			child++;
+		if (node->priority <= h->nodes[child]->priority)
+			break;
+		__set(h, index, h->nodes[child]);
+		index = child;
+	}
+	__set(h, index, node);
+}
+
+void heap_push(heap *h, heap_node *node)
+{
+	if (h->size == h->capacity) {
+		h->capacity *= 2;
+		h->nodes = (heap_node **)realloc(
+			h->nodes, h->capacity * sizeof(heap_node *));
+	}
+
+	__set(h, h->size, node);
+	h->size++;
+	__sift_up(h, h->size - 1);
+}
+
+heap_node *heap_top(const heap *h)
+{
+	return h->size ? h->nodes[0] : NULL;
+}
+
+heap_node *heap_pop(heap *h)
+{
+	heap_node *res = heap_top(h);
+	if (res != NULL)
+		heap_remove(h, res);
+	return res;
+}
+
+void heap_remove(heap *h, heap_node *node)
+{
+	size_t index = node->index;
+	if (index >= h->size || h->nodes[index] != node)
+		return;
+
+	h->size--;
+	if (index != h->size) {
+		__set(h, index, h->nodes[h->size]);
+		heap_update(h, h->nodes[index]);
+	}
+	node->index = HEAP_INVALID_INDEX;
+}
+
+void heap_update(heap *h, heap_node *node)
+{
+	size_t index = node->index;
+	if (index >= h->size || h->nodes[index] != node)
+		return;
+
+	if (index > 0 &&
+	    h->nodes[(index - 1) / 2]->priority > node->priority)
+		__sift_up(h, index);
+	else
+		__sift_down(h, index);
+}
+
+size_t heap_size(const heap *h)
+{
+	return h->size;
+}
@@ -0,0 +1,74 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MODEL_HEAP_H_
+#define MODEL_HEAP_H_
+
+#include "unidef.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEAP_INVALID_INDEX ((size_t)-1)
+
+/**
+ * 嵌入到元素中的堆节点，index由堆维护，用于O(log n)删除和调整。
+ */
+typedef struct heap_node {
+	uint64_t priority;
+	size_t index;
+} heap_node;
+
+/* 最小堆，priority最小的节点在堆顶 */
+typedef struct __heap {
+	heap_node **nodes;
+	size_t size;
+	size_t capacity;
+} heap;
+
+extern heap *create_heap(size_t capacity);
+extern void destroy_heap(heap *h);
+
+extern void heap_push(heap *h, heap_node *node);
+
+/**
+ * @return 若堆为空则返回NULL
+ */
+extern heap_node *heap_top(const heap *h);
+extern heap_node *heap_pop(heap *h);
+
+/**
+ * 删除堆中任意节点，node不在堆中时什么都不做
+ */
+extern void heap_remove(heap *h, heap_node *node);
+
+/**
+ * node的priority被修改后调用，重新调整其位置
+ */
+extern void heap_update(heap *h, heap_node *node);
+
+extern size_t heap_size(const heap *h);
+
+#endif /* MODEL_HEAP_H_ */
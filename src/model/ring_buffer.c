@@ -0,0 +1,150 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _ISOC11_SOURCE
+
+#include "ring_buffer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+ring_buffer *create_ring_buffer(size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	ring_buffer *result =
+		(ring_buffer *)aligned_alloc(_Alignof(ring_buffer),
+					     sizeof(ring_buffer));
+	memset(result, 0, sizeof(ring_buffer));
+
+	result->cells = (struct __ring_cell *)malloc(
+		size * sizeof(struct __ring_cell));
+	result->mask = size - 1;
+
+	for (size_t i = 0; i < size; i++) {
+		atomic_init(&result->cells[i].sequence, i);
+		result->cells[i].value = NULL;
+	}
+
+	atomic_init(&result->enqueue_pos, 0);
+	atomic_init(&result->dequeue_pos, 0);
+	atomic_init(&result->dropped, 0);
+	return result;
+}
+
+void destroy_ring_buffer(ring_buffer *ring)
+{
+	if (ring == NULL)
+		return;
+	free(ring->cells);
+	free(ring);
+}
+
+BOOL ring_push(ring_buffer *ring, void *val)
+{
+	struct __ring_cell *cell;
+	size_t pos = atomic_load_explicit(&ring->enqueue_pos,
+					  memory_order_relaxed);
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->sequence,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &ring->enqueue_pos, &pos, pos + 1,
+				    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* 队列已满 */
+			atomic_fetch_add_explicit(&ring->dropped, 1,
+						  memory_order_relaxed);
+			return FALSE;
+		} else {
+			pos = atomic_load_explicit(&ring->enqueue_pos,
+						   memory_order_relaxed);
+		}
+	}
+
+	cell->value = val;
+	atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+	return TRUE;
+}
+
+void *ring_pop(ring_buffer *ring)
+{
+	struct __ring_cell *cell;
+	size_t pos = atomic_load_explicit(&ring->dequeue_pos,
+					  memory_order_relaxed);
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->sequence,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &ring->dequeue_pos, &pos, pos + 1,
+				    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* 队列为空 */
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring->dequeue_pos,
+						   memory_order_relaxed);
+		}
+	}
+
+	void *res = cell->value;
+	atomic_store_explicit(&cell->sequence, pos + ring->mask + 1,
+			      memory_order_release);
+	return res;
+}
+
+size_t ring_capacity(ring_buffer *ring)
+{
+	return ring->mask + 1;
+}
+
+size_t ring_size(ring_buffer *ring)
+{
+	size_t dequeue_pos = atomic_load_explicit(&ring->dequeue_pos,
+						  memory_order_relaxed);
+	size_t enqueue_pos = atomic_load_explicit(&ring->enqueue_pos,
+						  memory_order_relaxed);
+	return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
+
+size_t ring_dropped(ring_buffer *ring)
+{
+	return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,73 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2021 qwqllh
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MODEL_RING_BUFFER_H_
+#define MODEL_RING_BUFFER_H_
+
+#include "unidef.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define RING_CACHE_LINE_SIZE 64
+
+struct __ring_cell {
+	atomic_size_t sequence;
+	void *value;
+};
+
+/**
+ * 有界无锁多生产者多消费者队列（Dmitry Vyukov的算法）。
+ * 读写位置分别独占一个cache line，避免生产者和消费者之间的false sharing。
+ */
+typedef struct __ring_buffer {
+	struct __ring_cell *cells;
+	size_t mask;
+	_Alignas(RING_CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+	_Alignas(RING_CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+	_Alignas(RING_CACHE_LINE_SIZE) atomic_size_t dropped;
+} ring_buffer;
+
+/**
+ * @param capacity 会被向上取整为2的幂
+ */
+extern ring_buffer *create_ring_buffer(size_t capacity);
+extern void destroy_ring_buffer(ring_buffer *ring);
+
+/**
+ * @return 若队列已满则返回FALSE，并计入dropped
+ */
+extern BOOL ring_push(ring_buffer *ring, void *val);
+
+/**
+ * @return 若队列为空则返回NULL
+ */
+extern void *ring_pop(ring_buffer *ring);
+
+extern size_t ring_capacity(ring_buffer *ring);
+extern size_t ring_size(ring_buffer *ring);
+extern size_t ring_dropped(ring_buffer *ring);
+
+#endif /* MODEL_RING_BUFFER_H_ */
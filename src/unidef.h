@@ -62,7 +62,8 @@
 #define sleepms(msec) usleep((msec)*1000)
 #endif
 
-#define RAW_DATA_MAX_SIZE 1024
+/* 回复的最大长度，超出时（只可能来自TCP）截断后回复客户端 */
+#define RAW_DATA_MAX_SIZE 4096
 #define DOMAIN_NAME_MAX_LENGTH 128
 
 #define GET_TYPE_PTR_TYPE(ptr) (ntohs(*(uint16_t *)(ptr)))